@@ -15,11 +15,14 @@
 // Memory allocation config
 #define PAGE_SIZE 0x1000
 #define VMA_START PAGE_SIZE
+#define KERNEL_VMA_START 0xFFFFA00000000000 // Kernel heap, lives in the shared higher half
+#define KSTACK_REGION_START 0xFFFFB00000000000 // Per-task kernel stacks, see proc/kstack.c
 
 // Misc
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define BIT(x) (1U << (x))
 #define FINAL_DEBUG 0
+#define EXIT_STRESS 0 // Boot into a user process spawn/exit loop instead of init, see exit_stress()
 
 #endif // CONFIG_H
\ No newline at end of file
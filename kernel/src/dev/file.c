@@ -0,0 +1,182 @@
+#include <dev/file.h>
+#include <sys/syscall.h>
+#include <mm/kmalloc.h>
+#include <lib/memory.h>
+#include <util/errno.h>
+
+file_t *file_open(vnode_t *node, uint64_t flags)
+{
+    file_t *file = (file_t *)kmalloc(sizeof(file_t));
+    if (!file)
+        return NULL;
+
+    memset(file, 0, sizeof(file_t));
+    spinlock_init(&file->lock);
+    file->node = node;
+    file->flags = flags;
+    file->refcount = 1;
+    if (node->ops && node->ops->open && node->ops->open(node) < 0)
+    {
+        kfree(file);
+        return NULL;
+    }
+    return file;
+}
+
+file_t *file_get(file_t *file)
+{
+    spinlock_acquire(&file->lock);
+    file->refcount++;
+    spinlock_release(&file->lock);
+    return file;
+}
+
+void file_put(file_t *file)
+{
+    if (!file)
+        return;
+
+    spinlock_acquire(&file->lock);
+    bool last = --file->refcount == 0;
+    spinlock_release(&file->lock);
+    if (!last)
+        return;
+
+    if (file->node->ops && file->node->ops->release)
+        file->node->ops->release(file->node);
+    kfree(file);
+}
+
+// There is no lock held across the transfer itself, so concurrent readers of one description
+// may get the same bytes. Each call still moves the position by what it transferred.
+int file_read(file_t *file, void *buf, size_t size)
+{
+    spinlock_acquire(&file->lock);
+    uint64_t pos = file->pos;
+    spinlock_release(&file->lock);
+
+    int ret = vfs_read(file->node, buf, size, pos);
+    if (ret > 0)
+    {
+        spinlock_acquire(&file->lock);
+        file->pos = pos + ret;
+        spinlock_release(&file->lock);
+    }
+    return ret;
+}
+
+int file_write(file_t *file, const void *buf, size_t size)
+{
+    spinlock_acquire(&file->lock);
+    uint64_t pos = (file->flags & O_APPEND) ? file->node->size : file->pos;
+    spinlock_release(&file->lock);
+
+    int ret = vfs_write(file->node, buf, size, pos);
+    if (ret > 0)
+    {
+        spinlock_acquire(&file->lock);
+        file->pos = pos + ret;
+        spinlock_release(&file->lock);
+    }
+    return ret;
+}
+
+int file_readv(file_t *file, const iovec_t *iov, int iovcnt)
+{
+    spinlock_acquire(&file->lock);
+    uint64_t pos = file->pos;
+    spinlock_release(&file->lock);
+
+    int ret = vfs_readv(file->node, iov, iovcnt, pos);
+    if (ret > 0)
+    {
+        spinlock_acquire(&file->lock);
+        file->pos = pos + ret;
+        spinlock_release(&file->lock);
+    }
+    return ret;
+}
+
+int file_writev(file_t *file, const iovec_t *iov, int iovcnt)
+{
+    spinlock_acquire(&file->lock);
+    uint64_t pos = (file->flags & O_APPEND) ? file->node->size : file->pos;
+    spinlock_release(&file->lock);
+
+    int ret = vfs_writev(file->node, iov, iovcnt, pos);
+    if (ret > 0)
+    {
+        spinlock_acquire(&file->lock);
+        file->pos = pos + ret;
+        spinlock_release(&file->lock);
+    }
+    return ret;
+}
+
+// Moves `size` bytes from `in` to `out` with vfs_splice(). Either side goes from its
+// `*offset` (updated) if given, or from its file position (advanced) otherwise.
+int file_splice(file_t *in, uint64_t *in_offset, file_t *out, uint64_t *out_offset, size_t size)
+{
+    spinlock_acquire(&in->lock);
+    uint64_t src = in_offset ? *in_offset : in->pos;
+    spinlock_release(&in->lock);
+
+    spinlock_acquire(&out->lock);
+    uint64_t dst = out_offset ? *out_offset : ((out->flags & O_APPEND) ? out->node->size : out->pos);
+    spinlock_release(&out->lock);
+
+    int ret = vfs_splice(in->node, src, out->node, dst, size);
+    if (ret <= 0)
+        return ret;
+
+    if (in_offset)
+        *in_offset = src + ret;
+    else
+    {
+        spinlock_acquire(&in->lock);
+        in->pos = src + ret;
+        spinlock_release(&in->lock);
+    }
+
+    if (out_offset)
+        *out_offset = dst + ret;
+    else
+    {
+        spinlock_acquire(&out->lock);
+        out->pos = dst + ret;
+        spinlock_release(&out->lock);
+    }
+    return ret;
+}
+
+// Seeking past the end is fine, a write there grows the file
+int64_t file_seek(file_t *file, int64_t offset, int whence)
+{
+    spinlock_acquire(&file->lock);
+    int64_t base;
+    switch (whence)
+    {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = file->pos;
+        break;
+    case SEEK_END:
+        base = file->node->size;
+        break;
+    default:
+        spinlock_release(&file->lock);
+        return -EINVAL;
+    }
+
+    // Checked before anything changes, a failed seek leaves the position alone
+    if (base < 0 || (offset > 0 && base > INT64_MAX - offset) || base + offset < 0)
+    {
+        spinlock_release(&file->lock);
+        return -EINVAL;
+    }
+    file->pos = base + offset;
+    spinlock_release(&file->lock);
+    return base + offset;
+}
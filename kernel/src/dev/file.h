@@ -0,0 +1,35 @@
+#ifndef DEV_FILE_H
+#define DEV_FILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <dev/vfs.h>
+#include <lib/spinlock.h>
+
+// lseek() whence
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+// Open-file description: what a descriptor refers to. dup'ed and inherited descriptors share
+// one, position included.
+typedef struct file
+{
+    vnode_t *node;
+    uint64_t pos;      // Where read() and write() pick up
+    uint64_t flags;    // O_* flags given to open()
+    uint64_t refcount; // Descriptor slots, plus calls using it right now
+    spinlock_t lock;   // pos
+} file_t;
+
+file_t *file_open(vnode_t *node, uint64_t flags);
+file_t *file_get(file_t *file);
+void file_put(file_t *file);
+int file_read(file_t *file, void *buf, size_t size);
+int file_write(file_t *file, const void *buf, size_t size);
+int file_readv(file_t *file, const iovec_t *iov, int iovcnt);
+int file_writev(file_t *file, const iovec_t *iov, int iovcnt);
+int64_t file_seek(file_t *file, int64_t offset, int whence);
+int file_splice(file_t *in, uint64_t *in_offset, file_t *out, uint64_t *out_offset, size_t size);
+
+#endif // DEV_FILE_H
@@ -4,9 +4,12 @@
 #include <sys/intr.h>
 #include <sys/pic.h>
 #include <fs/devfs.h>
+#include <proc/wait.h>
 
-static volatile uint8_t last_scancode = 0;
-static volatile uint8_t has_scancode = 0;
+static volatile uint8_t kbd_buffer[KBD_BUFFER_SIZE];
+static volatile uint64_t kbd_head = 0; // Written by IRQ1
+static volatile uint64_t kbd_tail = 0; // Written by readers
+static wait_queue_t kbd_wait = WAIT_QUEUE_INIT;
 
 static inline void wait_for_write(void)
 {
@@ -37,15 +40,12 @@ void kbd_handler(struct register_ctx *)
 {
     uint8_t scancode = kbd_read_scancode();
 
-    if (scancode == KBD_ACK)
+    // Drop ACKs, and new scancodes once the buffer is full
+    if (scancode != KBD_ACK && kbd_head - kbd_tail < KBD_BUFFER_SIZE)
     {
-        last_scancode = 0;
-        has_scancode = 0;
-    }
-    else
-    {
-        last_scancode = scancode;
-        has_scancode = 1;
+        kbd_buffer[kbd_head % KBD_BUFFER_SIZE] = scancode;
+        kbd_head++;
+        wake_up(&kbd_wait);
     }
 
     pic_eoi(1);
@@ -84,19 +84,18 @@ void kbd_init(void)
 // ---- HANDLE /dev/ps2kb* ----
 int kbd_read(void *out, size_t size, size_t)
 {
-    if (has_scancode)
-    {
-        if (size >= sizeof(last_scancode))
-        {
-            *(uint8_t *)out = last_scancode;
-            has_scancode = 0;
-        }
-        return sizeof(last_scancode);
-    }
-    else
+    // Sleep until IRQ1 delivers a scancode
+    int ret = wait_event(&kbd_wait, kbd_head != kbd_tail);
+    if (ret < 0)
+        return ret;
+
+    size_t read = 0;
+    while (read < size && kbd_tail != kbd_head)
     {
-        return -1;
+        ((uint8_t *)out)[read++] = kbd_buffer[kbd_tail % KBD_BUFFER_SIZE];
+        kbd_tail++;
     }
+    return read;
 }
 
 // Unused
@@ -18,6 +18,8 @@
 #define KBD_ACK 0xFA
 #define KBD_RESEND 0xFE
 
+#define KBD_BUFFER_SIZE 128 // Scancodes buffered between IRQ1 and readers
+
 void kbd_init(void);
 void kbd_register_fs(const char *name);
 
@@ -0,0 +1,90 @@
+#include <dev/serial.h>
+#include <dev/portio.h>
+#include <lib/log.h>
+#include <sys/intr.h>
+#include <sys/pic.h>
+#include <fs/devfs.h>
+#include <proc/wait.h>
+#include <proc/preempt.h>
+
+static uint16_t serial_port = 0;
+static volatile uint8_t serial_buffer[SERIAL_BUFFER_SIZE];
+static volatile uint64_t serial_head = 0; // Written by the IRQ
+static volatile uint64_t serial_tail = 0; // Written by readers
+static wait_queue_t serial_wait = WAIT_QUEUE_INIT;
+
+void serial_handler(struct register_ctx *)
+{
+    while (inb(serial_port + SERIAL_REG_LSR) & SERIAL_LSR_DATA_READY)
+    {
+        uint8_t c = inb(serial_port + SERIAL_REG_DATA);
+        if (serial_head - serial_tail < SERIAL_BUFFER_SIZE)
+        {
+            serial_buffer[serial_head % SERIAL_BUFFER_SIZE] = c;
+            serial_head++;
+        }
+    }
+
+    wake_up(&serial_wait);
+    pic_eoi(SERIAL_IRQ);
+}
+
+// Thanks osdev wiki
+void serial_init(uint16_t port)
+{
+    serial_port = port;
+    outb(port + SERIAL_REG_IER, 0x00); // Disable all interrupts
+    outb(port + SERIAL_REG_LCR, 0x80); // Enable DLAB (set baud rate divisor)
+    outb(port + 0, 0x03);              // Set divisor to 3 (lo byte) 38400 baud
+    outb(port + 1, 0x00);              //                  (hi byte)
+    outb(port + SERIAL_REG_LCR, 0x03); // 8 bits, no parity, one stop bit
+    outb(port + SERIAL_REG_FCR, 0xC7); // Enable FIFO, clear them, with 14-byte threshold
+    outb(port + SERIAL_REG_MCR, 0x0B); // IRQs enabled, RTS/DSR set
+    outb(port + SERIAL_REG_MCR, 0x1E); // Set in loopback mode, test the serial chip
+    outb(port + SERIAL_REG_DATA, 0xAE); // Test serial chip (send byte 0xAE and check if serial returns same byte)
+
+    // Check if serial is faulty (i.e: not same byte as sent)
+    if (inb(port + SERIAL_REG_DATA) != 0xAE)
+    {
+        warning("It looks like port: 0x%x (some COM port), is faulty. But yolo", port);
+    }
+    outb(port + SERIAL_REG_MCR, 0x0F);
+
+    // Interrupt on received data, readers sleep until then
+    idt_register_handler(IDT_IRQ_BASE + SERIAL_IRQ, serial_handler);
+    outb(port + SERIAL_REG_IER, 0x01);
+    pic_unmask(SERIAL_IRQ);
+}
+
+// ---- HANDLE /dev/ttyS* ----
+int serial_read(void *out, size_t size, size_t)
+{
+    int ret = wait_event(&serial_wait, serial_head != serial_tail);
+    if (ret < 0)
+        return ret;
+
+    size_t read = 0;
+    while (read < size && serial_tail != serial_head)
+    {
+        ((uint8_t *)out)[read++] = serial_buffer[serial_tail % SERIAL_BUFFER_SIZE];
+        serial_tail++;
+    }
+    return read;
+}
+
+int serial_write(const void *buf, size_t size, size_t)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        while (!(inb(serial_port + SERIAL_REG_LSR) & SERIAL_LSR_THR_EMPTY))
+            ;
+        outb(serial_port + SERIAL_REG_DATA, ((const uint8_t *)buf)[i]);
+        cond_resched(); // ~260us per byte at 38400 baud (divisor 3), big writes take a while
+    }
+    return size;
+}
+
+void serial_register_fs(const char *name)
+{
+    devfs_add_dev(name, serial_read, serial_write);
+}
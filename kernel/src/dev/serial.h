@@ -0,0 +1,23 @@
+#ifndef DEV_SERIAL_H
+#define DEV_SERIAL_H
+
+#include <stdint.h>
+
+#define SERIAL_IRQ 4 // COM1
+#define SERIAL_BUFFER_SIZE 256
+
+// Register offsets from the port base
+#define SERIAL_REG_DATA 0
+#define SERIAL_REG_IER 1
+#define SERIAL_REG_FCR 2
+#define SERIAL_REG_LCR 3
+#define SERIAL_REG_MCR 4
+#define SERIAL_REG_LSR 5
+
+#define SERIAL_LSR_DATA_READY (1 << 0)
+#define SERIAL_LSR_THR_EMPTY (1 << 5)
+
+void serial_init(uint16_t port);
+void serial_register_fs(const char *name);
+
+#endif // DEV_SERIAL_H
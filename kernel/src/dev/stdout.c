@@ -3,6 +3,7 @@
 #include <lib/assert.h>
 #include <fs/devfs.h>
 #include <dev/portio.h>
+#include <proc/preempt.h>
 
 vnode_t *stdout;
 
@@ -23,6 +24,7 @@ int write(const void *buf, size_t size, size_t)
 
         // Always write to com, should be initialized (hopefully)
         outb(DEFAULT_COM_PORT, *(char *)((uint8_t *)buf + i));
+        cond_resched();
     }
 
     return size;
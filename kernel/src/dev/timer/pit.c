@@ -4,30 +4,141 @@
 #include <lib/log.h>
 #include <sys/intr.h>
 #include <proc/scheduler.h>
+#include <sys/timer.h>
+#include <sys/vdso.h>
+#include <stdbool.h>
+
+static volatile uint64_t pit_clock = 0; // PIT input clocks elapsed since pit_init()
+static uint16_t pit_reload = 0;         // Count currently programmed into channel 0
+static bool pit_running = false;
+static bool pit_periodic = false;
+static bool pit_pending = false;   // One-shot armed and not fired yet
+static bool pit_fired = false;     // One-shot fired, the counter keeps going down from 0x10000
+static uint64_t pit_deadline = 0;  // What the pending one-shot was armed for, see pit_set_oneshot()
+static uint64_t pit_last_ns = 0;
+
+static uint16_t pit_read_count()
+{
+    outb(PIT_IO_COMMAND, 0x00); // Latch channel 0
+    uint8_t lo = inb(PIT_IO_CHANNEL0);
+    uint8_t hi = inb(PIT_IO_CHANNEL0);
+    return (uint16_t)((hi << 8) | lo);
+}
+
+static void pit_program(uint8_t mode, uint16_t count)
+{
+    outb(PIT_IO_COMMAND, mode);
+    outb(PIT_IO_CHANNEL0, count & 0xFF);
+    outb(PIT_IO_CHANNEL0, (count >> 8) & 0xFF);
+    pit_reload = count;
+}
+
+// Clocks counted since the one-shot fired. Mode 0 keeps counting down past terminal count,
+// wrapping around, so this is the interrupt latency plus whatever ran since.
+static uint16_t pit_since_fired(uint16_t left)
+{
+    return (uint16_t)(0x10000 - left);
+}
+
+// When a one-shot gets replaced, account for the part of it that already elapsed, pending or
+// past its terminal count.
+static void pit_account_partial()
+{
+    if (pit_periodic || (!pit_pending && !pit_fired))
+        return;
+
+    uint16_t left = pit_read_count();
+    if (pit_fired)
+        pit_clock += pit_since_fired(left);
+    else if (left <= pit_reload)
+        pit_clock += pit_reload - left;
+    pit_pending = false;
+    pit_fired = false;
+}
 
 void pit_handler(struct register_ctx *frame)
 {
-    scheduler_tick(frame);
+    (void)frame;
+    pit_clock += pit_reload;
+    if (!pit_periodic)
+    {
+        // Time keeps running off the counter until it gets reprogrammed
+        pit_pending = false;
+        pit_fired = true;
+    }
+    timer_run(pit_get_ns());
+    vdso_update_time();
+
+    // Acknowledge first, the tick may switch tasks on the way out of the interrupt
     pic_eoi(0);
+    scheduler_tick();
 }
 
-void pit_init()
+void pit_set_periodic()
 {
-    // Setup channel 0 at mode 3 (lohi)
-    outb(0x43, 0x36);
-    trace("Setup chanel 0 to mode 3 (LOHI)");
+    if (!pit_running || pit_periodic)
+        return;
 
+    pit_account_partial();
+    pit_program(0x34, PIT_DIVISOR); // Channel 0, lohi, mode 2 (rate generator, counts down by one so it can be read back)
+    pit_periodic = true;
+}
+
+// Interrupt once at the absolute monotonic time `deadline_ns`, or after PIT_ONESHOT_MAX_NS if
+// that is further out. Every reprogram is a few port writes (each a VM exit under
+// virtualization), so a one-shot already armed for the same deadline is left alone.
+void pit_set_oneshot(uint64_t deadline_ns)
+{
+    if (!pit_running || (!pit_periodic && pit_pending && pit_deadline == deadline_ns))
+        return;
+
+    uint64_t now = pit_get_ns();
+    uint64_t ns = deadline_ns > now ? deadline_ns - now : 0;
+    uint64_t count = PIT_MAX_COUNT;
+    if (ns < PIT_ONESHOT_MAX_NS)
+        count = MAX(ns * PIT_FREQUENCY / 1000000000ull, 1);
+
+    pit_account_partial();
+    pit_program(0x30, (uint16_t)count); // Channel 0, lohi, mode 0 (interrupt on terminal count)
+    pit_periodic = false;
+    pit_pending = true;
+    pit_deadline = deadline_ns;
+}
+
+// Monotonic time since pit_init()
+uint64_t pit_get_ns()
+{
+    uint64_t clock = pit_clock;
+    if (pit_running && (pit_periodic || pit_pending))
+    {
+        uint16_t left = pit_read_count();
+        if (left <= pit_reload)
+            clock += pit_reload - left;
+    }
+    else if (pit_running && pit_fired)
+    {
+        clock += pit_since_fired(pit_read_count());
+    }
+
+    uint64_t ns = clock / PIT_FREQUENCY * 1000000000ull + clock % PIT_FREQUENCY * 1000000000ull / PIT_FREQUENCY;
+
+    // The counter already reloaded but the IRQ is still pending (interrupts are off), don't go backwards
+    if (ns < pit_last_ns)
+        ns = pit_last_ns;
+    pit_last_ns = ns;
+    return ns;
+}
+
+void pit_init()
+{
     // Register our IRQ0 handller (aka the pit handler)
     idt_register_handler(IDT_IRQ_BASE + 0, pit_handler);
 
-    // Setup the divisor
-    uint16_t divisor = 5966; // ~200Hz
-    outb(0x40, divisor & 0xFF);
-    trace("Devisor thing 1");
-    outb(0x40, (divisor >> 8) & 0xFF);
-    trace("Devisor thing 2");
-    trace("Set divisor to %d", divisor);
+    // Setup channel 0 at mode 2 (lohi), the scheduler drops to one-shot mode once it has nothing to preempt
+    pit_running = true;
+    pit_set_periodic();
+    trace("Set channel 0 to mode 2 (LOHI), divisor %d", PIT_DIVISOR);
 
     // unmask the IRQ0
     pic_unmask(0);
-}
\ No newline at end of file
+}
@@ -3,6 +3,17 @@
 
 #include <stdint.h>
 
+#define PIT_IO_CHANNEL0 0x40
+#define PIT_IO_COMMAND 0x43
+
+#define PIT_FREQUENCY 1193182 // Input clock, in Hz
+#define PIT_DIVISOR 5966      // ~200Hz periodic tick
+#define PIT_MAX_COUNT 0xFFFF
+#define PIT_ONESHOT_MAX_NS ((uint64_t)PIT_MAX_COUNT * 1000000000ull / PIT_FREQUENCY) // ~54.9ms
+
 void pit_init();
+void pit_set_periodic();
+void pit_set_oneshot(uint64_t deadline_ns);
+uint64_t pit_get_ns();
 
-#endif // DEV_TIMER_PIT_H
\ No newline at end of file
+#endif // DEV_TIMER_PIT_H
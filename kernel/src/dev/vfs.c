@@ -5,8 +5,10 @@
 #include <lib/assert.h>
 #include <lib/spinlock.h>
 #include <dev/time/rtc.h>
+#include <proc/data/elf.h>
 
 mount_t *root_mount = NULL;
+splice_stats_t splice_stats = {0};
 
 void vfs_init(void)
 {
@@ -230,7 +232,13 @@ int vfs_write(vnode_t *vnode, const void *buf, size_t size, size_t offset)
 
     if (vnode->ops && vnode->ops->write)
     {
-        int ret = vnode->ops->write(vnode, buf, size, offset);
+        // Also keeps exec() off the file until the write is through
+        int ret = elf_cache_write_begin(vnode);
+        if (ret == 0)
+        {
+            ret = vnode->ops->write(vnode, buf, size, offset);
+            elf_cache_write_end(vnode);
+        }
         spinlock_release(&vnode->lock);
         if (vnode)
             vnode->modify_time = GET_CURRENT_UNIX_TIME(); // Quick, easy, and dirty fix.
@@ -242,6 +250,195 @@ int vfs_write(vnode_t *vnode, const void *buf, size_t size, size_t offset)
     return -1;
 }
 
+// Segment by segment through read(), stops at the first short or failed one
+static int vfs_readv_fallback(vnode_t *vnode, const iovec_t *iov, int iovcnt, size_t offset)
+{
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len == 0)
+            continue;
+
+        int ret = vnode->ops->read(vnode, iov[i].iov_base, iov[i].iov_len, offset + total);
+        if (ret < 0)
+            return total ? total : ret;
+        total += ret;
+        if ((size_t)ret < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+static int vfs_writev_fallback(vnode_t *vnode, const iovec_t *iov, int iovcnt, size_t offset)
+{
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len == 0)
+            continue;
+
+        int ret = vnode->ops->write(vnode, iov[i].iov_base, iov[i].iov_len, offset + total);
+        if (ret < 0)
+            return total ? total : ret;
+        total += ret;
+        if ((size_t)ret < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+// Reads into `iovcnt` buffers back to back, starting at `offset`
+int vfs_readv(vnode_t *vnode, const iovec_t *iov, int iovcnt, size_t offset)
+{
+    spinlock_acquire(&vnode->lock);
+
+    if (!vnode || vnode->type == VNODE_DIR)
+    {
+        error("Invalid vnode or unsupported type: %s", vfs_type_to_str(vnode->type));
+        spinlock_release(&vnode->lock);
+        return -1;
+    }
+
+    if (vnode->ops && (vnode->ops->readv || vnode->ops->read))
+    {
+        int ret = vnode->ops->readv ? vnode->ops->readv(vnode, iov, iovcnt, offset) : vfs_readv_fallback(vnode, iov, iovcnt, offset);
+        spinlock_release(&vnode->lock);
+        return ret;
+    }
+
+    error("Read operation not implemented for vnode '%s'", vnode->name);
+    spinlock_release(&vnode->lock);
+    return -1;
+}
+
+// Writes `iovcnt` buffers back to back, starting at `offset`
+int vfs_writev(vnode_t *vnode, const iovec_t *iov, int iovcnt, size_t offset)
+{
+    spinlock_acquire(&vnode->lock);
+
+    if (!vnode || vnode->type == VNODE_DIR)
+    {
+        error("Invalid vnode or unsupported type: %s", vfs_type_to_str(vnode->type));
+        spinlock_release(&vnode->lock);
+        return -1;
+    }
+
+    if (vnode->ops && (vnode->ops->writev || vnode->ops->write))
+    {
+        int ret = elf_cache_write_begin(vnode);
+        if (ret == 0)
+        {
+            ret = vnode->ops->writev ? vnode->ops->writev(vnode, iov, iovcnt, offset) : vfs_writev_fallback(vnode, iov, iovcnt, offset);
+            elf_cache_write_end(vnode);
+        }
+        spinlock_release(&vnode->lock);
+        vnode->modify_time = GET_CURRENT_UNIX_TIME();
+        return ret;
+    }
+
+    error("Write operation not implemented for vnode '%s'", vnode->name);
+    spinlock_release(&vnode->lock);
+    return -1;
+}
+
+typedef struct vfs_splice_ctx
+{
+    vnode_t *dst;
+    size_t offset;
+} vfs_splice_ctx_t;
+
+static int vfs_splice_actor(void *ctx, const void *buf, size_t size)
+{
+    vfs_splice_ctx_t *splice = (vfs_splice_ctx_t *)ctx;
+    int ret = vfs_write(splice->dst, buf, size, splice->offset);
+    if (ret > 0)
+        splice->offset += ret;
+    return ret;
+}
+
+// Moves `size` bytes from `src` to `dst` without leaving the kernel. Straight out of the
+// source's storage if it can hand that out and the destination can't, so the two vnode locks
+// are only ever nested in that order. Through a bounce buffer otherwise, and always for
+// destinations with slow writes: those would run with the source's lock held, unpreemptible.
+int vfs_splice(vnode_t *src, size_t src_offset, vnode_t *dst, size_t dst_offset, size_t size)
+{
+    if (!src || !dst || src->type == VNODE_DIR || dst->type == VNODE_DIR)
+    {
+        error("Invalid vnode passed to vfs_splice");
+        return -1;
+    }
+
+    if (src->ops && src->ops->splice_read && dst->ops && !dst->ops->splice_read && !(dst->flags & VNODE_FLAG_SLOW_WRITE))
+    {
+        vfs_splice_ctx_t ctx = {.dst = dst, .offset = dst_offset};
+        spinlock_acquire(&src->lock);
+        int ret = src->ops->splice_read(src, src_offset, size, vfs_splice_actor, &ctx);
+        spinlock_release(&src->lock);
+        if (ret > 0)
+            splice_stats.direct += ret;
+        return ret;
+    }
+
+    void *buf = kmalloc(MIN(size, VFS_SPLICE_CHUNK));
+    if (!buf)
+        return -1;
+
+    int total = 0;
+    while ((size_t)total < size)
+    {
+        size_t chunk = MIN(size - total, VFS_SPLICE_CHUNK);
+        int got = vfs_read(src, buf, chunk, src_offset + total);
+        if (got <= 0)
+        {
+            total = total ? total : got;
+            break;
+        }
+
+        int put = vfs_write(dst, buf, got, dst_offset + total);
+        if (put <= 0)
+        {
+            total = total ? total : put;
+            break;
+        }
+        total += put;
+        if (put < got || (size_t)got < chunk)
+            break;
+    }
+
+    kfree(buf);
+    if (total > 0)
+        splice_stats.bounced += total;
+    return total;
+}
+
+int vfs_truncate(vnode_t *vnode, size_t size)
+{
+    spinlock_acquire(&vnode->lock);
+    if (!vnode || vnode->type == VNODE_DIR)
+    {
+        error("Invalid vnode or unsupported type: %s", vfs_type_to_str(vnode->type));
+        spinlock_release(&vnode->lock);
+        return -1;
+    }
+
+    if (vnode->ops && vnode->ops->truncate)
+    {
+        int ret = elf_cache_write_begin(vnode);
+        if (ret == 0)
+        {
+            ret = vnode->ops->truncate(vnode, size);
+            elf_cache_write_end(vnode);
+        }
+        spinlock_release(&vnode->lock);
+        vnode->modify_time = GET_CURRENT_UNIX_TIME();
+        return ret;
+    }
+
+    error("Truncate operation not implemented for vnode '%s'", vnode->name);
+    spinlock_release(&vnode->lock);
+    return -1;
+}
+
 int vfs_chown(vnode_t *vnode, uint32_t uid)
 {
     spinlock_acquire(&vnode->lock);
@@ -327,6 +524,7 @@ void vfs_delete_node(vnode_t *vnode)
     }
 
     trace("Deleting vnode '%s' (%s)", vnode->name, vfs_type_to_str(vnode->type));
+    elf_cache_invalidate(vnode);
 
     if (vnode->name)
     {
@@ -370,6 +568,7 @@ vnode_t *vfs_lazy_lookup(mount_t *mount, const char *path)
         }
         name_buffer[i] = '\0';
 
+        cond_resched();
         current_vnode = vfs_lookup(current_vnode, name_buffer);
         if (!current_vnode)
         {
@@ -420,6 +619,7 @@ vnode_t *vfs_lazy_lookup_last(mount_t *mount, const char *path)
         }
         name_buffer[i] = '\0';
 
+        cond_resched();
         vnode_t *next_vnode = vfs_lookup(current_vnode, name_buffer);
         if (!next_vnode)
         {
@@ -541,6 +741,8 @@ char *vfs_type_to_str(vnode_type_t type)
         return "DIR";
     case VNODE_DEV:
         return "DEV";
+    case VNODE_PIPE:
+        return "PIPE";
     default:
         return "UNKNOWN";
     }
@@ -13,10 +13,12 @@ typedef enum
     VNODE_DIR = 0x0001,
     VNODE_FILE = 0x0002,
     VNODE_DEV = 0x0003,
+    VNODE_PIPE = 0x0004,
 } vnode_type_t;
 
 /* Flags and permission modes */
 #define VNODE_FLAG_MOUNTPOINT 0x0001
+#define VNODE_FLAG_SLOW_WRITE 0x0002 // Writes may sleep or take long, never done under another vnode's lock
 
 #define VNODE_MODE_RUSR 0x0100 // Read permission for the owner
 #define VNODE_MODE_WUSR 0x0080 // Write permission for the owner
@@ -30,14 +32,46 @@ typedef enum
 #define VNODE_MODE_WOTH 0x0002 // Write permission for others
 #define VNODE_MODE_XOTH 0x0001 // Execute permission for others
 
+#define IOV_MAX 1024           // Segments per readv()/writev()
+#define VFS_SPLICE_CHUNK 0x10000 // Bounce buffer of vfs_splice(), for sources without splice_read
+
 struct vnode;
 struct mount;
+struct vma_region;
+
+/* One segment of a vectored transfer */
+typedef struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+} iovec_t;
+
+/* Consumer of a vnode's own storage, see vnode_ops_t.splice_read. Returns what it took. */
+typedef int (*splice_actor_t)(void *ctx, const void *buf, size_t size);
 
 /* Operations on vnodes */
 typedef struct vnode_ops
 {
     int (*read)(struct vnode *vnode, void *buf, size_t size, size_t offset);
     int (*write)(struct vnode *vnode, const void *buf, size_t size, size_t offset);
+    // Optional, the whole vector in one call. Without them vfs_readv()/vfs_writev() fall
+    // back to read()/write() per segment.
+    int (*readv)(struct vnode *vnode, const iovec_t *iov, int iovcnt, size_t offset);
+    int (*writev)(struct vnode *vnode, const iovec_t *iov, int iovcnt, size_t offset);
+    // Optional, hands the file's storage from `offset` on to `actor` piece by piece, with no
+    // copy in between. Runs under the vnode lock, `actor` may only take locks of vnodes that
+    // don't implement this themselves, and must neither sleep nor take long.
+    int (*splice_read)(struct vnode *vnode, size_t offset, size_t size, splice_actor_t actor, void *ctx);
+    // Optional, a new open-file description of the node, see file_open()
+    int (*open)(struct vnode *vnode);
+    // Optional, an open-file description of the node went away (its last descriptor closed)
+    void (*release)(struct vnode *vnode);
+    // Optional, sets the file's size, dropping or zero-filling what changes
+    int (*truncate)(struct vnode *vnode, size_t size);
+    // Optional, backs `region` with the node's pages from `region->pgoff` on, by filling in
+    // its ops and data, or refuses it. `region` is not in any address space yet, so a failure
+    // changes nothing. Runs without the vnode lock.
+    int (*mmap)(struct vnode *vnode, struct vma_region *region);
     struct vnode *(*create)(struct vnode *self, const char *name, vnode_type_t type);
     int (*ioctl)(struct vnode *vnode, uint32_t cmd, uint32_t arg);
 } vnode_ops_t;
@@ -68,6 +102,7 @@ typedef struct vnode
 
     vnode_ops_t *ops;
     uint32_t flags;
+    uint32_t writers; // Writes and truncates in progress, exec() fails meanwhile (see elf.c)
 
     spinlock_t lock;
 } vnode_t;
@@ -83,6 +118,13 @@ typedef struct mount
     void *data;
 } mount_t;
 
+/* Bytes moved by vfs_splice() */
+typedef struct splice_stats
+{
+    uint64_t direct;  // Straight from the source's storage
+    uint64_t bounced; // Through a kernel buffer
+} splice_stats_t;
+
 /* For syscalls */
 typedef struct stat
 {
@@ -95,6 +137,7 @@ typedef struct stat
 } stat_t;
 
 extern mount_t *root_mount;
+extern splice_stats_t splice_stats;
 
 void vfs_init(void);
 vnode_t *vfs_lookup(vnode_t *parent, const char *name);
@@ -103,6 +146,10 @@ vnode_t *vfs_create_vnode(vnode_t *parent, const char *name, vnode_type_t type);
 void vfs_umount(mount_t *mount);
 int vfs_read(vnode_t *vnode, void *buf, size_t size, size_t offset);
 int vfs_write(vnode_t *vnode, const void *buf, size_t size, size_t offset);
+int vfs_readv(vnode_t *vnode, const iovec_t *iov, int iovcnt, size_t offset);
+int vfs_writev(vnode_t *vnode, const iovec_t *iov, int iovcnt, size_t offset);
+int vfs_splice(vnode_t *src, size_t src_offset, vnode_t *dst, size_t dst_offset, size_t size);
+int vfs_truncate(vnode_t *vnode, size_t size);
 int vfs_chown(vnode_t *vnode, uint32_t uid);
 int vfs_chmod(vnode_t *vnode, uint32_t mode);
 vnode_t *vfs_lazy_lookup(mount_t *mount, const char *path);
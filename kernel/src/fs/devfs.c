@@ -13,16 +13,24 @@ typedef struct dev
     int (*write)(const void *buf, size_t size, size_t offset);
 } dev_t;
 
+// Devices keep their own state and may sleep (e.g. waiting for input) or take a while, so
+// the vnode isn't kept locked while they run
 int devfs_read(vnode_t *vnode, void *buf, size_t size, size_t offset)
 {
-    (void)vnode;
-    return ((dev_t *)vnode->data)->read(buf, size, offset);
+    dev_t *dev = vnode->data;
+    spinlock_release(&vnode->lock);
+    int ret = dev->read(buf, size, offset);
+    spinlock_acquire(&vnode->lock);
+    return ret;
 }
 
 int devfs_write(vnode_t *vnode, const void *buf, size_t size, size_t offset)
 {
-    (void)vnode;
-    return ((dev_t *)vnode->data)->write(buf, size, offset);
+    dev_t *dev = vnode->data;
+    spinlock_release(&vnode->lock);
+    int ret = dev->write(buf, size, offset);
+    spinlock_acquire(&vnode->lock);
+    return ret;
 }
 
 struct vnode *devfs_create(vnode_t *self, const char *name, vnode_type_t type)
@@ -103,6 +111,7 @@ int devfs_add_dev(const char *name, int (*read)(void *, size_t, size_t), int (*w
     trace("Added device vnode '%s', path: %s", name, vfs_get_full_path(dev));
 
     dev->ops = &devfs_ops;
+    dev->flags |= VNODE_FLAG_SLOW_WRITE; // Serial output alone takes ~260us a byte
     dev_t *device = kmalloc(sizeof(dev_t));
     if (!device)
     {
@@ -0,0 +1,220 @@
+#include <fs/pipe.h>
+#include <mm/pmm.h>
+#include <mm/kmalloc.h>
+#include <lib/memory.h>
+#include <lib/log.h>
+#include <util/errno.h>
+#include <dev/time/rtc.h>
+
+pipe_stats_t pipe_stats = {0};
+
+static bool pipe_claim(bool *flag)
+{
+    return !__atomic_exchange_n(flag, true, __ATOMIC_ACQUIRE);
+}
+
+static void pipe_unclaim(bool *flag, wait_queue_t *wq)
+{
+    __atomic_store_n(flag, false, __ATOMIC_RELEASE);
+    if (wait_queue_active(wq))
+        wake_up(wq);
+}
+
+static uint64_t pipe_used(pipe_t *pipe)
+{
+    return __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+}
+
+// Copies between `buf` and the ring at stream position `pos`, wrapping around its end
+static void pipe_copy(pipe_t *pipe, uint64_t pos, void *buf, size_t size, bool to_pipe)
+{
+    size_t offset = pos % PIPE_SIZE;
+    size_t first = MIN(size, PIPE_SIZE - offset);
+    if (to_pipe)
+    {
+        memcpy(pipe->buffer + offset, buf, first);
+        memcpy(pipe->buffer, (uint8_t *)buf + first, size - first);
+    }
+    else
+    {
+        memcpy(buf, pipe->buffer + offset, first);
+        memcpy((uint8_t *)buf + first, pipe->buffer, size - first);
+    }
+}
+
+// Like devfs, the vnode lock is dropped while we may sleep. Blocks until there is data, or
+// returns 0 once it is drained and the write end is closed.
+static int pipe_read(vnode_t *vnode, void *buf, size_t size, size_t)
+{
+    pipe_t *pipe = vnode->data;
+    spinlock_release(&vnode->lock);
+    wait_event(&pipe->read_wait, pipe_claim(&pipe->reading));
+
+    if (pipe_used(pipe) == 0 && pipe->write_open)
+    {
+        pipe_stats.reader_sleeps++;
+        wait_event(&pipe->read_wait, pipe_used(pipe) > 0 || !pipe->write_open);
+    }
+
+    uint64_t tail = pipe->tail;
+    size_t count = MIN(size, pipe_used(pipe));
+    pipe_copy(pipe, tail, buf, count, false);
+    __atomic_store_n(&pipe->tail, tail + count, __ATOMIC_RELEASE);
+    pipe_stats.bytes += count;
+
+    pipe_unclaim(&pipe->reading, &pipe->read_wait);
+    if (count && wait_queue_active(&pipe->write_wait))
+        wake_up(&pipe->write_wait);
+
+    spinlock_acquire(&vnode->lock);
+    return count;
+}
+
+// Writes up to PIPE_BUF wait for room for all of it and go in at once, bigger ones as room
+// frees up. -EPIPE once the read end is closed, or what made it in before.
+static int pipe_write(vnode_t *vnode, const void *buf, size_t size, size_t)
+{
+    pipe_t *pipe = vnode->data;
+    spinlock_release(&vnode->lock);
+    wait_event(&pipe->write_wait, pipe_claim(&pipe->writing));
+
+    size_t done = 0;
+    while (done < size)
+    {
+        size_t want = size <= PIPE_BUF ? size : 1;
+        if (PIPE_SIZE - pipe_used(pipe) < want && pipe->read_open)
+        {
+            pipe_stats.writer_sleeps++;
+            wait_event(&pipe->write_wait, PIPE_SIZE - pipe_used(pipe) >= want || !pipe->read_open);
+        }
+        if (!pipe->read_open)
+            break;
+
+        uint64_t head = pipe->head;
+        size_t count = MIN(size - done, PIPE_SIZE - pipe_used(pipe));
+        pipe_copy(pipe, head, (uint8_t *)buf + done, count, true);
+        __atomic_store_n(&pipe->head, head + count, __ATOMIC_RELEASE);
+        done += count;
+
+        if (wait_queue_active(&pipe->read_wait))
+            wake_up(&pipe->read_wait);
+    }
+
+    pipe_unclaim(&pipe->writing, &pipe->write_wait);
+    spinlock_acquire(&vnode->lock);
+    return done ? (int)done : -EPIPE;
+}
+
+// Last descriptor of one end closed, the other side sees EOF or EPIPE
+static void pipe_release(vnode_t *vnode)
+{
+    pipe_t *pipe = vnode->data;
+    spinlock_acquire(&pipe->lock);
+    if (vnode == pipe->read_end)
+        pipe->read_open = false;
+    else
+        pipe->write_open = false;
+    bool last = !pipe->read_open && !pipe->write_open;
+    spinlock_release(&pipe->lock);
+
+    wake_up(&pipe->read_wait);
+    wake_up(&pipe->write_wait);
+
+    kfree(vnode->name);
+    kfree(vnode);
+    if (last)
+    {
+        pmm_release_page(PHYSICAL(pipe->buffer));
+        kfree(pipe);
+    }
+}
+
+static vnode_ops_t pipe_read_ops = {
+    .read = pipe_read,
+    .release = pipe_release,
+};
+
+static vnode_ops_t pipe_write_ops = {
+    .write = pipe_write,
+    .release = pipe_release,
+};
+
+// Ends aren't in any directory, they only live as long as their open files
+static vnode_t *pipe_new_end(pipe_t *pipe, const char *name, vnode_ops_t *ops, uint32_t mode, uint32_t uid, uint32_t gid)
+{
+    vnode_t *node = (vnode_t *)kmalloc(sizeof(vnode_t));
+    if (!node)
+        return NULL;
+
+    memset(node, 0, sizeof(vnode_t));
+    node->name = strdup(name);
+    if (!node->name)
+    {
+        kfree(node);
+        return NULL;
+    }
+    node->type = VNODE_PIPE;
+    node->flags = VNODE_FLAG_SLOW_WRITE; // Writers sleep while the pipe is full
+    node->uid = uid;
+    node->gid = gid;
+    node->mode = mode;
+    node->creation_time = GET_CURRENT_UNIX_TIME();
+    node->data = pipe;
+    node->ops = ops;
+    spinlock_init(&node->lock);
+    return node;
+}
+
+// New pipe, as a pair of open files owned by `uid`/`gid`
+int pipe_open(uint32_t uid, uint32_t gid, file_t **read_file, file_t **write_file)
+{
+    pipe_t *pipe = (pipe_t *)kmalloc(sizeof(pipe_t));
+    if (!pipe)
+        return -ENOMEM;
+
+    memset(pipe, 0, sizeof(pipe_t));
+    spinlock_init(&pipe->lock);
+    wait_queue_init(&pipe->read_wait);
+    wait_queue_init(&pipe->write_wait);
+    pipe->buffer = pmm_request_page();
+    if (pipe->buffer)
+        pipe->buffer = HIGHER_HALF(pipe->buffer);
+
+    pipe->read_end = pipe_new_end(pipe, "pipe:[read]", &pipe_read_ops, VNODE_MODE_RUSR | VNODE_MODE_RGRP | VNODE_MODE_ROTH, uid, gid);
+    pipe->write_end = pipe_new_end(pipe, "pipe:[write]", &pipe_write_ops, VNODE_MODE_WUSR | VNODE_MODE_WGRP | VNODE_MODE_WOTH, uid, gid);
+    if (!pipe->buffer || !pipe->read_end || !pipe->write_end)
+    {
+        if (pipe->buffer)
+            pmm_release_page(PHYSICAL(pipe->buffer));
+        if (pipe->read_end)
+            kfree(pipe->read_end->name);
+        if (pipe->write_end)
+            kfree(pipe->write_end->name);
+        kfree(pipe->read_end);
+        kfree(pipe->write_end);
+        kfree(pipe);
+        return -ENOMEM;
+    }
+
+    pipe->read_open = true;
+    pipe->write_open = true;
+    *read_file = file_open(pipe->read_end, 0);
+    *write_file = file_open(pipe->write_end, 0);
+    if (!*read_file || !*write_file)
+    {
+        // An end goes away with its file (see pipe_release()), and the pipe with the last end
+        if (*read_file)
+            file_put(*read_file);
+        else
+            pipe_release(pipe->read_end);
+        if (*write_file)
+            file_put(*write_file);
+        else
+            pipe_release(pipe->write_end);
+        *read_file = NULL;
+        *write_file = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef FS_PIPE_H
+#define FS_PIPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <dev/vfs.h>
+#include <dev/file.h>
+#include <proc/wait.h>
+
+#define PIPE_SIZE PAGE_SIZE // Ring buffer, one page
+#define PIPE_BUF PIPE_SIZE  // Writes up to this size never get split up
+
+// Anonymous pipe, one vnode per end. The ring buffer itself is single-producer/single-consumer
+// and lock free: only the writer moves `head` and only the reader moves `tail`. Concurrent
+// readers (or writers) take turns through `reading` (`writing`) first.
+typedef struct pipe
+{
+    uint8_t *buffer;
+    uint64_t head; // Bytes ever written, free running
+    uint64_t tail; // Bytes ever read
+    bool reading;  // A reader is in, others wait on read_wait
+    bool writing;  // A writer is in, others wait on write_wait
+    bool read_open;
+    bool write_open;
+    vnode_t *read_end;
+    vnode_t *write_end;
+    spinlock_t lock;         // read_open, write_open
+    wait_queue_t read_wait;  // Readers waiting for data or their turn
+    wait_queue_t write_wait; // Writers waiting for room or their turn
+} pipe_t;
+
+typedef struct pipe_stats
+{
+    uint64_t bytes;         // Moved through all pipes
+    uint64_t reader_sleeps; // Reads that found the pipe empty
+    uint64_t writer_sleeps; // Writes that found it full
+} pipe_stats_t;
+
+extern pipe_stats_t pipe_stats;
+
+int pipe_open(uint32_t uid, uint32_t gid, file_t **read_file, file_t **write_file);
+
+#endif // FS_PIPE_H
@@ -4,9 +4,13 @@
 #include <lib/memory.h>
 #include <stdbool.h>
 #include <mm/kmalloc.h>
+#include <mm/mmap.h>
+#include <proc/preempt.h>
+#include <util/errno.h>
 
 #define USTAR_HEADER_SIZE 512
 #define NAME_SIZE 100
+#define RAMFS_COPY_CHUNK 0x10000 // Bytes copied between preemption points
 
 typedef struct ustar_header
 {
@@ -29,6 +33,89 @@ typedef struct ustar_header
     char padding[12];
 } ustar_header_t;
 
+extern vma_context_t *kernel_vma_context;
+
+// Contents of a page or more get whole pages of the kernel heap's address space to themselves,
+// so mmap() can map those frames instead of copying them (see ramfs_fault())
+static void *ramfs_alloc(size_t size)
+{
+    if (size < PAGE_SIZE)
+        return kmalloc(size);
+
+    // Same context the heap grows in, under its lock
+    liballoc_lock();
+    void *buf = vma_alloc(kernel_vma_context, DIV_ROUND_UP(size, PAGE_SIZE), VMM_PRESENT | VMM_WRITE | VMM_NX);
+    liballoc_unlock();
+    return buf;
+}
+
+static void ramfs_free(void *buf, size_t size)
+{
+    if (!buf)
+        return;
+    if (size < PAGE_SIZE)
+    {
+        kfree(buf);
+        return;
+    }
+
+    // Frames still mapped by a process stay around for it
+    liballoc_lock();
+    vma_free(kernel_vma_context, buf);
+    liballoc_unlock();
+}
+
+// Copies between a file and `buf` in RAMFS_COPY_CHUNK pieces, giving up the CPU in between
+// if needed. Files only ever grow, but their buffer may be reallocated by a writer while the
+// vnode lock is dropped, so it is looked up again for every chunk.
+static void ramfs_copy(vnode_t *vnode, void *buf, size_t size, size_t offset, bool to_file)
+{
+    ramfs_data_t *data = vnode->data;
+    size_t done = 0;
+    while (done < size)
+    {
+        size_t chunk = MIN(size - done, RAMFS_COPY_CHUNK);
+        uint8_t *file = (uint8_t *)data->data + offset + done;
+        if (to_file)
+            memcpy(file, (uint8_t *)buf + done, chunk);
+        else
+            memcpy((uint8_t *)buf + done, file, chunk);
+        done += chunk;
+
+        if (done < size)
+            cond_resched_lock(&vnode->lock);
+    }
+}
+
+// Makes room for `size` bytes, files never shrink
+static bool ramfs_grow(vnode_t *vnode, size_t size)
+{
+    ramfs_data_t *data = vnode->data;
+    if (size <= data->size)
+        return true;
+
+    void *new_data = ramfs_alloc(size);
+    if (!new_data)
+    {
+        error("Failed to allocate memory for expanding the file data");
+        return false;
+    }
+
+    // A write past the end leaves a hole that has to read back as zeroes, kmalloc() doesn't clear
+    memcpy(new_data, data->data, data->size);
+    memset((uint8_t *)new_data + data->size, 0, size - data->size);
+    void *old_data = data->data;
+    size_t old_size = data->size;
+    spinlock_acquire(&data->lock);
+    data->data = new_data;
+    data->size = size;
+    spinlock_release(&data->lock);
+    ramfs_free(old_data, old_size);
+    vnode->size = size;
+    trace("Resized file data buffer to %zu bytes", size);
+    return true;
+}
+
 int ramfs_read(struct vnode *vnode, void *buf, size_t size, size_t offset)
 {
     if (!vnode || vnode->type != VNODE_FILE)
@@ -38,12 +125,16 @@ int ramfs_read(struct vnode *vnode, void *buf, size_t size, size_t offset)
     }
 
     ramfs_data_t *data = vnode->data;
-    if (!data || offset >= data->size)
+    if (!data)
     {
-        error("Invalid offset for read operation, data: %s", data ? "ok" : "null");
+        error("Invalid data for read operation");
         return 0;
     }
 
+    // End of file, streaming readers get here on every file
+    if (offset >= data->size)
+        return 0;
+
     size_t to_read = size > (data->size - offset) ? (data->size - offset) : size;
     if (!buf)
     {
@@ -51,7 +142,7 @@ int ramfs_read(struct vnode *vnode, void *buf, size_t size, size_t offset)
         return -1;
     }
 
-    memcpy(buf, data->data + offset, to_read);
+    ramfs_copy(vnode, buf, to_read, offset, false);
     return to_read;
 }
 
@@ -70,26 +161,8 @@ int ramfs_write(struct vnode *vnode, const void *buf, size_t size, size_t offset
         return -1;
     }
 
-    if (offset >= data->size)
-    {
-        size_t new_size = offset + size;
-        if (new_size > data->size)
-        {
-            void *new_data = kmalloc(new_size);
-            if (!new_data)
-            {
-                error("Failed to allocate memory for expanding the file data");
-                return -1;
-            }
-
-            memcpy(new_data, data->data, data->size);
-            kfree(data->data);
-            data->data = new_data;
-            data->size = new_size;
-            vnode->size = new_size;
-            trace("Resized file data buffer to %zu bytes", new_size);
-        }
-    }
+    if (!ramfs_grow(vnode, offset + size))
+        return -1;
 
     if (!buf)
     {
@@ -97,12 +170,144 @@ int ramfs_write(struct vnode *vnode, const void *buf, size_t size, size_t offset
         return -1;
     }
 
-    memcpy(data->data + offset, buf, size);
+    ramfs_copy(vnode, (void *)buf, size, offset, true);
     vnode->size = (vnode->size > offset + size) ? vnode->size : (offset + size);
     data->size = vnode->size;
     return size;
 }
 
+// Every segment is copied straight out of the file in one call. ramfs_copy() may still drop
+// the vnode lock between chunks of a big segment, like a plain read() does.
+int ramfs_readv(struct vnode *vnode, const iovec_t *iov, int iovcnt, size_t offset)
+{
+    if (!vnode || vnode->type != VNODE_FILE || !vnode->data)
+    {
+        error("Invalid vnode or not a file");
+        return -1;
+    }
+
+    ramfs_data_t *data = vnode->data;
+    size_t done = 0;
+    for (int i = 0; i < iovcnt && offset + done < data->size; i++)
+    {
+        size_t chunk = MIN(iov[i].iov_len, data->size - (offset + done));
+        ramfs_copy(vnode, iov[i].iov_base, chunk, offset + done, false);
+        done += chunk;
+    }
+    return done;
+}
+
+// Grows the file once for the whole vector, then copies every segment straight in
+int ramfs_writev(struct vnode *vnode, const iovec_t *iov, int iovcnt, size_t offset)
+{
+    if (!vnode || vnode->type != VNODE_FILE || !vnode->data)
+    {
+        error("Invalid vnode or not a file");
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (!ramfs_grow(vnode, offset + total))
+        return -1;
+
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        ramfs_copy(vnode, iov[i].iov_base, iov[i].iov_len, offset + done, true);
+        done += iov[i].iov_len;
+    }
+    return done;
+}
+
+// Hands the file buffer itself to `actor`, in RAMFS_COPY_CHUNK pieces with a preemption point
+// in between. The buffer is looked up again every time, like in ramfs_copy().
+int ramfs_splice_read(struct vnode *vnode, size_t offset, size_t size, splice_actor_t actor, void *ctx)
+{
+    if (!vnode || vnode->type != VNODE_FILE || !vnode->data)
+    {
+        error("Invalid vnode or not a file");
+        return -1;
+    }
+
+    ramfs_data_t *data = vnode->data;
+    size_t done = 0;
+    while (done < size && offset + done < data->size)
+    {
+        size_t chunk = MIN(MIN(size - done, data->size - (offset + done)), RAMFS_COPY_CHUNK);
+        int ret = actor(ctx, (uint8_t *)data->data + offset + done, chunk);
+        if (ret < 0)
+            return done ? (int)done : ret;
+        done += ret;
+        if ((size_t)ret < chunk)
+            break;
+
+        cond_resched_lock(&vnode->lock);
+    }
+    return done;
+}
+
+// Page `index` of a file mapping. Whole pages of page aligned contents are mapped as they are
+// (copy-on-write where writable), anything else gets a copy. Past the end of the file is an
+// error, there is nothing to map. The fault may come from a read() or write() of this very
+// file into or out of the mapping, which holds the vnode lock, so only the buffer lock is taken.
+static uint64_t ramfs_fault(vma_region_t *region, uint64_t index, bool *shared)
+{
+    vnode_t *vnode = region->data;
+    uint64_t offset = (region->pgoff + index) * PAGE_SIZE;
+
+    ramfs_data_t *data = vnode->data;
+    spinlock_acquire(&data->lock);
+    uint64_t frame = 0;
+    if (offset < data->size)
+    {
+        uint64_t src = (uint64_t)data->data + offset;
+        if (offset + PAGE_SIZE <= data->size && !(src & (PAGE_SIZE - 1)))
+        {
+            frame = virt_to_phys(kernel_pagemap, src);
+            pmm_frame_ref(frame);
+            *shared = true;
+            mmap_stats.file_direct++;
+        }
+        else
+        {
+            // Fresh pages are zeroed, so is the rest of the last one
+            frame = (uint64_t)pmm_request_page();
+            if (frame)
+            {
+                memcpy(HIGHER_HALF(frame), (void *)src, MIN(PAGE_SIZE, data->size - offset));
+                *shared = false;
+                mmap_stats.file_copied++;
+            }
+        }
+    }
+    spinlock_release(&data->lock);
+    return frame;
+}
+
+static const vma_ops_t ramfs_vma_ops = {
+    .fault = ramfs_fault,
+};
+
+// Files are never written back, so shared mappings are read-only snapshots like private ones
+int ramfs_mmap(struct vnode *vnode, vma_region_t *region)
+{
+    if (!vnode || vnode->type != VNODE_FILE || !vnode->data)
+        return -ENODEV;
+
+    if (region->flags & VMM_SHARED)
+    {
+        if (region->flags & VMM_WRITE)
+            return -EACCES;
+        region->write_denied = true;
+    }
+
+    region->ops = &ramfs_vma_ops;
+    region->data = vnode;
+    return 0;
+}
+
 struct vnode *ramfs_create(vnode_t *self, const char *name, vnode_type_t type)
 {
     spinlock_release(&self->lock);
@@ -187,6 +392,10 @@ struct vnode *ramfs_create(vnode_t *self, const char *name, vnode_type_t type)
 vnode_ops_t ramfs_ops = {
     .read = ramfs_read,
     .write = ramfs_write,
+    .readv = ramfs_readv,
+    .writev = ramfs_writev,
+    .splice_read = ramfs_splice_read,
+    .mmap = ramfs_mmap,
     .create = ramfs_create,
 };
 
@@ -272,8 +481,9 @@ void ramfs_init_ustar(mount_t *mount, void *data, size_t size)
                     error("Failed to allocate memory for ramfs data");
                     return;
                 }
+                spinlock_init(&ramfs_data->lock);
 
-                ramfs_data->data = kmalloc(file_size);
+                ramfs_data->data = ramfs_alloc(file_size);
                 if (!ramfs_data->data)
                 {
                     error("Failed to allocate memory for file data");
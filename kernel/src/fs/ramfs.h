@@ -2,6 +2,7 @@
 #define FS_RAMFS_H
 
 #include <dev/vfs.h>
+#include <lib/spinlock.h>
 
 #define RAMFS_TYPE_USTAR 0x0001
 
@@ -9,6 +10,7 @@ typedef struct ramfs_data
 {
     void *data;
     size_t size;
+    spinlock_t lock; // Swapping `data` out, for mappings that can't take the vnode lock
 } ramfs_data_t;
 
 extern vnode_ops_t ramfs_ops;
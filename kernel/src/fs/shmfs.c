@@ -0,0 +1,458 @@
+#include <fs/shmfs.h>
+#include <sys/syscall.h>
+#include <mm/pmm.h>
+#include <mm/vma.h>
+#include <mm/kmalloc.h>
+#include <lib/memory.h>
+#include <lib/log.h>
+#include <util/errno.h>
+#include <dev/time/rtc.h>
+#include <proc/scheduler.h>
+
+shm_stats_t shm_stats = {0};
+static vnode_t *shm_dir = NULL;
+
+static vnode_ops_t shm_ops;
+static vnode_ops_t shm_dir_ops;
+
+static shm_object_t *shm_get(shm_object_t *object)
+{
+    spinlock_acquire(&object->lock);
+    object->refcount++;
+    spinlock_release(&object->lock);
+    return object;
+}
+
+// The name is gone and so is every file and mapping, nobody can reach the object anymore
+static void shm_put(shm_object_t *object)
+{
+    spinlock_acquire(&object->lock);
+    bool last = --object->refcount == 0;
+    spinlock_release(&object->lock);
+    if (!last)
+        return;
+
+    // Mappings held references of their own, these are the object's
+    for (uint64_t i = 0; i < object->pages; i++)
+    {
+        if (object->frames[i])
+        {
+            pmm_release_page((void *)object->frames[i]);
+            shm_stats.pages--;
+        }
+    }
+    shm_stats.objects--;
+
+    kfree(object->frames);
+    kfree(object->node->name);
+    kfree(object->node);
+    kfree(object);
+}
+
+// Frame behind page `index`, allocated on first use if `create`. The object lock is held.
+static uint64_t shm_frame(shm_object_t *object, uint64_t index, bool create)
+{
+    if (index >= object->pages)
+        return 0;
+
+    if (!object->frames[index] && create)
+    {
+        object->frames[index] = (uint64_t)pmm_request_page();
+        if (object->frames[index])
+            shm_stats.pages++;
+    }
+    return object->frames[index];
+}
+
+// New size in bytes, with the object lock held. Frames past the end are dropped, pages still
+// mapped somewhere keep them alive until unmapped but no longer belong to the object.
+static bool shm_resize(shm_object_t *object, uint64_t size)
+{
+    uint64_t pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    if (pages > object->pages)
+    {
+        // Room to spare, so growing a file by appending doesn't copy the array every page
+        uint64_t count = MAX(pages, object->pages * 2);
+        uint64_t *frames = (uint64_t *)kcalloc(count, sizeof(uint64_t));
+        if (!frames)
+            return false;
+
+        if (object->frames)
+        {
+            memcpy(frames, object->frames, object->pages * sizeof(uint64_t));
+            kfree(object->frames);
+        }
+        object->frames = frames;
+        object->pages = count;
+    }
+
+    if (size < object->size)
+    {
+        for (uint64_t i = pages; i < object->pages; i++)
+        {
+            if (object->frames[i])
+            {
+                pmm_release_page((void *)object->frames[i]);
+                object->frames[i] = 0;
+                shm_stats.pages--;
+            }
+        }
+
+        // Growing again must read back zeroes, not what used to be there
+        if (size % PAGE_SIZE && object->frames[pages - 1])
+            memset((uint8_t *)HIGHER_HALF(object->frames[pages - 1]) + size % PAGE_SIZE, 0, PAGE_SIZE - size % PAGE_SIZE);
+    }
+
+    object->size = size;
+    object->node->size = size;
+    return true;
+}
+
+// Page by page, the object lock is only held to look the frame up since `buf` may well be a
+// mapping of this very object. Holes read as zeroes.
+static int shm_copy(shm_object_t *object, void *buf, size_t size, size_t offset, bool write)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        uint64_t pos = offset + done;
+        size_t page_offset = pos % PAGE_SIZE;
+        size_t chunk = MIN(size - done, PAGE_SIZE - page_offset);
+
+        spinlock_acquire(&object->lock);
+        uint64_t frame = shm_frame(object, pos / PAGE_SIZE, write);
+        if (frame)
+            pmm_frame_ref(frame);
+        spinlock_release(&object->lock);
+
+        if (write && !frame)
+            return done ? (int)done : -ENOMEM;
+
+        uint8_t *page = frame ? (uint8_t *)HIGHER_HALF(frame) + page_offset : NULL;
+        if (write)
+            memcpy(page, (uint8_t *)buf + done, chunk);
+        else if (page)
+            memcpy((uint8_t *)buf + done, page, chunk);
+        else
+            memset((uint8_t *)buf + done, 0, chunk);
+
+        if (frame)
+            pmm_release_page((void *)frame);
+        done += chunk;
+    }
+    return done;
+}
+
+static int shm_read(vnode_t *vnode, void *buf, size_t size, size_t offset)
+{
+    shm_object_t *object = vnode->data;
+    spinlock_acquire(&object->lock);
+    uint64_t end = object->size;
+    spinlock_release(&object->lock);
+
+    if (offset >= end)
+        return 0;
+    return shm_copy(object, buf, MIN(size, end - offset), offset, false);
+}
+
+static int shm_write(vnode_t *vnode, const void *buf, size_t size, size_t offset)
+{
+    shm_object_t *object = vnode->data;
+    spinlock_acquire(&object->lock);
+    bool ok = offset + size <= object->size || shm_resize(object, offset + size);
+    spinlock_release(&object->lock);
+
+    if (!ok)
+        return -ENOMEM;
+    return shm_copy(object, (void *)buf, size, offset, true);
+}
+
+static int shm_truncate(vnode_t *vnode, size_t size)
+{
+    shm_object_t *object = vnode->data;
+    spinlock_acquire(&object->lock);
+    bool ok = shm_resize(object, size);
+    spinlock_release(&object->lock);
+    return ok ? 0 : -ENOMEM;
+}
+
+static int shm_vnode_open(vnode_t *vnode)
+{
+    shm_get(vnode->data);
+    return 0;
+}
+
+static void shm_vnode_release(vnode_t *vnode)
+{
+    shm_put(vnode->data);
+}
+
+// Every mapping gets the object's own frames, writable ones included, so there is no COW
+static uint64_t shm_vma_fault(vma_region_t *region, uint64_t index, bool *shared)
+{
+    shm_object_t *object = region->data;
+    uint64_t page = region->pgoff + index;
+
+    spinlock_acquire(&object->lock);
+    uint64_t frame = page < DIV_ROUND_UP(object->size, PAGE_SIZE) ? shm_frame(object, page, true) : 0;
+    if (frame)
+        pmm_frame_ref(frame);
+    spinlock_release(&object->lock);
+
+    if (!frame)
+    {
+        // Nothing to map, the faulting process gets killed (see page_fault_handler())
+        warning("Access to page %llu of a shared memory object of %llu bytes", page, object->size);
+        return 0;
+    }
+
+    // MAP_PRIVATE mappings see the object's data, but their writes go to a copy of their own
+    shm_stats.faults++;
+    *shared = !(region->flags & VMM_SHARED);
+    return frame;
+}
+
+static void shm_vma_open(vma_region_t *region)
+{
+    shm_get(region->data);
+}
+
+static void shm_vma_close(vma_region_t *region)
+{
+    shm_put(region->data);
+}
+
+static const vma_ops_t shm_vma_ops = {
+    .fault = shm_vma_fault,
+    .open = shm_vma_open,
+    .close = shm_vma_close,
+};
+
+static int shm_mmap(vnode_t *vnode, vma_region_t *region)
+{
+    region->ops = &shm_vma_ops;
+    region->data = shm_get(vnode->data);
+    return 0;
+}
+
+// Empty object holding one reference for the caller. Named ones go into `parent` (with its
+// lock held) and hold another one for the name.
+static shm_object_t *shm_new(vnode_t *parent, const char *name, uint32_t mode, uint32_t uid, uint32_t gid)
+{
+    shm_object_t *object = (shm_object_t *)kmalloc(sizeof(shm_object_t));
+    vnode_t *node = (vnode_t *)kmalloc(sizeof(vnode_t));
+    char *copy = strdup(name);
+    if (!object || !node || !copy)
+    {
+        kfree(object);
+        kfree(node);
+        kfree(copy);
+        return NULL;
+    }
+
+    memset(object, 0, sizeof(shm_object_t));
+    spinlock_init(&object->lock);
+    object->node = node;
+    object->refcount = 1;
+
+    memset(node, 0, sizeof(vnode_t));
+    spinlock_init(&node->lock);
+    node->name = copy;
+    node->type = VNODE_FILE;
+    node->uid = uid;
+    node->gid = gid;
+    node->mode = mode;
+    node->creation_time = GET_CURRENT_UNIX_TIME();
+    node->modify_time = node->creation_time;
+    node->access_time = node->creation_time;
+    node->data = object;
+    node->ops = &shm_ops;
+
+    if (parent)
+    {
+        node->parent = parent;
+        node->mount = parent->mount;
+        node->next = parent->child;
+        parent->child = node;
+        object->linked = true;
+        object->refcount++;
+    }
+
+    shm_stats.objects++;
+    return object;
+}
+
+// open() with O_CREATE inside /dev/shm, runs with the directory locked. open() takes no
+// mode, so the object belongs to the caller and only it may use it, like shm_open() with 0600.
+static vnode_t *shmfs_create(vnode_t *self, const char *name, vnode_type_t type)
+{
+    if (type != VNODE_FILE || strlen(name) > SHM_NAME_MAX || vfs_lookup(self, name) != NULL)
+    {
+        error("Could not create '%s' in /dev/shm", name);
+        return NULL;
+    }
+
+    pcb_t *proc = scheduler_get_current();
+    uint32_t uid = proc ? proc->whoami.uid : 0;
+    uint32_t gid = proc ? proc->whoami.gid : 0;
+    shm_object_t *object = shm_new(self, name, VNODE_MODE_RUSR | VNODE_MODE_WUSR, uid, gid);
+    if (!object)
+        return NULL;
+
+    // Only the name keeps it now, open() takes its own reference through file_open()
+    object->refcount--;
+    return object->node;
+}
+
+static vnode_ops_t shm_ops = {
+    .read = shm_read,
+    .write = shm_write,
+    .open = shm_vnode_open,
+    .release = shm_vnode_release,
+    .truncate = shm_truncate,
+    .mmap = shm_mmap,
+};
+
+static vnode_ops_t shm_dir_ops = {
+    .create = shmfs_create,
+};
+
+// "/name", one component
+static bool shm_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    return name[0] == '/' && len > 1 && len - 1 <= SHM_NAME_MAX && !strchr(name + 1, '/');
+}
+
+// Opens (or with O_CREATE makes) the object called `name`, NULL for a fresh anonymous one
+// that goes away with its last file and mapping. `mode` only applies to new objects.
+int shm_open(const char *name, uint64_t flags, uint32_t mode, uint32_t uid, uint32_t gid, file_t **out)
+{
+    if (name && !shm_dir)
+        return -ENODEV;
+    if (name && !shm_name_valid(name))
+        return -EINVAL;
+
+    mode &= VNODE_MODE_RUSR | VNODE_MODE_WUSR | VNODE_MODE_XUSR |
+            VNODE_MODE_RGRP | VNODE_MODE_WGRP | VNODE_MODE_XGRP |
+            VNODE_MODE_ROTH | VNODE_MODE_WOTH | VNODE_MODE_XOTH;
+
+    shm_object_t *object;
+    if (!name)
+    {
+        object = shm_new(NULL, "shm:[anon]", mode, uid, gid);
+        if (!object)
+            return -ENOMEM;
+    }
+    else
+    {
+        // Looked up and referenced under the directory lock, shm_unlink() can't get between
+        spinlock_acquire(&shm_dir->lock);
+        vnode_t *node = vfs_lookup(shm_dir, name + 1);
+        int ret = 0;
+        if (node && (flags & O_CREATE) && (flags & O_EXCL))
+            ret = -EEXIST;
+        else if (!node && !(flags & O_CREATE))
+            ret = -ENOENT;
+        else if (node && !vfs_am_i_allowed(node, uid, gid, 1))
+            ret = -EACCES;
+
+        object = NULL;
+        if (ret == 0)
+            object = node ? shm_get(node->data) : shm_new(shm_dir, name + 1, mode, uid, gid);
+        spinlock_release(&shm_dir->lock);
+
+        if (ret < 0)
+            return ret;
+        if (!object)
+            return -ENOMEM;
+    }
+
+    file_t *file = file_open(object->node, flags & ~(O_CREATE | O_EXCL));
+    shm_put(object);
+    if (!file)
+        return -ENOMEM;
+
+    object->node->access_time = GET_CURRENT_UNIX_TIME();
+    *out = file;
+    return 0;
+}
+
+// Drops the name, the object itself lives on while open or mapped
+int shm_unlink(const char *name, uint32_t uid, uint32_t gid)
+{
+    (void)gid;
+    if (!shm_dir)
+        return -ENODEV;
+    if (!shm_name_valid(name))
+        return -EINVAL;
+
+    spinlock_acquire(&shm_dir->lock);
+    vnode_t *node = vfs_lookup(shm_dir, name + 1);
+    if (!node || (uid != 0 && node->uid != uid))
+    {
+        spinlock_release(&shm_dir->lock);
+        return node ? -EACCES : -ENOENT;
+    }
+
+    vnode_t **link = &shm_dir->child;
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+    node->next = NULL;
+    node->parent = NULL;
+
+    shm_object_t *object = node->data;
+    object->linked = false;
+    spinlock_release(&shm_dir->lock);
+
+    shm_put(object);
+    return 0;
+}
+
+// /dev/shm, needs devfs
+void shmfs_init()
+{
+    vnode_t *dev = vfs_lazy_lookup(root_mount, "/dev");
+    if (!dev)
+    {
+        error("No /dev to put /dev/shm in");
+        return;
+    }
+
+    vnode_t *dir = (vnode_t *)kmalloc(sizeof(vnode_t));
+    if (!dir)
+    {
+        error("Failed to allocate memory for /dev/shm");
+        return;
+    }
+
+    memset(dir, 0, sizeof(vnode_t));
+    spinlock_init(&dir->lock);
+    dir->name = strdup("shm");
+    dir->type = VNODE_DIR;
+    dir->mode = VNODE_MODE_RUSR | VNODE_MODE_WUSR | VNODE_MODE_XUSR |
+                VNODE_MODE_RGRP | VNODE_MODE_WGRP | VNODE_MODE_XGRP |
+                VNODE_MODE_ROTH | VNODE_MODE_WOTH | VNODE_MODE_XOTH;
+    dir->flags = VNODE_FLAG_MOUNTPOINT;
+    dir->ops = &shm_dir_ops;
+    dir->creation_time = GET_CURRENT_UNIX_TIME();
+    dir->parent = dev;
+
+    spinlock_acquire(&dev->lock);
+    dir->next = dev->child;
+    dev->child = dir;
+    spinlock_release(&dev->lock);
+
+    mount_t *mount = vfs_mount("/dev/shm", "shmfs");
+    if (!mount)
+    {
+        error("Failed to mount shmfs at '/dev/shm'");
+        return;
+    }
+
+    mount->root = dir;
+    dir->mount = mount;
+    shm_dir = dir;
+    trace("shmfs initialized at /dev/shm");
+}
@@ -0,0 +1,38 @@
+#ifndef FS_SHMFS_H
+#define FS_SHMFS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <dev/vfs.h>
+#include <dev/file.h>
+#include <lib/spinlock.h>
+
+#define SHM_NAME_MAX 255 // Without the leading '/'
+
+// Shared memory object, the file behind a /dev/shm entry or an anonymous shm_open(). Its
+// frames are handed out to every mapping as they are, so all of them see the same memory.
+typedef struct shm_object
+{
+    uint64_t *frames;  // One per page, 0 until first touched
+    uint64_t pages;    // Entries in `frames`
+    uint64_t size;     // In bytes, set by ftruncate() or writes past the end
+    uint64_t refcount; // The name while linked, open files and mappings
+    bool linked;       // Still has its name in /dev/shm
+    vnode_t *node;     // Freed together with the object
+    spinlock_t lock;   // frames, pages, size, refcount
+} shm_object_t;
+
+typedef struct shm_stats
+{
+    uint64_t objects; // Alive right now
+    uint64_t pages;   // Frames held by objects right now
+    uint64_t faults;  // Pages mapped in on access
+} shm_stats_t;
+
+extern shm_stats_t shm_stats;
+
+void shmfs_init();
+int shm_open(const char *name, uint64_t flags, uint32_t mode, uint32_t uid, uint32_t gid, file_t **out);
+int shm_unlink(const char *name, uint32_t uid, uint32_t gid);
+
+#endif // FS_SHMFS_H
@@ -20,6 +20,7 @@ typedef long ssize_t;
 #include <lib/memory.h>
 #include <lib/log.h>
 #include <dev/stdout.h>
+#include <util/cpu.h>
 
 extern struct flanterm_context *ft_ctx;
 extern void (*putchar_impl)(char);
@@ -38,6 +39,8 @@ void append_to_printk_buff(const char *data, size_t length)
 
 void put(const char *data, size_t length)
 {
+    // Kernel threads log with interrupts on, keep IRQ handlers from spinning on us
+    uint64_t flags = irq_save();
     spinlock_acquire(&put_lock);
     if (stdout)
     {
@@ -47,6 +50,7 @@ void put(const char *data, size_t length)
             outb(0xE9, data[i]);
         }
         spinlock_release(&put_lock);
+        irq_restore(flags);
         return;
     }
 
@@ -60,6 +64,7 @@ void put(const char *data, size_t length)
             putchar_impl(data[i]);
     }
     spinlock_release(&put_lock);
+    irq_restore(flags);
 }
 
 int fwrite(vnode_t *vnode, const void *buffer, size_t size)
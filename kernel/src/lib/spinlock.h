@@ -2,6 +2,7 @@
 #define LIB_SPINLOCK_H
 
 #include <stdint.h>
+#include <proc/preempt.h>
 
 typedef struct spinlock
 {
@@ -12,9 +13,11 @@ typedef struct spinlock
 
 #define spinlock_init(lock) ((lock)->locked = 0)
 
+// Holding a spinlock disables preemption, we would just spin on it forever otherwise
 #define spinlock_acquire(lock)                               \
     do                                                       \
     {                                                        \
+        preempt_disable();                                   \
         while (__sync_lock_test_and_set(&(lock)->locked, 1)) \
         {                                                    \
             while ((lock)->locked)                           \
@@ -28,6 +31,7 @@ typedef struct spinlock
     do                                        \
     {                                         \
         __sync_lock_release(&(lock)->locked); \
+        preempt_enable();                     \
     } while (0)
 
 #endif // LIB_SPINLOCK_H
@@ -24,9 +24,12 @@
 #include <proc/scheduler.h>
 #include <proc/data/elf.h>
 #include <fs/devfs.h>
+#include <fs/shmfs.h>
 #include <dev/input/ps2.h>
 #include <dev/input/keyboard.h>
 #include <dev/time/rtc.h>
+#include <dev/serial.h>
+#include <proc/workqueue.h>
 
 struct limine_framebuffer *framebuffer = NULL;
 uint64_t hhdm_offset = 0;
@@ -67,6 +70,20 @@ void putchar(char c)
     flanterm_write(ft_ctx_priv, &c, 1);
 }
 
+// Copies the early printk buffer into /var/log/boot.log, off the boot path
+static void bootlog_flush(work_t *work)
+{
+    (void)work;
+    vnode_t *log = vfs_lazy_lookup(VFS_ROOT()->mount, "/var/log/boot.log");
+    assert(log);
+    fwrite(log, &printk_buff_start, printk_index);
+    vfs_write(log, "\0", 1, log->size);
+    memset(&printk_buff_start, 0, printk_index);
+    printk_index = 0;
+}
+
+static work_t bootlog_work = WORK_INIT(bootlog_flush, NULL);
+
 void post_main(void);
 void kmain(void)
 {
@@ -115,6 +132,7 @@ void kmain(void)
     gdt_init();
     idt_init();
     load_idt();
+    syscall_init();
 
     __asm__ volatile("cli");
     pic_init();
@@ -146,6 +164,7 @@ void kmain(void)
         error("Failed to create kernel VMA context, halting");
         hcf();
     }
+    kernel_vma_context->root->start = KERNEL_VMA_START;
 
     vfs_init();
     msg_assert(module_request.response, "No modules passed to the kernel, expected at least one");
@@ -196,19 +215,20 @@ void kmain(void)
     // Ensure /var/log/boot.log file exists
     vfs_create_vnode(vfs_lazy_lookup(VFS_ROOT()->mount, "/var/log"), "boot.log", VNODE_FILE);
 
+    // Set up the scheduler and the kernel worker threads, nothing runs until the PIT is started
+    scheduler_init();
+    workqueue_init();
+
     // Log out that we reached end of boot.log
     info("Reached end of boot log");
 
-    // write the printk buffer to the /var/log/boot.log file
-    vnode_t *log = vfs_lazy_lookup(VFS_ROOT()->mount, "/var/log/boot.log");
-    assert(log);
-    fwrite(log, &printk_buff_start, printk_index);
-    vfs_write(log, "\0", 1, log->size);
-    memset(&printk_buff_start, 0, printk_index);
-    printk_index = 0;
+    // Write the printk buffer to the /var/log/boot.log file once the workers run. Nothing is
+    // appended to it after stdout_init(), so it can't change under the worker's feet.
+    schedule_work(&bootlog_work);
 
-    // Initialize devfs
+    // Initialize devfs, and /dev/shm on top of it
     devfs_init();
+    shmfs_init();
 
     // clear screen becuz we are done
     ft_ctx_priv->clear(ft_ctx_priv, true);
@@ -216,23 +236,8 @@ void kmain(void)
     // Disable writing directly to the flanterm context, since kprintf will be disabled anyways.
     ft_ctx = NULL;
 
-    // Initialize DEFAULT_COM_PORT (should be com1), thanks osdev wiki
-    outb(DEFAULT_COM_PORT + 1, 0x00); // Disable all interrupts
-    outb(DEFAULT_COM_PORT + 3, 0x80); // Enable DLAB (set baud rate divisor)
-    outb(DEFAULT_COM_PORT + 0, 0x03); // Set divisor to 3 (lo byte) 38400 baud
-    outb(DEFAULT_COM_PORT + 1, 0x00); //                  (hi byte)
-    outb(DEFAULT_COM_PORT + 3, 0x03); // 8 bits, no parity, one stop bit
-    outb(DEFAULT_COM_PORT + 2, 0xC7); // Enable FIFO, clear them, with 14-byte threshold
-    outb(DEFAULT_COM_PORT + 4, 0x0B); // IRQs enabled, RTS/DSR set
-    outb(DEFAULT_COM_PORT + 4, 0x1E); // Set in loopback mode, test the serial chip
-    outb(DEFAULT_COM_PORT + 0, 0xAE); // Test serial chip (send byte 0xAE and check if serial returns same byte)
-
-    // Check if serial is faulty (i.e: not same byte as sent)
-    if (inb(DEFAULT_COM_PORT + 0) != 0xAE)
-    {
-        warning("It looks like port: 0x%x (some COM port), is faulty. But yolo", DEFAULT_COM_PORT);
-    }
-    outb(DEFAULT_COM_PORT + 4, 0x0F);
+    // Initialize DEFAULT_COM_PORT (should be com1)
+    serial_init(DEFAULT_COM_PORT);
 
     // Setup all devices
     stdout_init();
@@ -245,6 +250,9 @@ void kmain(void)
     // Register /dev/ps2kb1
     kbd_register_fs("ps2kb1");
 
+    // Register /dev/ttyS0
+    serial_register_fs("ttyS0");
+
     // Set permissions on stdout to: -w--w--w-
     vfs_chmod(stdout, VNODE_MODE_WUSR | VNODE_MODE_WGRP | VNODE_MODE_WOTH);
 
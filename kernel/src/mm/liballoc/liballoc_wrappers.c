@@ -2,20 +2,27 @@
 #include <lib/spinlock.h>
 #include <lib/log.h>
 #include <stddef.h>
+#include <util/cpu.h>
 
 extern vma_context_t *kernel_vma_context;
 
 static spinlock_t liballoc_lock_var = SPINLOCK_INIT;
+static uint64_t liballoc_irq_flags = 0;
 
+// Interrupts stay off while the heap is locked, kernel threads allocate with them enabled
 int liballoc_lock()
 {
+    uint64_t flags = irq_save();
     spinlock_acquire(&liballoc_lock_var);
+    liballoc_irq_flags = flags;
     return 0;
 }
 
 int liballoc_unlock()
 {
+    uint64_t flags = liballoc_irq_flags;
     spinlock_release(&liballoc_lock_var);
+    irq_restore(flags);
     return 0;
 }
 
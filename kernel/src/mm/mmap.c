@@ -0,0 +1,209 @@
+#include <mm/mmap.h>
+#include <lib/log.h>
+#include <util/errno.h>
+
+mmap_stats_t mmap_stats = {0};
+
+// Page table flags for `prot`. PROT_NONE pages stay present but kernel-only, so they keep
+// their frame (and contents) for a later mprotect() while user access still faults.
+static uint64_t mmap_prot_flags(int prot)
+{
+    if (!(prot & (PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return VMM_PRESENT | VMM_NX;
+
+    uint64_t flags = VMM_PRESENT | VMM_USER;
+    if (prot & PROT_WRITE)
+        flags |= VMM_WRITE;
+    if (!(prot & PROT_EXEC))
+        flags |= VMM_NX;
+    return flags;
+}
+
+// MAP_PRIVATE | MAP_ANONYMOUS, everything reads as the zero page until written
+static uint64_t mmap_anon_fault(vma_region_t *region, uint64_t index, bool *shared)
+{
+    (void)region;
+    (void)index;
+    *shared = true;
+    pmm_frame_ref(vmm_zero_page);
+    return vmm_zero_page;
+}
+
+static const vma_ops_t mmap_anon_ops = {
+    .fault = mmap_anon_fault,
+};
+
+static bool mmap_range_free(vma_context_t *ctx, uint64_t start, uint64_t end)
+{
+    for (vma_region_t *region = ctx->root; region != NULL; region = region->next)
+    {
+        if (region->size && region->start < end && region->start + region->size * PAGE_SIZE > start)
+            return false;
+    }
+    return true;
+}
+
+// Splits `region` as needed and returns the one covering exactly its part of [start, end)
+static vma_region_t *mmap_clip(vma_region_t *region, uint64_t start, uint64_t end)
+{
+    if (region->start < start)
+    {
+        region = vma_split(region, start);
+        if (region == NULL)
+            return NULL;
+    }
+
+    if (region->start + region->size * PAGE_SIZE > end && vma_split(region, end) == NULL)
+        return NULL;
+    return region;
+}
+
+static bool mmap_range_valid(vma_context_t *ctx, uint64_t addr, size_t length)
+{
+    return !(addr & (PAGE_SIZE - 1)) && length != 0 && addr >= ctx->root->start &&
+           addr < VMM_USER_END && length <= VMM_USER_END - addr;
+}
+
+// Maps `length` bytes and returns where, or a negative errno. Anonymous private memory when
+// `node` is NULL, pages of `node` from `offset` on through its mmap op otherwise (shared
+// anonymous memory comes as an anonymous shm object). Nothing is mapped until touched, see
+// mmap_populate() for MAP_POPULATE. The backing is set up before the region is placed, so a
+// MAP_FIXED that fails leaves what was mapped there alone. The caller holds the address
+// space's sem for writing and has its pagemap loaded.
+long mmap_map(vma_context_t *ctx, uint64_t addr, size_t length, int prot, int flags, vnode_t *node, uint64_t offset)
+{
+    if (length == 0 || length > VMM_USER_END || (offset & (PAGE_SIZE - 1)))
+        return -EINVAL;
+    if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) || (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_POPULATE)))
+        return -EINVAL;
+    if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+        return -EINVAL;
+    if (!node && (flags & (MAP_SHARED | MAP_ANONYMOUS)) != MAP_ANONYMOUS)
+        return -EBADF;
+    if (node && (!node->ops || !node->ops->mmap))
+        return -ENODEV;
+
+    uint64_t pages = DIV_ROUND_UP(length, PAGE_SIZE);
+    if ((flags & MAP_FIXED) && !mmap_range_valid(ctx, addr, pages * PAGE_SIZE))
+        return -EINVAL;
+
+    // What the region will look like, for the node to fill in its backing (and refuse it)
+    vma_region_t backing = {
+        .size = pages,
+        .flags = mmap_prot_flags(prot) | ((flags & MAP_SHARED) ? VMM_SHARED : 0),
+        .ops = &mmap_anon_ops,
+        .pgoff = offset / PAGE_SIZE,
+    };
+    if (node)
+    {
+        int ret = node->ops->mmap(node, &backing);
+        if (ret < 0)
+            return ret;
+    }
+
+    vma_region_t *region;
+    if (flags & MAP_FIXED)
+        region = vma_replace(ctx, addr, pages, backing.flags, backing.ops, backing.data);
+    else if (addr && mmap_range_valid(ctx, addr, pages * PAGE_SIZE) && mmap_range_free(ctx, addr, addr + pages * PAGE_SIZE))
+        region = vma_insert(ctx, addr, pages, backing.flags, backing.ops, backing.data); // The hint is free, take it
+    else
+        region = vma_reserve(ctx, pages, backing.flags, backing.ops, backing.data);
+
+    if (!region)
+    {
+        if (backing.ops->close)
+            backing.ops->close(&backing);
+        return -ENOMEM;
+    }
+    region->pgoff = backing.pgoff;
+    region->write_denied = backing.write_denied;
+
+    trace("Mapped %llu pages of %s at 0x%.16llx", pages, node ? node->name : "anonymous memory", region->start);
+    return region->start;
+}
+
+// MAP_POPULATE, faults in what mmap_map() just mapped at `addr`. Best effort: whatever can't be
+// faulted in now (e.g. past the end of the file) faults later. The caller holds the address
+// space's sem for reading, like any other fault would, since reading pages in may sleep.
+void mmap_populate(vma_context_t *ctx, uint64_t addr, size_t length, int prot)
+{
+    if (!(prot & (PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return;
+
+    for (uint64_t i = 0; i < DIV_ROUND_UP(length, PAGE_SIZE) && vma_fault_in(ctx, addr + i * PAGE_SIZE, prot & PROT_WRITE); i++)
+        mmap_stats.populated++;
+}
+
+// Unmaps every page in range, splitting regions that stick out of it. Pages in no region are
+// skipped. The caller holds the address space's sem for writing and has its pagemap loaded,
+// so vmm_unmap() flushes the right TLB.
+int mmap_unmap(vma_context_t *ctx, uint64_t addr, size_t length)
+{
+    if ((addr & (PAGE_SIZE - 1)) || length == 0 || addr >= VMM_USER_END || length > VMM_USER_END - addr)
+        return -EINVAL;
+
+    uint64_t end = addr + ALIGN_UP(length, PAGE_SIZE);
+    vma_region_t *region = ctx->root;
+    while (region != NULL)
+    {
+        vma_region_t *next = region->next;
+        if (region->size && region->start < end && region->start + region->size * PAGE_SIZE > addr)
+        {
+            region = mmap_clip(region, addr, end);
+            if (region == NULL)
+                return -ENOMEM;
+
+            next = region->next;
+            vma_free(ctx, (void *)region->start);
+        }
+        region = next;
+    }
+    return 0;
+}
+
+// Changes the protection of every page in range, which must all be mapped
+int mmap_protect(vma_context_t *ctx, uint64_t addr, size_t length, int prot)
+{
+    if ((addr & (PAGE_SIZE - 1)) || length == 0 || addr >= VMM_USER_END || length > VMM_USER_END - addr)
+        return -EINVAL;
+    if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+        return -EINVAL;
+
+    // Check first, nothing changes unless all of it can
+    uint64_t end = addr + ALIGN_UP(length, PAGE_SIZE);
+    uint64_t covered = addr;
+    for (vma_region_t *region = ctx->root; region != NULL && covered < end; region = region->next)
+    {
+        uint64_t region_end = region->start + region->size * PAGE_SIZE;
+        if (!region->size || region_end <= covered)
+            continue;
+        if (region->start > covered)
+            return -ENOMEM;
+        if ((prot & PROT_WRITE) && region->write_denied)
+            return -EACCES;
+        covered = region_end;
+    }
+    if (covered < end)
+        return -ENOMEM;
+
+    vma_region_t *region = ctx->root;
+    while (region != NULL && region->start < end)
+    {
+        if (region->size && region->start + region->size * PAGE_SIZE > addr)
+        {
+            region = mmap_clip(region, addr, end);
+            if (region == NULL)
+                return -ENOMEM;
+
+            region->flags = mmap_prot_flags(prot) | (region->flags & VMM_SHARED);
+            for (uint64_t i = 0; i < region->size; i++)
+            {
+                uint64_t virt = region->start + i * PAGE_SIZE;
+                if (virt_to_phys(ctx->pagemap, virt))
+                    vmm_protect(ctx->pagemap, virt, region->flags);
+            }
+        }
+        region = region->next;
+    }
+    return 0;
+}
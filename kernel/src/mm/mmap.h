@@ -0,0 +1,38 @@
+#ifndef MM_MMAP_H
+#define MM_MMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/vma.h>
+#include <dev/vfs.h>
+
+// mmap() protection
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2 // Implies PROT_READ, pages can't be write-only
+#define PROT_EXEC 0x4
+
+// mmap() flags
+#define MAP_SHARED 0x01 // Writes go to the object and are seen by every mapping of it
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10      // Exactly at `addr`, replacing whatever was mapped there
+#define MAP_ANONYMOUS 0x20  // Zero filled memory, no file
+#define MAP_POPULATE 0x8000 // Fault everything in right away
+
+#define MAP_FAILED ((uint64_t)-1)
+
+typedef struct mmap_stats
+{
+    uint64_t file_direct; // File pages mapped straight from the file's own storage
+    uint64_t file_copied; // File pages that had to be copied into a frame of their own
+    uint64_t populated;   // Pages faulted in up front for MAP_POPULATE
+} mmap_stats_t;
+
+extern mmap_stats_t mmap_stats;
+
+long mmap_map(vma_context_t *ctx, uint64_t addr, size_t length, int prot, int flags, vnode_t *node, uint64_t offset);
+void mmap_populate(vma_context_t *ctx, uint64_t addr, size_t length, int prot);
+int mmap_unmap(vma_context_t *ctx, uint64_t addr, size_t length);
+int mmap_protect(vma_context_t *ctx, uint64_t addr, size_t length, int prot);
+
+#endif // MM_MMAP_H
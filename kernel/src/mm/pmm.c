@@ -5,6 +5,7 @@
 #include <lib/memory.h>
 #include <stdbool.h>
 #include <mm/kmalloc.h>
+#include <lib/spinlock.h>
 
 // TODO: Maybe rewrite this
 
@@ -21,6 +22,14 @@ typedef struct page_cache_entry
 pmm_stack_t stack;
 struct limine_memmap_response *_memmap;
 
+// Frame database, how many mappings (or other owners) each physical frame has, by PFN.
+// Frames are handed out with one reference and only go back on the stack once the last
+// one is dropped, which lets address spaces share frames (e.g. copy-on-write after fork).
+static uint32_t *frame_refs = NULL;
+static uint64_t frame_count = 0;
+
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
 static page_cache_entry_t valid_page_cache[CACHE_SIZE] = {0};
 static uint64_t cache_head = 0;
 static page_cache_entry_t secondary_cache[SECONDARY_CACHE_SIZE] = {0};
@@ -146,6 +155,36 @@ void pmm_init(struct limine_memmap_response *memmap)
 
     array_size = ALIGN_UP(free_pages * 8, PAGE_SIZE);
 
+    // The frame database covers every frame we might ever hand out, reclaimable ones included
+    uint64_t max_addr = 0;
+    for (uint64_t i = 0; i < memmap->entry_count; i++)
+    {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->type == LIMINE_MEMMAP_USABLE || entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
+            max_addr = MAX(max_addr, entry->base + entry->length);
+    }
+    frame_count = DIV_ROUND_UP(max_addr, PAGE_SIZE);
+    uint64_t refs_size = ALIGN_UP(frame_count * sizeof(uint32_t), PAGE_SIZE);
+
+    for (uint64_t i = 0; i < memmap->entry_count; i++)
+    {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->length >= refs_size + array_size && entry->type == LIMINE_MEMMAP_USABLE)
+        {
+            frame_refs = (uint32_t *)HIGHER_HALF(entry->base);
+            memset(frame_refs, 0, refs_size);
+            entry->length -= refs_size;
+            entry->base += refs_size;
+            break;
+        }
+    }
+
+    if (frame_refs == NULL)
+    {
+        error("No room for the frame database (%llu frames), halting", frame_count);
+        hcf();
+    }
+
     uint64_t cached_count = 0;
 
     for (uint64_t i = 0; i < memmap->entry_count; i++)
@@ -238,20 +277,26 @@ void pmm_vmm_cleanup(struct limine_memmap_response *memmap)
 
 void *pmm_request_page()
 {
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+
     if (stack.idx == 0)
     {
+        spinlock_release(&pmm_lock);
+        irq_restore(flags);
         error("Out of memory");
         return NULL;
     }
 
-    if (stack.idx - 1 == (uint64_t)-1)
-    {
-        warning("Stack underflow detected");
-        return NULL;
-    }
-
     uint64_t page_addr = stack.pages[--stack.idx];
-    if (!is_page_valid(page_addr))
+    bool valid = is_page_valid(page_addr);
+    if (valid)
+        frame_refs[page_addr / PAGE_SIZE] = 1;
+
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+
+    if (!valid)
     {
         warning("Requested page at 0x%.16llx is not valid or out-of-bounds", page_addr);
         return NULL;
@@ -268,6 +313,21 @@ void *pmm_request_page()
     return (void *)ALIGN_UP(page_addr, PAGE_SIZE);
 }
 
+// Drops one reference, true if that was the last one and the frame is free again.
+// Frames that were never handed out (e.g. reclaimed bootloader memory) have none.
+static bool pmm_frame_put(uint64_t page_addr)
+{
+    uint32_t *refs = &frame_refs[page_addr / PAGE_SIZE];
+    if (*refs > 1)
+    {
+        (*refs)--;
+        return false;
+    }
+
+    *refs = 0;
+    return true;
+}
+
 void pmm_release_page(void *page)
 {
     if (page == NULL)
@@ -278,24 +338,81 @@ void pmm_release_page(void *page)
 
     uint64_t page_addr = (uint64_t)page;
 
-    if (!is_page_valid(page_addr))
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+
+    bool overflow = false;
+    if (is_page_valid(page_addr) && pmm_frame_put(page_addr))
     {
-        return;
+        if (stack.idx >= stack.max)
+        {
+            overflow = true;
+        }
+        else
+        {
+            uint64_t cache_idx = hash_page(page_addr);
+            valid_page_cache[cache_idx].page_addr = page_addr;
+            valid_page_cache[cache_idx].is_valid = true;
+            valid_page_cache[cache_idx].access_count = 0;
+
+            cache_head = (cache_head + 1) % CACHE_SIZE;
+            stack.pages[stack.idx++] = page_addr;
+        }
     }
 
-    if (stack.idx >= stack.max)
-    {
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+
+    if (overflow)
         warning("Stack overflow attempt while releasing page");
-        return;
+}
+
+// Releases `count` physical addresses at once, e.g. all frames of a page table
+void pmm_release_pages(uint64_t *pages, uint64_t count)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+
+    bool overflow = false;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (pages[i] == 0 || !is_page_valid(pages[i]) || !pmm_frame_put(pages[i]))
+            continue;
+
+        if (stack.idx >= stack.max)
+        {
+            overflow = true;
+            break;
+        }
+        stack.pages[stack.idx++] = pages[i];
     }
 
-    uint64_t cache_idx = hash_page(page_addr);
-    valid_page_cache[cache_idx].page_addr = page_addr;
-    valid_page_cache[cache_idx].is_valid = true;
-    valid_page_cache[cache_idx].access_count = 0;
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+
+    if (overflow)
+        warning("Stack overflow attempt while releasing %llu pages", count);
+}
+
+// Another owner of an already allocated frame, dropped again by pmm_release_page()
+void pmm_frame_ref(uint64_t page)
+{
+    if (page / PAGE_SIZE >= frame_count)
+        return;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pmm_lock);
+    frame_refs[page / PAGE_SIZE]++;
+    spinlock_release(&pmm_lock);
+    irq_restore(flags);
+}
+
+uint32_t pmm_frame_refcount(uint64_t page)
+{
+    if (page / PAGE_SIZE >= frame_count)
+        return 0;
 
-    cache_head = (cache_head + 1) % CACHE_SIZE;
-    stack.pages[stack.idx++] = page_addr;
+    return __atomic_load_n(&frame_refs[page / PAGE_SIZE], __ATOMIC_RELAXED);
 }
 
 uint64_t pmm_get_free_memory()
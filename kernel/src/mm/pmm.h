@@ -29,6 +29,9 @@ void pmm_init(struct limine_memmap_response *memmap);
 void pmm_vmm_cleanup(struct limine_memmap_response *memmap);
 void *pmm_request_page();
 void pmm_release_page(void *page);
+void pmm_release_pages(uint64_t *pages, uint64_t count);
+void pmm_frame_ref(uint64_t page);
+uint32_t pmm_frame_refcount(uint64_t page);
 uint64_t pmm_get_free_memory();
 uint64_t pmm_get_total_memory();
 
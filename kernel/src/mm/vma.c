@@ -1,6 +1,7 @@
 #include <mm/vma.h>
 #include <lib/memory.h>
 #include <lib/log.h>
+#include <util/cpu.h>
 
 vma_context_t *vma_create_context(uint64_t *pagemap)
 {
@@ -48,6 +49,8 @@ void vma_destroy_context(vma_context_t *ctx)
     {
         trace("Freeing region at 0x%.16llx", (uint64_t)region);
         vma_region_t *next = region->next;
+        if (region->ops && region->ops->close)
+            region->ops->close(region);
         pmm_release_page((void *)PHYSICAL(region));
         region = next;
     }
@@ -56,6 +59,48 @@ void vma_destroy_context(vma_context_t *ctx)
     debug("Destroyed VMA context at 0x%.16llx", (uint64_t)ctx);
 }
 
+// Same regions, but describing `pagemap` (e.g. from vmm_fork_pagemap()). No pages are mapped.
+vma_context_t *vma_clone_context(vma_context_t *ctx, uint64_t *pagemap)
+{
+    if (ctx == NULL || ctx->root == NULL)
+    {
+        error("Invalid context passed to vma_clone_context");
+        return NULL;
+    }
+
+    vma_context_t *clone = vma_create_context(pagemap);
+    if (clone == NULL)
+        return NULL;
+
+    memcpy(clone->root, ctx->root, sizeof(vma_region_t));
+    clone->root->prev = NULL;
+    clone->root->next = NULL;
+
+    vma_region_t *last = clone->root;
+    for (vma_region_t *region = ctx->root->next; region != NULL; region = region->next)
+    {
+        vma_region_t *copy = (vma_region_t *)HIGHER_HALF(pmm_request_page());
+        if (copy == NULL)
+        {
+            error("Failed to allocate VMA region");
+            vma_destroy_context(clone);
+            return NULL;
+        }
+
+        memcpy(copy, region, sizeof(vma_region_t));
+        copy->prev = last;
+        copy->next = NULL;
+        last->next = copy;
+        last = copy;
+
+        if (copy->ops && copy->ops->open)
+            copy->ops->open(copy);
+    }
+
+    trace("Cloned VMA context 0x%.16llx into 0x%.16llx", (uint64_t)ctx, (uint64_t)clone);
+    return clone;
+}
+
 void *vma_alloc(vma_context_t *ctx, uint64_t size, uint64_t flags)
 {
     if (ctx == NULL || ctx->root == NULL || ctx->pagemap == NULL)
@@ -70,7 +115,7 @@ void *vma_alloc(vma_context_t *ctx, uint64_t size, uint64_t flags)
 
     while (region != NULL)
     {
-        if (region->next == NULL || region->start + region->size < region->next->start)
+        if (region->next == NULL || region->start + region->size * PAGE_SIZE + size * PAGE_SIZE <= region->next->start)
         {
             new_region = (vma_region_t *)HIGHER_HALF(pmm_request_page());
             if (new_region == NULL)
@@ -82,9 +127,11 @@ void *vma_alloc(vma_context_t *ctx, uint64_t size, uint64_t flags)
             memset(new_region, 0, sizeof(vma_region_t));
             new_region->size = size;
             new_region->flags = flags;
-            new_region->start = region->start + region->size;
+            new_region->start = region->start + region->size * PAGE_SIZE;
             new_region->next = region->next;
             new_region->prev = region;
+            if (region->next)
+                region->next->prev = new_region;
             region->next = new_region;
 
             for (uint64_t i = 0; i < size; i++)
@@ -115,7 +162,7 @@ void *vma_alloc(vma_context_t *ctx, uint64_t size, uint64_t flags)
 
     last_region->next = new_region;
     new_region->prev = last_region;
-    new_region->start = last_region->start + last_region->size;
+    new_region->start = last_region->start + last_region->size * PAGE_SIZE;
     new_region->size = size;
     new_region->flags = flags;
     new_region->next = NULL;
@@ -146,7 +193,8 @@ void vma_free(vma_context_t *ctx, void *ptr)
     vma_region_t *region = ctx->root;
     while (region != NULL)
     {
-        if (region->start == (uint64_t)ptr)
+        // The root is an empty anchor, the first real region may start at the same address
+        if (region->start == (uint64_t)ptr && (region != ctx->root || region->size))
         {
             trace("Found region to free at 0x%.16llx", (uint64_t)region);
             break;
@@ -166,7 +214,7 @@ void vma_free(vma_context_t *ctx, void *ptr)
     for (uint64_t i = 0; i < region->size; i++)
     {
         uint64_t virt = region->start + i * PAGE_SIZE;
-        uint64_t phys = virt_to_phys(kernel_pagemap, virt);
+        uint64_t phys = virt_to_phys(ctx->pagemap, virt);
 
         if (phys != 0)
         {
@@ -190,9 +238,235 @@ void vma_free(vma_context_t *ctx, void *ptr)
         ctx->root = next;
     }
 
+    if (region->ops && region->ops->close)
+        region->ops->close(region);
     pmm_release_page((void *)PHYSICAL(region));
 }
 
+// Adds a region at a fixed address without mapping anything, its pages are provided by
+// `ops` on first access. Fails if it would overlap another region.
+vma_region_t *vma_insert(vma_context_t *ctx, uint64_t start, uint64_t size, uint64_t flags, const vma_ops_t *ops, void *data)
+{
+    if (ctx == NULL || ctx->root == NULL || start < ctx->root->start || (start & (PAGE_SIZE - 1)))
+    {
+        error("Invalid context or address passed to vma_insert");
+        return NULL;
+    }
+
+    // Regions are sorted by address, find the one we go after
+    vma_region_t *prev = ctx->root;
+    while (prev->next != NULL && prev->next->start < start)
+        prev = prev->next;
+
+    uint64_t end = start + size * PAGE_SIZE;
+    if (prev->start + prev->size * PAGE_SIZE > start || (prev->next && end > prev->next->start))
+    {
+        error("Region 0x%.16llx - 0x%.16llx overlaps an existing one", start, end);
+        return NULL;
+    }
+
+    vma_region_t *region = (vma_region_t *)HIGHER_HALF(pmm_request_page());
+    if (region == NULL)
+    {
+        error("Failed to allocate new VMA region");
+        return NULL;
+    }
+
+    memset(region, 0, sizeof(vma_region_t));
+    region->start = start;
+    region->size = size;
+    region->flags = flags;
+    region->ops = ops;
+    region->data = data;
+    region->prev = prev;
+    region->next = prev->next;
+    if (prev->next)
+        prev->next->prev = region;
+    prev->next = region;
+
+    return region;
+}
+
+// vma_insert() over whatever is in the way (mmap() with MAP_FIXED). Everything that can fail
+// comes first: the new region is allocated and regions sticking out of the range are split
+// before any of the old ones go, so on failure the address space is left as it was.
+vma_region_t *vma_replace(vma_context_t *ctx, uint64_t start, uint64_t size, uint64_t flags, const vma_ops_t *ops, void *data)
+{
+    uint64_t end = start + size * PAGE_SIZE;
+    if (ctx == NULL || ctx->root == NULL || start < ctx->root->start || (start & (PAGE_SIZE - 1)) || end <= start)
+    {
+        error("Invalid context or address passed to vma_replace");
+        return NULL;
+    }
+
+    vma_region_t *region = (vma_region_t *)HIGHER_HALF(pmm_request_page());
+    if (region == NULL)
+    {
+        error("Failed to allocate new VMA region");
+        return NULL;
+    }
+
+    // A split changes nothing about what is mapped, so giving up halfway through is fine
+    vma_region_t *first = vma_find(ctx, start);
+    vma_region_t *last = vma_find(ctx, end - 1);
+    if ((first && first->start < start && !vma_split(first, start)) ||
+        (last && last->start + last->size * PAGE_SIZE > end && !vma_split(last, end)))
+    {
+        pmm_release_page((void *)PHYSICAL(region));
+        return NULL;
+    }
+
+    // Now every region in range lies entirely within it
+    vma_region_t *prev = ctx->root;
+    while (prev->next != NULL && prev->next->start < end)
+    {
+        if (prev->next->start >= start)
+            vma_free(ctx, (void *)prev->next->start);
+        else
+            prev = prev->next;
+    }
+
+    memset(region, 0, sizeof(vma_region_t));
+    region->start = start;
+    region->size = size;
+    region->flags = flags;
+    region->ops = ops;
+    region->data = data;
+    region->prev = prev;
+    region->next = prev->next;
+    if (prev->next)
+        prev->next->prev = region;
+    prev->next = region;
+
+    return region;
+}
+
+// Free range of `size` pages picked like vma_alloc() does, mapping it is up to the caller
+vma_region_t *vma_reserve(vma_context_t *ctx, uint64_t size, uint64_t flags, const vma_ops_t *ops, void *data)
+{
+    if (ctx == NULL || ctx->root == NULL)
+    {
+        error("Invalid context or root passed to vma_reserve");
+        return NULL;
+    }
+
+    vma_region_t *region = ctx->root;
+    while (region->next != NULL && region->start + region->size * PAGE_SIZE + size * PAGE_SIZE > region->next->start)
+        region = region->next;
+
+    uint64_t start = region->start + region->size * PAGE_SIZE;
+    if (ctx->pagemap != kernel_pagemap && start + size * PAGE_SIZE > VMM_USER_END)
+    {
+        error("No room for %llu pages in VMA context 0x%.16llx", size, (uint64_t)ctx);
+        return NULL;
+    }
+    return vma_insert(ctx, start, size, flags, ops, data);
+}
+
+vma_region_t *vma_find(vma_context_t *ctx, uint64_t addr)
+{
+    if (ctx == NULL)
+        return NULL;
+
+    for (vma_region_t *region = ctx->root; region != NULL; region = region->next)
+    {
+        if (addr >= region->start && addr < region->start + region->size * PAGE_SIZE)
+            return region;
+    }
+    return NULL;
+}
+
+// Cuts `region` in two at page aligned `addr` inside it and returns the upper half, which
+// uses the same backing (see vma_ops_t.open) from the matching page on
+vma_region_t *vma_split(vma_region_t *region, uint64_t addr)
+{
+    uint64_t pages = (addr - region->start) / PAGE_SIZE;
+    if ((addr & (PAGE_SIZE - 1)) || pages == 0 || pages >= region->size)
+    {
+        error("Invalid address 0x%.16llx to split region 0x%.16llx at", addr, region->start);
+        return NULL;
+    }
+
+    vma_region_t *upper = (vma_region_t *)HIGHER_HALF(pmm_request_page());
+    if (upper == NULL)
+    {
+        error("Failed to allocate VMA region");
+        return NULL;
+    }
+
+    memcpy(upper, region, sizeof(vma_region_t));
+    upper->start = addr;
+    upper->size = region->size - pages;
+    upper->pgoff = region->pgoff + pages;
+    upper->prev = region;
+    if (region->next)
+        region->next->prev = upper;
+    region->next = upper;
+    region->size = pages;
+
+    if (upper->ops && upper->ops->open)
+        upper->ops->open(upper);
+    return upper;
+}
+
+// Demand paging, maps the page behind a fault on a not yet touched page of a region with a
+// backing. Faults on present pages (COW) are vmm_handle_fault()'s business. Regions user code
+// may not touch at all (PROT_NONE) never get anything mapped. The caller keeps the regions
+// from changing meanwhile, see mm_t.sem.
+bool vma_handle_fault(vma_context_t *ctx, uint64_t addr, uint64_t err)
+{
+    if (err & VMM_FAULT_PRESENT)
+        return false;
+
+    vma_region_t *region = vma_find(ctx, addr);
+    if (region == NULL || region->ops == NULL || region->ops->fault == NULL)
+        return false;
+
+    if (!(region->flags & VMM_USER) || ((err & VMM_FAULT_WRITE) && !(region->flags & VMM_WRITE)))
+        return false;
+
+    uint64_t page = ALIGN_DOWN(addr, PAGE_SIZE);
+    bool shared = false;
+    uint64_t frame = region->ops->fault(region, (page - region->start) / PAGE_SIZE, &shared);
+    if (frame == 0)
+        return false;
+
+    uint64_t flags = region->flags;
+    if (shared && (flags & VMM_WRITE))
+        flags = (flags & ~VMM_WRITE) | VMM_COW;
+
+    uint64_t irq = irq_save();
+    if (virt_to_phys(ctx->pagemap, page))
+    {
+        // Someone sharing the address space got here first
+        irq_restore(irq);
+        pmm_release_page((void *)frame);
+        return true;
+    }
+    vmm_map(ctx->pagemap, page, frame, flags);
+    irq_restore(irq);
+
+    // Writes get their private copy right away instead of faulting once more
+    if ((err & VMM_FAULT_WRITE) && (flags & VMM_COW))
+        return vmm_handle_fault(ctx->pagemap, addr, err | VMM_FAULT_PRESENT);
+
+    return true;
+}
+
+// Makes sure `addr` is mapped, and if `write` no longer copy-on-write, as if user code had
+// just touched it. For callers that care about the frame behind an address (e.g. futexes).
+bool vma_fault_in(vma_context_t *ctx, uint64_t addr, bool write)
+{
+    uint64_t err = VMM_FAULT_USER | (write ? VMM_FAULT_WRITE : 0);
+    if (!virt_to_phys(ctx->pagemap, addr) && !vma_handle_fault(ctx, addr, err))
+        return false;
+
+    // Does nothing unless the page is copy-on-write
+    if (write)
+        vmm_handle_fault(ctx->pagemap, addr, err | VMM_FAULT_PRESENT);
+    return true;
+}
+
 void vma_dump_context(vma_context_t *ctx)
 {
     if (ctx == NULL || ctx->root == NULL)
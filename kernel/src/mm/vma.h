@@ -4,12 +4,29 @@
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+struct vma_region;
+
+// Backing of a region whose pages are only mapped once touched, see vma_handle_fault()
+typedef struct vma_ops
+{
+    // Frame for page `index` of the region, with a reference for the new mapping, or 0.
+    // `shared` is set if other mappings may use it too, writable regions then map it COW.
+    uint64_t (*fault)(struct vma_region *region, uint64_t index, bool *shared);
+    void (*open)(struct vma_region *region);  // Another region uses `data` now (fork)
+    void (*close)(struct vma_region *region); // Region is gone
+} vma_ops_t;
 
 typedef struct vma_region
 {
     uint64_t start;
     uint64_t size;
     uint64_t flags;
+    const vma_ops_t *ops; // NULL for regions mapped up front by vma_alloc()
+    void *data;
+    uint64_t pgoff;    // Page of the backing object the region starts at, for `ops`
+    bool write_denied; // Must not be made writable, e.g. a shared map of a read-only file
     struct vma_region *next;
     struct vma_region *prev;
 } vma_region_t;
@@ -22,7 +39,15 @@ typedef struct vma_context
 
 vma_context_t *vma_create_context(uint64_t *pagemap);
 void vma_destroy_context(vma_context_t *ctx);
+vma_context_t *vma_clone_context(vma_context_t *ctx, uint64_t *pagemap);
 void *vma_alloc(vma_context_t *ctx, uint64_t size, uint64_t flags);
+vma_region_t *vma_reserve(vma_context_t *ctx, uint64_t size, uint64_t flags, const vma_ops_t *ops, void *data);
+vma_region_t *vma_insert(vma_context_t *ctx, uint64_t start, uint64_t size, uint64_t flags, const vma_ops_t *ops, void *data);
+vma_region_t *vma_replace(vma_context_t *ctx, uint64_t start, uint64_t size, uint64_t flags, const vma_ops_t *ops, void *data);
+vma_region_t *vma_find(vma_context_t *ctx, uint64_t addr);
+vma_region_t *vma_split(vma_region_t *region, uint64_t addr);
+bool vma_handle_fault(vma_context_t *ctx, uint64_t addr, uint64_t err);
+bool vma_fault_in(vma_context_t *ctx, uint64_t addr, bool write);
 void vma_free(vma_context_t *ctx, void *ptr);
 void vma_dump_context(vma_context_t *ctx);
 #endif // MM_VMA_H
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <lib/log.h>
 
 uint64_t *kernel_pagemap;
+uint64_t vmm_zero_page; // Always zero, mapped read-only (COW) wherever nothing was written yet
 extern char __limine_requests_start[];
 extern char __limine_requests_end[];
 extern char __text_start[];
@@ -133,10 +134,198 @@ uint64_t *vmm_new_pagemap()
     return pagemap;
 }
 
+// Frees everything mapped by a (PML3 = 3, PML2 = 2, PML1 = 1) table, then the table itself
+static uint64_t vmm_free_table(uint64_t *table, int level)
+{
+    uint64_t freed = 0;
+    if (level == 1)
+    {
+        // Pack the frames to the front of the table and hand them back to the PMM in one go
+        uint64_t n = 0;
+        for (uint64_t i = 0; i < 512; i++)
+        {
+            if (table[i] & VMM_PRESENT)
+                table[n++] = table[i] & VMM_ADDR_MASK;
+        }
+        pmm_release_pages(table, n);
+        freed += n;
+    }
+    else
+    {
+        for (uint64_t i = 0; i < 512; i++)
+        {
+            if (table[i] & VMM_PRESENT)
+                freed += vmm_free_table((uint64_t *)HIGHER_HALF(table[i] & VMM_ADDR_MASK), level - 1);
+        }
+    }
+
+    pmm_release_page((void *)PHYSICAL(table));
+    return freed + 1;
+}
+
+// Copies a (PML3 = 3, PML2 = 2, PML1 = 1) table for vmm_fork_pagemap(). The pages themselves
+// aren't copied but shared, writable ones become read-only copy-on-write pages on both sides.
+static uint64_t *vmm_fork_table(uint64_t *table, int level, uint64_t *shared)
+{
+    uint64_t *copy = (uint64_t *)pmm_request_page();
+    if (copy == NULL)
+        return NULL;
+    copy = (uint64_t *)HIGHER_HALF(copy);
+
+    for (uint64_t i = 0; i < 512; i++)
+    {
+        uint64_t entry = table[i];
+        if (!(entry & VMM_PRESENT))
+            continue;
+
+        if (level == 1)
+        {
+            if ((entry & VMM_WRITE) && !(entry & VMM_SHARED))
+            {
+                entry = (entry & ~VMM_WRITE) | VMM_COW;
+                table[i] = entry;
+            }
+            pmm_frame_ref(entry & VMM_ADDR_MASK);
+            copy[i] = entry;
+            (*shared)++;
+            continue;
+        }
+
+        uint64_t *child = vmm_fork_table((uint64_t *)HIGHER_HALF(entry & VMM_ADDR_MASK), level - 1, shared);
+        if (child == NULL)
+        {
+            // Drops the references taken so far, the parent's COW entries just get resolved
+            // in place on their next write fault
+            vmm_free_table(copy, level);
+            return NULL;
+        }
+        copy[i] = (uint64_t)PHYSICAL(child) | (entry & ~VMM_ADDR_MASK);
+    }
+
+    return copy;
+}
+
+// Duplicates the user half of `pagemap` for fork(). Only the page tables are copied, which
+// keeps this cheap for big address spaces; see vmm_handle_fault() for the actual copying.
+uint64_t *vmm_fork_pagemap(uint64_t *pagemap)
+{
+    uint64_t *child = vmm_new_pagemap();
+    if (child == NULL)
+        return NULL;
+
+    uint64_t shared = 0;
+    for (uint64_t i = 0; i < VMM_USER_PML4_ENTRIES; i++)
+    {
+        if (!(pagemap[i] & VMM_PRESENT))
+            continue;
+
+        uint64_t *table = vmm_fork_table((uint64_t *)HIGHER_HALF(pagemap[i] & VMM_ADDR_MASK), 3, &shared);
+        if (table == NULL)
+        {
+            error("Out of memory while forking pagemap 0x%.16llx", (uint64_t)pagemap);
+            vmm_destroy_pagemap(child);
+            return NULL;
+        }
+        child[i] = (uint64_t)PHYSICAL(table) | (pagemap[i] & ~VMM_ADDR_MASK);
+    }
+
+    // Writable pages of the parent just turned read-only, drop whatever the TLB still has
+    uint64_t cr3;
+    __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+    if ((cr3 & VMM_ADDR_MASK) == (uint64_t)PHYSICAL(pagemap))
+        __asm__ volatile("movq %0, %%cr3" : : "r"(cr3) : "memory");
+
+    trace("Forked pagemap 0x%.16llx into 0x%.16llx, %llu pages shared", (uint64_t)pagemap, (uint64_t)child, shared);
+    return child;
+}
+
+// Leaf entry mapping `virt`, NULL if there is no page table for it
+static uint64_t *vmm_get_pte(uint64_t *pagemap, uint64_t virt)
+{
+    uint64_t *table = pagemap;
+    for (int shift = 39; shift > 12; shift -= 9)
+    {
+        uint64_t entry = table[(virt >> shift) & 0x1ff];
+        if (!(entry & VMM_PRESENT))
+            return NULL;
+        table = (uint64_t *)HIGHER_HALF(entry & VMM_ADDR_MASK);
+    }
+    return &table[(virt >> 12) & 0x1ff];
+}
+
+// Resolves write faults on copy-on-write pages, by copying the page unless we turn out to
+// be the last one sharing it. Returns false for any other fault.
+bool vmm_handle_fault(uint64_t *pagemap, uint64_t virt, uint64_t err)
+{
+    if (!(err & VMM_FAULT_PRESENT) || !(err & VMM_FAULT_WRITE) || virt >= VMM_USER_END)
+        return false;
+
+    uint64_t flags = irq_save();
+    uint64_t *pte = vmm_get_pte(pagemap, virt);
+    if (pte == NULL || (*pte & (VMM_PRESENT | VMM_COW)) != (VMM_PRESENT | VMM_COW))
+    {
+        irq_restore(flags);
+        return false;
+    }
+
+    uint64_t phys = *pte & VMM_ADDR_MASK;
+    uint64_t pte_flags = ((*pte & ~VMM_ADDR_MASK) & ~VMM_COW) | VMM_WRITE;
+    if (pmm_frame_refcount(phys) > 1)
+    {
+        uint64_t copy = (uint64_t)pmm_request_page();
+        if (copy == 0)
+        {
+            irq_restore(flags);
+            error("Out of memory while copying COW page 0x%.16llx", virt);
+            return false;
+        }
+
+        // Fresh pages are zeroed already
+        if (phys != vmm_zero_page)
+            memcpy(HIGHER_HALF(copy), HIGHER_HALF(phys), PAGE_SIZE);
+        *pte = copy | pte_flags;
+        pmm_release_page((void *)phys);
+    }
+    else
+    {
+        // Everyone else already got their own copy
+        *pte = phys | pte_flags;
+    }
+
+    __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    irq_restore(flags);
+    return true;
+}
+
+// New flags for the page mapped at `virt`, keeping its frame. A private page only turns
+// writable through a write fault, which copies it first unless nobody else uses the frame.
+void vmm_protect(uint64_t *pagemap, uint64_t virt, uint64_t flags)
+{
+    uint64_t irq = irq_save();
+    uint64_t *pte = vmm_get_pte(pagemap, virt);
+    if (pte && (*pte & VMM_PRESENT))
+    {
+        if ((flags & VMM_WRITE) && !(flags & VMM_SHARED) && !(*pte & VMM_WRITE))
+            flags = (flags & ~VMM_WRITE) | VMM_COW;
+        *pte = (*pte & VMM_ADDR_MASK) | flags;
+        __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    }
+    irq_restore(irq);
+}
+
+// Tears down the whole user half, frames and page tables included. The higher half tables
+// are shared with kernel_pagemap and stay. Must not be called on the loaded pagemap.
 void vmm_destroy_pagemap(uint64_t *pagemap)
 {
+    uint64_t freed = 0;
+    for (uint64_t i = 0; i < VMM_USER_PML4_ENTRIES; i++)
+    {
+        if (pagemap[i] & VMM_PRESENT)
+            freed += vmm_free_table((uint64_t *)HIGHER_HALF(pagemap[i] & VMM_ADDR_MASK), 3);
+    }
+
     pmm_release_page((void *)PHYSICAL(pagemap));
-    trace("Destroyed pagemap at 0x%.16llx", (uint64_t)pagemap);
+    trace("Destroyed pagemap at 0x%.16llx, %llu pages released", (uint64_t)pagemap, freed + 1);
 }
 
 void vmm_switch_pagemap(uint64_t *new_pagemap)
@@ -157,6 +346,16 @@ void vmm_init()
 
     memset(kernel_pagemap, 0, PAGE_SIZE);
 
+    // Holds on to its reference forever, so it is never handed out again
+    vmm_zero_page = (uint64_t)pmm_request_page();
+
+    // Pre-allocate every higher half PML3, so mappings made later on (kernel heap, stacks) are shared by all pagemaps
+    for (uint64_t i = 256; i < 512; i++)
+    {
+        kernel_pagemap[i] = (uint64_t)pmm_request_page() | VMM_PRESENT | VMM_WRITE;
+    }
+    trace("Pre-allocated higher half PML3 tables.");
+
     for (uint64_t reqs = ALIGN_DOWN(__limine_requests_start, PAGE_SIZE); reqs < ALIGN_UP(__limine_requests_end, PAGE_SIZE); reqs += PAGE_SIZE)
     {
         vmm_map(kernel_pagemap, reqs, reqs - __kernel_virt_base + __kernel_phys_base, VMM_PRESENT | VMM_WRITE);
@@ -204,6 +403,11 @@ void vmm_init()
     }
     trace("Mapped HHDM.");
 
+    // Have the kernel respect read-only pages too, its writes to user memory would bypass COW otherwise
+    uint64_t cr0;
+    __asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("movq %0, %%cr0" : : "r"(cr0 | (1 << 16)) : "memory"); // CR0.WP
+
     vmm_switch_pagemap(kernel_pagemap);
     trace("VMM initialization complete. Switched to kernel pagemap at: 0x%.16llx", (uint64_t)kernel_pagemap);
 }
\ No newline at end of file
@@ -2,13 +2,26 @@
 #define MM_VMM_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define VMM_PRESENT (1ull << 0)
 #define VMM_WRITE (1ull << 1)
 #define VMM_USER (1ull << 2)
+#define VMM_COW (1ull << 9) // Available to software, shared copy-on-write page (VMM_WRITE is cleared)
+#define VMM_SHARED (1ull << 10) // Available to software, writable page fork() must keep shared rather than COW
 #define VMM_NX (1ull << 63)
 
+#define VMM_ADDR_MASK 0x000FFFFFFFFFF000
+#define VMM_USER_PML4_ENTRIES 256 // PML4 slots of the lower (user) half
+#define VMM_USER_END 0x0000800000000000
+
+// Page fault error code bits
+#define VMM_FAULT_PRESENT (1 << 0) // Protection violation rather than a missing page
+#define VMM_FAULT_WRITE (1 << 1)
+#define VMM_FAULT_USER (1 << 2)
+
 extern uint64_t *kernel_pagemap;
+extern uint64_t vmm_zero_page;
 
 void vmm_init();
 void vmm_switch_pagemap(uint64_t *pagemap);
@@ -17,5 +30,8 @@ void vmm_map(uint64_t *pagemap, uint64_t virt, uint64_t phys, uint64_t flags);
 void vmm_unmap(uint64_t *pagemap, uint64_t virt);
 uint64_t virt_to_phys(uint64_t *pagemap, uint64_t virt);
 void vmm_destroy_pagemap(uint64_t *pagemap);
+uint64_t *vmm_fork_pagemap(uint64_t *pagemap);
+bool vmm_handle_fault(uint64_t *pagemap, uint64_t virt, uint64_t err);
+void vmm_protect(uint64_t *pagemap, uint64_t virt, uint64_t flags);
 
 #endif // MM_VMM_H
\ No newline at end of file
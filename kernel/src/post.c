@@ -6,11 +6,22 @@
 #include <lib/assert.h>
 #include <dev/timer/pit.h>
 #include <proc/scheduler.h>
+#include <proc/kthread.h>
+#include <proc/pid.h>
 #include <dev/portio.h>
+#include <proc/exec.h>
 #include <proc/data/elf.h>
+#include <proc/futex.h>
+#include <proc/ring.h>
+#include <fs/pipe.h>
+#include <fs/shmfs.h>
+#include <mm/mmap.h>
 #include <sys/gdt.h>
 #include <dev/input/keyboard.h>
 #include <dev/time/rtc.h>
+#include <sys/timer.h>
+#include <sys/vdso.h>
+#include <sys/syscall.h>
 
 #define GET_KERNEL_CONFIG_VALUE(buff, key) ({ \
     char *value = NULL;                       \
@@ -36,11 +47,82 @@ void final()
     uint64_t free = pmm_get_free_memory();
     uint64_t total = pmm_get_total_memory();
     printf("Free memory:\t%llu MB\nTotal memory:\t%llu MB\n", BYTES_TO_MB(free), BYTES_TO_MB(total));
+    uint64_t avg_late = timer_stats.fired ? timer_stats.total_late_ns / timer_stats.fired : 0;
+    printf("Timers fired:\t%llu (avg jitter %llu us, max %llu us)\n", timer_stats.fired, avg_late / 1000, timer_stats.max_late_ns / 1000);
+    uint64_t avg_latency = sched_stats.preemptions ? sched_stats.total_latency_ns / sched_stats.preemptions : 0;
+    printf("Preemptions:\t%llu (avg latency %llu us, max %llu us)\n", sched_stats.preemptions, avg_latency / 1000, sched_stats.max_latency_ns / 1000);
+    printf("Image cache:\t%llu hits, %llu misses, %llu evictions, %llu pages read\n", elf_cache_stats.hits, elf_cache_stats.misses, elf_cache_stats.evictions, elf_cache_stats.page_ins);
+    printf("Syscalls:\t%llu via SYSCALL, %llu via int 0x80\n", syscall_stats.fast, syscall_stats.legacy);
+    printf("Futexes:\t%llu waits, %llu wakes, %llu requeues, %llu timeouts, %llu raced\n", futex_stats.waits, futex_stats.wakes, futex_stats.requeues, futex_stats.timeouts, futex_stats.mismatches);
+    printf("Rings:\t\t%llu ops over %llu enters, %llu poller wake-ups, %llu held back\n", ring_stats.completed, ring_stats.enters, ring_stats.sq_wakeups, ring_stats.held_back);
+    printf("Splice:\t\t%llu KiB direct, %llu KiB bounced\n", splice_stats.direct / 1024, splice_stats.bounced / 1024);
+    printf("Pipes:\t\t%llu KiB through, %llu reader sleeps, %llu writer sleeps\n", pipe_stats.bytes / 1024, pipe_stats.reader_sleeps, pipe_stats.writer_sleeps);
+    printf("Shm:\t\t%llu objects, %llu pages, %llu mapping faults\n", shm_stats.objects, shm_stats.pages, shm_stats.faults);
+    printf("Mmap:\t\t%llu file pages mapped in place, %llu copied, %llu populated\n", mmap_stats.file_direct, mmap_stats.file_copied, mmap_stats.populated);
     printf("------------------------------------------------------------\n");
     printf("\n");
     printf("\033[0m");
 }
 
+#if EXIT_STRESS
+#define EXIT_STRESS_ROUNDS 100000
+
+// push %rax (touches the stack), then exit(0) through SYSCALL
+static const uint8_t exit_stress_code[] = {0x50, 0xb8, SYS_exit, 0x00, 0x00, 0x00, 0x31, 0xff, 0x0f, 0x05, 0xeb, 0xfe};
+
+// Smallest user address space worth tearing down: a code page, a stack and the vDSO
+static bool exit_stress_image(exec_image_t *image)
+{
+    image->pagemap = vmm_new_pagemap();
+    image->vma_ctx = image->pagemap ? vma_create_context(image->pagemap) : NULL;
+    if (!image->vma_ctx)
+        return false;
+
+    uint64_t code = (uint64_t)vma_alloc(image->vma_ctx, 1, VMM_PRESENT | VMM_USER);
+    uint64_t stack = (uint64_t)vma_alloc(image->vma_ctx, 1, VMM_PRESENT | VMM_WRITE | VMM_USER | VMM_NX);
+    if (!code || !stack || vdso_map(image->vma_ctx) < 0)
+        return false;
+
+    memcpy(HIGHER_HALF(virt_to_phys(image->pagemap, code)), exit_stress_code, sizeof(exit_stress_code));
+    image->entry = code;
+    image->rsp = stack + PAGE_SIZE;
+    return true;
+}
+
+// Spawns EXIT_STRESS_ROUNDS user processes one at a time and lets each exit. Their pids,
+// kernel stacks and every frame of their address spaces (page tables, regions, vDSO page)
+// have to come back. Runs instead of init, so nothing else allocates meanwhile.
+static void exit_stress(void *arg)
+{
+    (void)arg;
+    uint64_t pids = pid_count();
+    uint64_t stacks = kstack_count();
+    uint64_t free = 0;
+
+    for (uint64_t i = 0; i < EXIT_STRESS_ROUNDS; i++)
+    {
+        exec_image_t image = {0};
+        msg_assert(exit_stress_image(&image), "Out of memory building a process, frames leaked");
+        uint64_t pid = scheduler_spawn_image(image.pagemap, image.vma_ctx, image.entry, image.rsp);
+        msg_assert(pid != (uint64_t)-1, "Failed to spawn a process, pids or stacks leaked");
+
+        // Freed on exit, by then the process is reaped too (before anything else runs)
+        while (pid_in_use(pid))
+            scheduler_yield();
+
+        msg_assert(pid_count() == pids, "Exited process kept its pid");
+        msg_assert(kstack_count() == stacks, "Exited process kept its kernel stack");
+
+        // After the heap grew for the first one
+        if (i == 0)
+            free = pmm_get_free_memory();
+    }
+
+    msg_assert(pmm_get_free_memory() == free, "Exited processes leaked frames");
+    info("Exit stress: %d processes spawned and torn down, %llu KiB free throughout", EXIT_STRESS_ROUNDS, free / 1024);
+}
+#endif
+
 extern uint64_t kernel_stack_top;
 void post_main()
 {
@@ -74,10 +156,13 @@ void post_main()
 
     // Initialize tss
     tss_init(kernel_stack_top);
+    idt_set_ist(8, TSS_IST_DOUBLE_FAULT);
 
-    // Finish and spawn init task
-    scheduler_init();
-
+    vdso_init();
+#if EXIT_STRESS
+    (void)init_path;
+    assert(kthread_create(exit_stress, NULL) != (uint64_t)-1);
+#else
     // Load init proc, in usermode
     info("Launching %s as init proc", init_path);
     vnode_t *init = vfs_lazy_lookup(VFS_ROOT()->mount, init_path);
@@ -87,18 +172,18 @@ void post_main()
         hcf();
     }
 
-    char *buf = (char *)kmalloc(init->size);
-    assert(buf);
-    vfs_read(init, buf, init->size, 0);
-    uint64_t *pm = vmm_new_pagemap();
-    trace("Loaded new pagemap at 0x%.16llx", (uint64_t)pm);
-    uint64_t entry = elf_load_binary(buf, pm);
-    assert(entry != 0);
-    uint64_t pid = scheduler_spawn(true, (void (*)(void))entry, pm);
+    const char *init_argv[] = {init_path, NULL};
+    const char *init_envp[] = {NULL};
+    exec_image_t image;
+    assert(exec_load(init, init_argv, init_envp, 0, 0, &image) == 0);
+    uint64_t pid = scheduler_spawn_image(image.pagemap, image.vma_ctx, image.entry, image.rsp);
     trace("Spawned %s with pid %d", init_path, pid);
     scheduler_set_final(final);
+#endif
 
     // Init the timer, aka start the scheduler
+    timer_init();
+    scheduler_start();
     pit_init();
     hlt();
 }
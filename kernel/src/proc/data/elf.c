@@ -2,6 +2,9 @@
 #include <lib/assert.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <util/errno.h>
+#include <mm/kmalloc.h>
+#include <lib/spinlock.h>
 #include <config.h>
 
 typedef struct
@@ -69,99 +72,461 @@ typedef struct
 #define PF_W 0x2 // Write
 #define PF_R 0x4 // Read
 
-uint64_t elf_load_binary(void *data, uint64_t *pagemap)
+#define ELF_MAX_PHNUM 32 // Sanity limit, real binaries have a handful
+#define ELF_CACHE_MAX 16 // Images kept around, the least recently used one goes first
+
+struct elf_image;
+
+// A PT_LOAD segment as it sits in the cache, pages are only read in once somebody touches them
+typedef struct elf_segment
+{
+    uint64_t start; // Page aligned
+    uint64_t pages;
+    uint64_t flags; // VMM flags the segment asks for
+    uint64_t vaddr; // As in the program header
+    uint64_t offset;
+    uint64_t filesz;
+    uint64_t *frames; // The cache's own reference on each page read so far, 0 if not yet
+    struct elf_image *image;
+} elf_segment_t;
+
+// A loaded executable, shared by every process running it
+typedef struct elf_image
 {
-    assert(data);
-    elf_header_t *header = (elf_header_t *)data;
+    vnode_t *node; // Key, NULL once the file changed or went away (see elf_cache_invalidate())
+    elf_info_t info;
+    elf_segment_t segments[ELF_MAX_PHNUM];
+    uint64_t segment_count;
+    uint64_t users; // elf_load()s and regions using it, freed once evicted and unused
+    bool cached;
+    struct elf_image *next;
+} elf_image_t;
 
-    if (header->e_magic != ELF_MAGIC)
+elf_cache_stats_t elf_cache_stats = {0};
+
+static elf_image_t *cache_head = NULL; // Most recently used first
+static uint64_t cache_count = 0;
+static spinlock_t cache_lock = SPINLOCK_INIT;
+
+static void elf_image_free(elf_image_t *image)
+{
+    for (uint64_t i = 0; i < image->segment_count; i++)
     {
-        error("Invalid ELF magic: 0x%x", header->e_magic);
-        return 0;
+        // Frames still mapped somewhere keep living until those mappings go
+        pmm_release_pages(image->segments[i].frames, image->segments[i].pages);
+        kfree(image->segments[i].frames);
     }
+    kfree(image);
+}
 
-    if (header->e_class != 2)
+// Reads straight through the node's ops, without vfs_read() taking the vnode lock. The caller
+// either holds that lock itself, or is a fault that must not take it (see elf_segment_fault()).
+static int elf_read(vnode_t *node, void *buf, size_t size, size_t offset)
+{
+    if (!node->ops || !node->ops->read)
+        return -1;
+    return node->ops->read(node, buf, size, offset);
+}
+
+// Parses the headers of `node`, segment contents are left to elf_segment_fault(). The caller
+// holds the vnode lock.
+static int elf_image_read(vnode_t *node, elf_image_t *image)
+{
+    elf_header_t header;
+    if (elf_read(node, &header, sizeof(header), 0) != sizeof(header))
     {
-        error("Unsupported ELF class (not 64-bit): %u", header->e_class);
-        return 0;
+        error("ELF file too small for its header");
+        return -ENOEXEC;
     }
 
-    if (header->e_type != 2)
+    if (header.e_magic != ELF_MAGIC)
     {
-        error("Unsupported ELF type (not executable): %u", header->e_type);
-        return 0;
+        error("Invalid ELF magic: 0x%x", header.e_magic);
+        return -ENOEXEC;
+    }
+
+    if (header.e_class != 2)
+    {
+        error("Unsupported ELF class (not 64-bit): %u", header.e_class);
+        return -ENOEXEC;
+    }
+
+    if (header.e_type != 2)
+    {
+        error("Unsupported ELF type (not executable): %u", header.e_type);
+        return -ENOEXEC;
     }
 
-    elf_pheader_t *ph = (elf_pheader_t *)((uint8_t *)data + header->e_phoff);
+    if (header.e_phentsize != sizeof(elf_pheader_t) || header.e_phnum == 0 || header.e_phnum > ELF_MAX_PHNUM)
+    {
+        error("Unsupported program headers: %u entries of %u bytes", header.e_phnum, header.e_phentsize);
+        return -ENOEXEC;
+    }
 
-    for (uint16_t i = 0; i < header->e_phnum; i++)
+    elf_pheader_t ph[ELF_MAX_PHNUM];
+    int ph_size = header.e_phnum * sizeof(elf_pheader_t);
+    if (elf_read(node, ph, ph_size, header.e_phoff) != ph_size)
     {
+        error("Program headers past the end of the file");
+        return -ENOEXEC;
+    }
+
+    image->info.entry = header.e_entry;
+    image->info.phdr = 0;
+    image->info.phent = header.e_phentsize;
+    image->info.phnum = header.e_phnum;
+
+    for (uint16_t i = 0; i < header.e_phnum; i++)
+    {
+        if (ph[i].p_type == PT_PHDR)
+            image->info.phdr = ph[i].p_vaddr;
+
         if (ph[i].p_type != PT_LOAD)
             continue;
 
-        uint64_t vaddr_start = ALIGN_DOWN(ph[i].p_vaddr, PAGE_SIZE);
-        uint64_t vaddr_end = ALIGN_UP(ph[i].p_vaddr + ph[i].p_memsz, PAGE_SIZE);
-        uint64_t offset = ph[i].p_offset;
+        if (ph[i].p_filesz > ph[i].p_memsz || ph[i].p_vaddr + ph[i].p_memsz >= VMM_USER_END ||
+            ph[i].p_offset + ph[i].p_filesz > node->size)
+        {
+            error("Invalid ELF segment %u", i);
+            return -ENOEXEC;
+        }
+
+        // Without PT_PHDR, find the headers in whatever segment loaded them
+        if (!image->info.phdr && header.e_phoff >= ph[i].p_offset && header.e_phoff + ph_size <= ph[i].p_offset + ph[i].p_filesz)
+            image->info.phdr = ph[i].p_vaddr + (header.e_phoff - ph[i].p_offset);
+
+        elf_segment_t *seg = &image->segments[image->segment_count];
+        seg->start = ALIGN_DOWN(ph[i].p_vaddr, PAGE_SIZE);
+        seg->pages = (ALIGN_UP(ph[i].p_vaddr + ph[i].p_memsz, PAGE_SIZE) - seg->start) / PAGE_SIZE;
+        seg->vaddr = ph[i].p_vaddr;
+        seg->offset = ph[i].p_offset;
+        seg->filesz = ph[i].p_filesz;
+        seg->image = image;
+        seg->frames = kcalloc(seg->pages ? seg->pages : 1, sizeof(uint64_t));
+        if (!seg->frames)
+            return -ENOMEM;
+        image->segment_count++;
 
-        uint64_t flags = VMM_PRESENT;
+        seg->flags = VMM_PRESENT;
         if (ph[i].p_flags & PF_W)
-            flags |= VMM_WRITE;
+            seg->flags |= VMM_WRITE;
         if (!(ph[i].p_flags & PF_X))
-            flags |= VMM_NX;
+            seg->flags |= VMM_NX;
 
-        flags |= VMM_USER; // User mode access
+        seg->flags |= VMM_USER; // User mode access
 
-        trace("Loading ELF segment %u: vaddr 0x%llx - 0x%llx, offset 0x%llx, filesz 0x%llx, memsz 0x%llx, flags 0x%llx",
-              i, vaddr_start, vaddr_end, offset, ph[i].p_filesz, ph[i].p_memsz, flags);
+        trace("Loading ELF segment %u: vaddr 0x%llx, %llu pages, offset 0x%llx, filesz 0x%llx, memsz 0x%llx, flags 0x%llx",
+              i, seg->start, seg->pages, ph[i].p_offset, ph[i].p_filesz, ph[i].p_memsz, seg->flags);
 
-        uint64_t page_offset = ph[i].p_vaddr & (PAGE_SIZE - 1);
+    }
+
+    return 0;
+}
+
+// Reads page `page` of `seg` from the image's file into a frame of its own, which becomes the
+// cache's reference. With cache_lock held, so the node can't go away meanwhile, and without
+// the vnode lock (see elf_segment_fault()). Returns 0 if it couldn't be read.
+static uint64_t elf_page_read(elf_segment_t *seg, uint64_t page)
+{
+    uint64_t vaddr = seg->start + page * PAGE_SIZE;
+    uint64_t from = MAX(vaddr, seg->vaddr);
+    uint64_t to = MIN(vaddr + PAGE_SIZE, seg->vaddr + seg->filesz);
+
+    uint64_t frame = (uint64_t)pmm_request_page();
+    if (!frame)
+    {
+        error("Out of physical memory while loading ELF page 0x%llx", vaddr);
+        return 0;
+    }
+
+    int size = to - from;
+    if (elf_read(seg->image->node, HIGHER_HALF(frame) + (from - vaddr), size, seg->offset + (from - seg->vaddr)) != size)
+    {
+        error("Failed to read ELF page 0x%llx", vaddr);
+        pmm_release_page((void *)frame);
+        return 0;
+    }
+
+    seg->frames[page] = frame;
+    elf_cache_stats.page_ins++;
+    return frame;
+}
+
+// Whether page `page` of `seg` has anything from the file, rather than only .bss
+static bool elf_page_in_file(elf_segment_t *seg, uint64_t page)
+{
+    uint64_t vaddr = seg->start + page * PAGE_SIZE;
+    return MAX(vaddr, seg->vaddr) < MIN(vaddr + PAGE_SIZE, seg->vaddr + seg->filesz);
+}
 
-        for (uint64_t vaddr = vaddr_start; vaddr < vaddr_end; vaddr += PAGE_SIZE)
+static void elf_cache_unlink(elf_image_t *image)
+{
+    for (elf_image_t **link = &cache_head; *link; link = &(*link)->next)
+    {
+        if (*link == image)
         {
-            uint64_t phys = (uint64_t)pmm_request_page();
-            if (!phys)
-            {
-                error("Out of physical memory while loading ELF segment.");
-                return 0;
-            }
+            *link = image->next;
+            image->cached = false;
+            cache_count--;
+            return;
+        }
+    }
+}
+
+// Drops an image from the cache, it is freed right away unless something still uses it
+static void elf_cache_evict(elf_image_t *image)
+{
+    elf_cache_unlink(image);
+    if (image->users == 0)
+        elf_image_free(image);
+}
+
+static void elf_cache_put(elf_image_t *image)
+{
+    spinlock_acquire(&cache_lock);
+    if (--image->users == 0 && !image->cached)
+        elf_image_free(image);
+    spinlock_release(&cache_lock);
+}
+
+// Cached image of `node`, read in on a miss. Release with elf_cache_put(). Fails with
+// -ETXTBSY while the file is being written, it would be half old and half new. Runs with the
+// vnode lock held, so no write can start before the image counts as in use (see
+// elf_cache_write_begin()).
+static int elf_cache_get(vnode_t *node, elf_image_t **out)
+{
+    spinlock_acquire(&node->lock);
+    if (node->writers)
+    {
+        spinlock_release(&node->lock);
+        return -ETXTBSY;
+    }
+
+    spinlock_acquire(&cache_lock);
+    for (elf_image_t *image = cache_head; image; image = image->next)
+    {
+        if (image->node != node)
+            continue;
+
+        elf_cache_unlink(image);
+        image->next = cache_head;
+        image->cached = true;
+        cache_head = image;
+        cache_count++;
+
+        image->users++;
+        elf_cache_stats.hits++;
+        spinlock_release(&cache_lock);
+        spinlock_release(&node->lock);
+        *out = image;
+        return 0;
+    }
+    elf_cache_stats.misses++;
+    spinlock_release(&cache_lock);
+
+    // Only the headers are read here, that is quick
+    elf_image_t *image = kcalloc(1, sizeof(elf_image_t));
+    if (!image)
+    {
+        spinlock_release(&node->lock);
+        return -ENOMEM;
+    }
+    image->node = node;
+
+    int ret = elf_image_read(node, image);
+    if (ret < 0)
+    {
+        spinlock_release(&node->lock);
+        elf_image_free(image);
+        return ret;
+    }
+
+    spinlock_acquire(&cache_lock);
+    image->users = 1;
+    image->cached = true;
+    image->next = cache_head;
+    cache_head = image;
+    cache_count++;
+
+    if (cache_count > ELF_CACHE_MAX)
+    {
+        elf_image_t *last = cache_head;
+        while (last->next)
+            last = last->next;
+        elf_cache_evict(last);
+        elf_cache_stats.evictions++;
+    }
+    spinlock_release(&cache_lock);
+    spinlock_release(&node->lock);
+
+    *out = image;
+    return 0;
+}
+
+static elf_image_t *elf_cache_find(vnode_t *node)
+{
+    for (elf_image_t *image = cache_head; image; image = image->next)
+    {
+        if (image->node == node)
+            return image;
+    }
+    return NULL;
+}
+
+// Called by the VFS with the vnode locked before it writes to or truncates `node`. Drops the
+// cached image, or refuses with -ETXTBSY while a process runs it: pages it hasn't touched yet
+// are still read from the file. Until elf_cache_write_end(), exec() of the node fails instead.
+int elf_cache_write_begin(vnode_t *node)
+{
+    if (node->type != VNODE_FILE)
+        return 0; // Nothing else gets exec()ed, and writes to devices and pipes are frequent
 
-            vmm_map(pagemap, vaddr, phys, flags);
-            memset((void *)HIGHER_HALF(phys), 0, PAGE_SIZE);
+    spinlock_acquire(&cache_lock);
+    elf_image_t *image = elf_cache_find(node);
+    if (image && image->users)
+    {
+        spinlock_release(&cache_lock);
+        return -ETXTBSY;
+    }
+    if (image)
+    {
+        image->node = NULL;
+        elf_cache_evict(image);
+    }
+    spinlock_release(&cache_lock);
+
+    node->writers++;
+    return 0;
+}
+
+void elf_cache_write_end(vnode_t *node)
+{
+    if (node->type == VNODE_FILE)
+        node->writers--;
+}
 
-            uint64_t file_page_offset = offset + (vaddr - vaddr_start);
-            uint64_t file_data_end = offset + ph[i].p_filesz;
+// Forget about `node` because it is being deleted. Called by the VFS with the vnode locked.
+// Processes still running the image get every page they haven't touched yet read in first,
+// nothing can be read from the node afterwards.
+void elf_cache_invalidate(vnode_t *node)
+{
+    if (node->type != VNODE_FILE)
+        return;
 
-            if (file_page_offset < file_data_end)
+    spinlock_acquire(&cache_lock);
+    elf_image_t *image = elf_cache_find(node);
+    if (image)
+    {
+        for (uint64_t i = 0; i < image->segment_count && image->users; i++)
+        {
+            elf_segment_t *seg = &image->segments[i];
+            for (uint64_t page = 0; page < seg->pages; page++)
             {
-                uint64_t bytes_from_start = vaddr - vaddr_start;
-                uint64_t page_data_offset = 0;
-
-                if (bytes_from_start == 0 && page_offset > 0)
-                {
-                    page_data_offset = page_offset;
-                }
-
-                uint64_t copy_offset = file_page_offset;
-                uint64_t copy_size = PAGE_SIZE - page_data_offset;
-
-                if (copy_offset + copy_size > file_data_end)
-                {
-                    copy_size = file_data_end - copy_offset;
-                }
-
-                if (copy_size > 0)
-                {
-                    void *dest = (void *)(HIGHER_HALF(phys) + page_data_offset);
-                    void *src = (uint8_t *)data + copy_offset;
-                    memcpy(dest, src, copy_size);
-
-                    trace("Copied 0x%llx bytes from ELF file offset 0x%llx to vaddr 0x%llx (phys 0x%llx)",
-                          copy_size, copy_offset, vaddr + page_data_offset, phys + page_data_offset);
-                }
+                // A page that fails to read (out of memory) kills whoever faults on it later
+                if (!seg->frames[page] && elf_page_in_file(seg, page))
+                    elf_page_read(seg, page);
             }
         }
+
+        image->node = NULL;
+        elf_cache_evict(image);
+    }
+    spinlock_release(&cache_lock);
+}
+
+// Page `index` of a segment region, read from the file by whoever touches it first. The
+// frame then stays in the cache for everyone else running the image. The vnode lock is not
+// taken: the fault may come from a read() of this very file into a page it hasn't touched yet,
+// which holds it. Nothing can change the file meanwhile, writes are refused while the image is
+// in use, and a delete reads every page in (under cache_lock) before the node goes.
+static uint64_t elf_segment_fault(vma_region_t *region, uint64_t index, bool *shared)
+{
+    elf_segment_t *seg = region->data;
+    uint64_t page = (region->start - seg->start) / PAGE_SIZE + index;
+    if (page >= seg->pages)
+        return 0;
+
+    // Mapped COW by writable segments, so the page never changes
+    *shared = true;
+
+    if (!elf_page_in_file(seg, page))
+    {
+        // Nothing but .bss, no need for a frame of its own until written
+        pmm_frame_ref(vmm_zero_page);
+        return vmm_zero_page;
+    }
+
+    spinlock_acquire(&cache_lock);
+    uint64_t frame = seg->frames[page];
+    if (!frame && seg->image->node)
+        frame = elf_page_read(seg, page);
+    if (frame)
+        pmm_frame_ref(frame);
+    spinlock_release(&cache_lock);
+    return frame;
+}
+
+static void elf_segment_open(vma_region_t *region)
+{
+    elf_segment_t *seg = region->data;
+    spinlock_acquire(&cache_lock);
+    seg->image->users++;
+    spinlock_release(&cache_lock);
+}
+
+static void elf_segment_close(vma_region_t *region)
+{
+    elf_segment_t *seg = region->data;
+    elf_cache_put(seg->image);
+}
+
+static const vma_ops_t elf_segment_ops = {
+    .fault = elf_segment_fault,
+    .open = elf_segment_open,
+    .close = elf_segment_close,
+};
+
+// Sets up a region for every PT_LOAD segment of `node` in `ctx`, nothing is mapped until
+// touched. The pages come from the image cache: read-only ones are shared outright, writable
+// ones copy-on-write and .bss starts out as the zero page. Regions added before a failure
+// stay in `ctx` and are freed along with it.
+int elf_load(vnode_t *node, vma_context_t *ctx, elf_info_t *info)
+{
+    assert(node && ctx && info);
+
+    elf_image_t *image;
+    int ret = elf_cache_get(node, &image);
+    if (ret < 0)
+        return ret;
+
+    for (uint64_t i = 0; i < image->segment_count && ret == 0; i++)
+    {
+        elf_segment_t *seg = &image->segments[i];
+
+        // Segments sharing a page, the later one wins
+        vma_region_t *prev = vma_find(ctx, seg->start);
+        if (prev && prev->ops == &elf_segment_ops)
+        {
+            prev->size = (seg->start - prev->start) / PAGE_SIZE;
+            if (prev->size == 0)
+                vma_free(ctx, (void *)prev->start);
+        }
+
+        spinlock_acquire(&cache_lock);
+        image->users++; // The region's, dropped by elf_segment_close()
+        spinlock_release(&cache_lock);
+        if (!vma_insert(ctx, seg->start, seg->pages, seg->flags, &elf_segment_ops, seg))
+        {
+            elf_cache_put(image);
+            ret = -ENOEXEC;
+        }
     }
 
-    trace("ELF loaded successfully, entry point: 0x%llx", header->e_entry);
-    return header->e_entry;
-}
\ No newline at end of file
+    *info = image->info;
+    elf_cache_put(image);
+    if (ret < 0)
+        return ret;
+
+    trace("ELF loaded successfully, entry point: 0x%llx", info->entry);
+    return 0;
+}
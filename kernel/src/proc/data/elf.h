@@ -2,7 +2,31 @@
 #define PROC_DATA_ELF_H
 
 #include <stdint.h>
+#include <dev/vfs.h>
+#include <mm/vma.h>
 
-uint64_t elf_load_binary(void *data, uint64_t *pagemap);
+// What the loader learned about the image, mostly for the auxiliary vector
+typedef struct elf_info
+{
+    uint64_t entry;
+    uint64_t phdr; // Where the program headers got mapped, 0 if they didn't
+    uint64_t phent;
+    uint64_t phnum;
+} elf_info_t;
 
-#endif // PROC_DATA_ELF_H
\ No newline at end of file
+typedef struct elf_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t page_ins; // Pages read from a file, once per image
+} elf_cache_stats_t;
+
+extern elf_cache_stats_t elf_cache_stats;
+
+int elf_load(vnode_t *node, vma_context_t *ctx, elf_info_t *info);
+int elf_cache_write_begin(vnode_t *node);
+void elf_cache_write_end(vnode_t *node);
+void elf_cache_invalidate(vnode_t *node);
+
+#endif // PROC_DATA_ELF_H
@@ -0,0 +1,271 @@
+#include <proc/exec.h>
+#include <proc/scheduler.h>
+#include <proc/data/elf.h>
+#include <mm/kmalloc.h>
+#include <mm/vmm.h>
+#include <lib/log.h>
+#include <lib/memory.h>
+#include <util/errno.h>
+#include <util/cpu.h>
+#include <dev/timer/pit.h>
+#include <sys/vdso.h>
+
+#define EXEC_AUXV_MAX 13 // Pairs, AT_NULL included
+
+// argv and envp strings, packed back to back in kernel memory
+typedef struct exec_args
+{
+    char *strings;
+    size_t size;
+    uint64_t argc;
+    uint64_t envc;
+} exec_args_t;
+
+// Counts `list` towards the limits, it may still live in the old image's memory
+static int exec_args_count(const char *const list[], uint64_t *count, size_t *size)
+{
+    for (uint64_t i = 0; list && list[i]; i++)
+    {
+        *size += strlen(list[i]) + 1;
+        if (++*count > EXEC_ARGS_MAX || *size > EXEC_ARG_MAX)
+            return -E2BIG;
+    }
+    return 0;
+}
+
+static char *exec_args_pack(char *dest, const char *const list[], uint64_t count)
+{
+    for (uint64_t i = 0; i < count; i++)
+    {
+        size_t len = strlen(list[i]) + 1;
+        memcpy(dest, list[i], len);
+        dest += len;
+    }
+    return dest;
+}
+
+// Copies argv and envp out of the caller's memory, before the address space goes away
+static int exec_args_copy(exec_args_t *args, const char *const argv[], const char *const envp[])
+{
+    memset(args, 0, sizeof(exec_args_t));
+
+    uint64_t total = 0;
+    if (exec_args_count(argv, &total, &args->size) < 0)
+        return -E2BIG;
+    args->argc = total;
+    if (exec_args_count(envp, &total, &args->size) < 0)
+        return -E2BIG;
+    args->envc = total - args->argc;
+
+    args->strings = kmalloc(args->size ? args->size : 1);
+    if (!args->strings)
+        return -ENOMEM;
+
+    char *end = exec_args_pack(args->strings, argv, args->argc);
+    exec_args_pack(end, envp, args->envc);
+    return 0;
+}
+
+// Copies into a pagemap that isn't loaded, through the HHDM
+static void exec_copy_out(uint64_t *pagemap, uint64_t virt, const void *src, size_t size)
+{
+    while (size > 0)
+    {
+        uint64_t page_offset = virt & (PAGE_SIZE - 1);
+        size_t chunk = MIN(size, PAGE_SIZE - page_offset);
+        memcpy(HIGHER_HALF(virt_to_phys(pagemap, virt)) + page_offset, src, chunk);
+        virt += chunk;
+        src = (const uint8_t *)src + chunk;
+        size -= chunk;
+    }
+}
+
+// Seed for AT_RANDOM, there is no proper entropy source yet so this is far from cryptographic
+static uint64_t exec_random()
+{
+    static uint64_t state = 0;
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    state += (((uint64_t)hi << 32) | lo) + 0x9e3779b97f4a7c15;
+
+    // splitmix64
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+// Lays out the initial process stack the SysV ABI describes, from `stack_top` down:
+//   strings, AT_RANDOM bytes, (padding), auxv, NULL, envp[], NULL, argv[], argc <- rsp
+static int exec_build_stack(exec_image_t *image, exec_args_t *args, elf_info_t *info, uint64_t stack_top, uint64_t uid, uint64_t gid)
+{
+    uint64_t strings_at = stack_top - args->size;
+    uint64_t random_at = ALIGN_DOWN(strings_at - 16, 16);
+
+    uint64_t auxv[EXEC_AUXV_MAX][2];
+    uint64_t auxc = 0;
+    if (info->phdr)
+    {
+        auxv[auxc][0] = AT_PHDR;
+        auxv[auxc++][1] = info->phdr;
+    }
+    auxv[auxc][0] = AT_PHENT;
+    auxv[auxc++][1] = info->phent;
+    auxv[auxc][0] = AT_PHNUM;
+    auxv[auxc++][1] = info->phnum;
+    auxv[auxc][0] = AT_PAGESZ;
+    auxv[auxc++][1] = PAGE_SIZE;
+    auxv[auxc][0] = AT_ENTRY;
+    auxv[auxc++][1] = info->entry;
+    auxv[auxc][0] = AT_UID;
+    auxv[auxc++][1] = uid;
+    auxv[auxc][0] = AT_EUID;
+    auxv[auxc++][1] = uid;
+    auxv[auxc][0] = AT_GID;
+    auxv[auxc++][1] = gid;
+    auxv[auxc][0] = AT_EGID;
+    auxv[auxc++][1] = gid;
+    auxv[auxc][0] = AT_RANDOM;
+    auxv[auxc++][1] = random_at;
+    if (args->argc)
+    {
+        auxv[auxc][0] = AT_EXECFN;
+        auxv[auxc++][1] = strings_at; // argv[0]
+    }
+    auxv[auxc][0] = AT_VDSO;
+    auxv[auxc++][1] = VDSO_BASE;
+    auxv[auxc][0] = AT_NULL;
+    auxv[auxc++][1] = 0;
+
+    uint64_t words = 1 + (args->argc + 1) + (args->envc + 1) + auxc * 2;
+    uint64_t sp = ALIGN_DOWN(random_at - words * sizeof(uint64_t), 16);
+
+    // Leave the program at least a page of stack of its own
+    size_t size = stack_top - sp;
+    if (size > (EXEC_STACK_PAGES - 1) * PAGE_SIZE)
+        return -E2BIG;
+
+    uint8_t *buf = kcalloc(1, size);
+    if (!buf)
+        return -ENOMEM;
+
+    uint64_t *out = (uint64_t *)buf;
+    *out++ = args->argc;
+
+    // argv[] and envp[], each NULL terminated, pointing into the strings copied below
+    uint64_t str = strings_at;
+    const char *p = args->strings;
+    uint64_t counts[2] = {args->argc, args->envc};
+    for (int list = 0; list < 2; list++)
+    {
+        for (uint64_t i = 0; i < counts[list]; i++)
+        {
+            *out++ = str;
+            uint64_t len = strlen(p) + 1;
+            str += len;
+            p += len;
+        }
+        *out++ = 0;
+    }
+
+    memcpy(out, auxv, auxc * sizeof(auxv[0]));
+
+    uint64_t random[2] = {exec_random(), exec_random()};
+    memcpy(buf + (random_at - sp), random, sizeof(random));
+    memcpy(buf + (strings_at - sp), args->strings, args->size);
+
+    exec_copy_out(image->pagemap, sp, buf, size);
+    kfree(buf);
+
+    image->rsp = sp;
+    return 0;
+}
+
+// Counterpart of exec_load() for images that never got to run
+static void exec_image_free(exec_image_t *image)
+{
+    if (image->vma_ctx)
+        vma_destroy_context(image->vma_ctx);
+    vmm_destroy_pagemap(image->pagemap);
+}
+
+// Builds a new user address space running `node`, without touching the caller's.
+// argv and envp are copied first, so they may point into the address space being replaced.
+int exec_load(vnode_t *node, const char *const argv[], const char *const envp[], uint64_t uid, uint64_t gid, exec_image_t *image)
+{
+    if (!node || node->type != VNODE_FILE)
+        return -EACCES;
+
+    exec_args_t args;
+    int ret = exec_args_copy(&args, argv, envp);
+    if (ret < 0)
+        return ret;
+
+    memset(image, 0, sizeof(exec_image_t));
+    image->pagemap = vmm_new_pagemap();
+    image->vma_ctx = vma_create_context(image->pagemap);
+
+    elf_info_t info;
+    ret = image->vma_ctx ? elf_load(node, image->vma_ctx, &info) : -ENOMEM;
+    if (ret == 0)
+    {
+        uint64_t stack = (uint64_t)vma_alloc(image->vma_ctx, EXEC_STACK_PAGES, VMM_PRESENT | VMM_WRITE | VMM_USER | VMM_NX);
+        ret = stack ? vdso_map(image->vma_ctx) : -ENOMEM;
+        if (ret == 0)
+            ret = exec_build_stack(image, &args, &info, stack + EXEC_STACK_PAGES * PAGE_SIZE, uid, gid);
+    }
+
+    kfree(args.strings);
+    if (ret < 0)
+    {
+        exec_image_free(image);
+        return ret;
+    }
+
+    image->entry = info.entry;
+    return 0;
+}
+
+// execve() for the current process: same PCB, pid and descriptors, brand new address space.
+// On failure the old image is left intact and the caller just gets the error back. Other
+// threads keep running in the old address space, there is no de_thread() (yet).
+int exec_replace(const char *path, const char *const argv[], const char *const envp[])
+{
+    pcb_t *proc = scheduler_get_current();
+    if (!proc || proc->kernel)
+        return -ESRCH;
+
+    uint64_t start = pit_get_ns();
+    vnode_t *node = vfs_lazy_lookup(VFS_ROOT()->mount, path);
+    if (!node)
+        return -ENOENT;
+
+    exec_image_t image;
+    int ret = exec_load(node, argv, envp, proc->whoami.uid, proc->whoami.gid, &image);
+    if (ret < 0)
+        return ret;
+
+    mm_t *mm = mm_create(image.pagemap, image.vma_ctx);
+    if (!mm)
+    {
+        exec_image_free(&image);
+        return -ENOMEM;
+    }
+
+    // Point of no return, switch over before the old pagemap goes away under us
+    mm_t *old_mm = proc->mm;
+    uint64_t flags = irq_save();
+    proc->mm = mm;
+    vmm_switch_pagemap(mm->pagemap);
+    irq_restore(flags);
+    mm_release(old_mm);
+
+    scheduler_reset_user_frame(proc, image.entry, image.rsp);
+    scheduler_set_fs_base(proc, 0);
+    proc->clear_child_tid = 0;
+    vdso_update_proc(proc);
+
+    // `path` went away with the old image
+    trace("Process %d is now running %s, exec took %llu us", proc->pid, node->name, (pit_get_ns() - start) / 1000);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef PROC_EXEC_H
+#define PROC_EXEC_H
+
+#include <stdint.h>
+#include <dev/vfs.h>
+#include <mm/vma.h>
+
+#define EXEC_STACK_PAGES 16          // Initial user stack, argv/envp/auxv included
+#define EXEC_ARG_MAX (8 * PAGE_SIZE) // argv and envp strings together
+#define EXEC_ARGS_MAX 1024           // argv and envp entries together
+
+// Auxiliary vector types
+#define AT_NULL 0
+#define AT_PHDR 3
+#define AT_PHENT 4
+#define AT_PHNUM 5
+#define AT_PAGESZ 6
+#define AT_ENTRY 9
+#define AT_UID 11
+#define AT_EUID 12
+#define AT_GID 13
+#define AT_EGID 14
+#define AT_RANDOM 25
+#define AT_EXECFN 31
+#define AT_VDSO 0x5600 // Base of our vDSO, not an ELF image like AT_SYSINFO_EHDR, see sys/vdso.h
+
+// A freshly built user address space, ready to be run by a process
+typedef struct exec_image
+{
+    uint64_t *pagemap;
+    vma_context_t *vma_ctx;
+    uint64_t entry;
+    uint64_t rsp; // Points at argc, as the SysV ABI wants it
+} exec_image_t;
+
+int exec_load(vnode_t *node, const char *const argv[], const char *const envp[], uint64_t uid, uint64_t gid, exec_image_t *image);
+int exec_replace(const char *path, const char *const argv[], const char *const envp[]);
+
+#endif // PROC_EXEC_H
@@ -0,0 +1,171 @@
+#include <proc/fdtable.h>
+#include <mm/kmalloc.h>
+#include <lib/memory.h>
+#include <lib/log.h>
+
+static bool fd_table_alloc_slots(fd_table_t *table, uint64_t size)
+{
+    file_t **fds = (file_t **)kcalloc(size, sizeof(file_t *));
+    uint64_t *used = (uint64_t *)kcalloc(size / 64, sizeof(uint64_t));
+    if (!fds || !used)
+    {
+        kfree(fds);
+        kfree(used);
+        return false;
+    }
+
+    if (table->fds)
+    {
+        memcpy(fds, table->fds, table->size * sizeof(file_t *));
+        memcpy(used, table->used, table->size / 64 * sizeof(uint64_t));
+        kfree(table->fds);
+        kfree(table->used);
+    }
+
+    table->fds = fds;
+    table->used = used;
+    table->size = size;
+    return true;
+}
+
+fd_table_t *fd_table_create()
+{
+    fd_table_t *table = (fd_table_t *)kmalloc(sizeof(fd_table_t));
+    if (!table)
+        return NULL;
+
+    memset(table, 0, sizeof(fd_table_t));
+    spinlock_init(&table->lock);
+    table->refcount = 1;
+    if (!fd_table_alloc_slots(table, FD_TABLE_INITIAL_SIZE))
+    {
+        kfree(table);
+        return NULL;
+    }
+    return table;
+}
+
+// Another user of the same table, e.g. a thread
+fd_table_t *fd_table_share(fd_table_t *table)
+{
+    spinlock_acquire(&table->lock);
+    table->refcount++;
+    spinlock_release(&table->lock);
+    return table;
+}
+
+// Private copy with the same descriptor numbers, e.g. for fork. The open files themselves
+// are shared, positions included.
+fd_table_t *fd_table_clone(fd_table_t *table)
+{
+    fd_table_t *copy = (fd_table_t *)kmalloc(sizeof(fd_table_t));
+    if (!copy)
+        return NULL;
+
+    memset(copy, 0, sizeof(fd_table_t));
+    spinlock_init(&copy->lock);
+    copy->refcount = 1;
+
+    spinlock_acquire(&table->lock);
+    if (!fd_table_alloc_slots(copy, table->size))
+    {
+        spinlock_release(&table->lock);
+        kfree(copy);
+        return NULL;
+    }
+    memcpy(copy->fds, table->fds, table->size * sizeof(file_t *));
+    memcpy(copy->used, table->used, table->size / 64 * sizeof(uint64_t));
+    for (uint64_t fd = 0; fd < copy->size; fd++)
+    {
+        if (copy->fds[fd])
+            file_get(copy->fds[fd]);
+    }
+    copy->count = table->count;
+    copy->hint = table->hint;
+    spinlock_release(&table->lock);
+    return copy;
+}
+
+void fd_table_release(fd_table_t *table)
+{
+    if (!table)
+        return;
+
+    spinlock_acquire(&table->lock);
+    bool last = --table->refcount == 0;
+    spinlock_release(&table->lock);
+    if (!last)
+        return;
+
+    for (uint64_t fd = 0; fd < table->size; fd++)
+        file_put(table->fds[fd]);
+    kfree(table->fds);
+    kfree(table->used);
+    kfree(table);
+}
+
+// Puts `file` in the lowest free slot, growing the table if it is full. The slot takes over
+// the caller's reference.
+int fd_alloc(fd_table_t *table, file_t *file)
+{
+    spinlock_acquire(&table->lock);
+    uint64_t words = table->size / 64;
+    uint64_t word = table->hint;
+    while (word < words && table->used[word] == ~0ull)
+        word++;
+
+    if (word == words)
+    {
+        if (table->size >= FD_TABLE_MAX_SIZE || !fd_table_alloc_slots(table, MIN(table->size * 2, FD_TABLE_MAX_SIZE)))
+        {
+            spinlock_release(&table->lock);
+            return -1;
+        }
+    }
+
+    int bit = __builtin_ctzll(~table->used[word]);
+    int fd = word * 64 + bit;
+    table->used[word] |= 1ull << bit;
+    table->fds[fd] = file;
+    table->count++;
+    table->hint = word;
+    spinlock_release(&table->lock);
+    return fd;
+}
+
+int fd_free(fd_table_t *table, int fd)
+{
+    spinlock_acquire(&table->lock);
+    if (fd < 0 || (uint64_t)fd >= table->size || table->fds[fd] == NULL)
+    {
+        spinlock_release(&table->lock);
+        return -1;
+    }
+
+    file_t *file = table->fds[fd];
+    table->fds[fd] = NULL;
+    table->used[fd / 64] &= ~(1ull << (fd % 64));
+    table->count--;
+    if ((uint64_t)fd / 64 < table->hint)
+        table->hint = fd / 64;
+    spinlock_release(&table->lock);
+
+    // Calls still using it keep it alive
+    file_put(file);
+    return 0;
+}
+
+// Returns a reference of its own, a concurrent close() can't pull the file out from under
+// the caller. Drop it with file_put().
+file_t *fd_get(fd_table_t *table, int fd)
+{
+    if (!table || fd < 0)
+        return NULL;
+
+    spinlock_acquire(&table->lock);
+    file_t *file = (uint64_t)fd < table->size ? table->fds[fd] : NULL;
+    if (file)
+        file_get(file);
+    spinlock_release(&table->lock);
+    return file;
+}
@@ -0,0 +1,34 @@
+#ifndef PROC_FDTABLE_H
+#define PROC_FDTABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <dev/file.h>
+#include <lib/spinlock.h>
+
+#define FD_TABLE_INITIAL_SIZE 64 // One bitmap word, enough for most processes
+#define FD_TABLE_MAX_SIZE 1024   // that shuold hopefully be plenty
+
+// Growable descriptor table, descriptor numbers stay stable until they are closed.
+// Can be shared between processes (threads), freed once the last user releases it. Every
+// slot holds a reference to its file.
+typedef struct fd_table
+{
+    file_t **fds;
+    uint64_t *used;    // Bitmap of allocated slots
+    uint64_t size;     // Slots in fds, always a multiple of 64
+    uint64_t count;    // Open descriptors
+    uint64_t hint;     // No free slot below this bitmap word
+    uint64_t refcount;
+    spinlock_t lock;
+} fd_table_t;
+
+fd_table_t *fd_table_create();
+fd_table_t *fd_table_share(fd_table_t *table);
+fd_table_t *fd_table_clone(fd_table_t *table);
+void fd_table_release(fd_table_t *table);
+int fd_alloc(fd_table_t *table, file_t *file);
+int fd_free(fd_table_t *table, int fd);
+file_t *fd_get(fd_table_t *table, int fd);
+
+#endif // PROC_FDTABLE_H
@@ -0,0 +1,280 @@
+#include <proc/futex.h>
+#include <proc/scheduler.h>
+#include <proc/wait.h>
+#include <mm/vma.h>
+#include <lib/log.h>
+
+// A task sleeping in futex_wait(), lives on its kernel stack
+typedef struct futex_waiter
+{
+    uint64_t key; // Physical address of the word, changed by requeueing
+    uint32_t bitset;
+    pcb_t *proc;
+    bool woken;
+    struct futex_waiter *next;
+} futex_waiter_t;
+
+typedef struct futex_bucket
+{
+    spinlock_t lock;
+    futex_waiter_t *head; // FIFO, so wake-ups are fair
+    futex_waiter_t *tail;
+} futex_bucket_t;
+
+futex_stats_t futex_stats = {0};
+
+static futex_bucket_t buckets[FUTEX_HASH_SIZE]; // Zeroed, so unlocked and empty
+
+// Physical address of the word at `uaddr` in the current address space, 0 if there is none.
+// Keying by frame rather than by address makes shared mappings just work. Copy-on-write is
+// broken up front, otherwise the first write to the word would move it to another frame and
+// strand its waiters on the old one.
+static uint64_t futex_key(uint32_t *uaddr)
+{
+    pcb_t *proc = scheduler_get_current();
+    uint64_t addr = (uint64_t)uaddr;
+    if (!proc || addr >= VMM_USER_END || (addr & (sizeof(uint32_t) - 1)))
+        return 0;
+
+    rwsem_read_lock(&proc->mm->sem);
+    bool present = vma_fault_in(proc->mm->vma_ctx, addr, true);
+    rwsem_read_unlock(&proc->mm->sem);
+    if (!present)
+        return 0;
+
+    uint64_t phys = virt_to_phys(proc->mm->pagemap, addr);
+    return phys ? phys + (addr & (PAGE_SIZE - 1)) : 0;
+}
+
+static futex_bucket_t *futex_bucket(uint64_t key)
+{
+    // Words are 4 byte aligned, and neighbouring ones often both see use
+    uint64_t hash = (key >> 2) * 0x9e3779b97f4a7c15;
+    return &buckets[hash >> (64 - FUTEX_HASH_BITS)];
+}
+
+static void futex_enqueue(futex_bucket_t *bucket, futex_waiter_t *waiter)
+{
+    waiter->next = NULL;
+    if (bucket->tail)
+        bucket->tail->next = waiter;
+    else
+        bucket->head = waiter;
+    bucket->tail = waiter;
+}
+
+// Unlinks `waiter` from `bucket`, its predecessor is `prev` (NULL for the head)
+static void futex_unlink(futex_bucket_t *bucket, futex_waiter_t *prev, futex_waiter_t *waiter)
+{
+    if (prev)
+        prev->next = waiter->next;
+    else
+        bucket->head = waiter->next;
+    if (bucket->tail == waiter)
+        bucket->tail = prev;
+    waiter->next = NULL;
+}
+
+static bool futex_remove(futex_bucket_t *bucket, futex_waiter_t *waiter)
+{
+    futex_waiter_t *prev = NULL;
+    for (futex_waiter_t *cur = bucket->head; cur; prev = cur, cur = cur->next)
+    {
+        if (cur == waiter)
+        {
+            futex_unlink(bucket, prev, cur);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Both buckets locked, in a fixed order so two requeues can't deadlock
+static void futex_lock_pair(futex_bucket_t *a, futex_bucket_t *b)
+{
+    if (a > b)
+    {
+        futex_bucket_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    spinlock_acquire(&a->lock);
+    if (a != b)
+        spinlock_acquire(&b->lock);
+}
+
+static void futex_unlock_pair(futex_bucket_t *a, futex_bucket_t *b)
+{
+    if (a != b)
+        spinlock_release(&b->lock);
+    spinlock_release(&a->lock);
+}
+
+// Sleeps until woken through the same word, as long as it still holds `val`. The check and
+// going to sleep are atomic against futex_wake(), so a wake-up can't get lost in between.
+// Returns 0 once woken, -EAGAIN if the word changed already or -ETIMEDOUT.
+int futex_wait(uint32_t *uaddr, uint32_t val, uint64_t timeout_ns, uint32_t bitset)
+{
+    if (bitset == 0)
+        return -EINVAL;
+
+    uint64_t key = futex_key(uaddr);
+    if (!key)
+        return -EFAULT;
+
+    futex_waiter_t waiter = {.key = key, .bitset = bitset, .proc = scheduler_get_current(), .woken = false};
+    futex_bucket_t *bucket = futex_bucket(key);
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&bucket->lock);
+
+    // Present and writable, futex_key() just made sure of it
+    if (__atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != val)
+    {
+        spinlock_release(&bucket->lock);
+        irq_restore(flags);
+        futex_stats.mismatches++;
+        return -EAGAIN;
+    }
+
+    futex_enqueue(bucket, &waiter);
+    spinlock_release(&bucket->lock);
+    futex_stats.waits++;
+
+    int ret = 0;
+    if (timeout_ns == FUTEX_NO_TIMEOUT)
+        wait_event(NULL, waiter.woken);
+    else
+        ret = wait_event_timeout(NULL, waiter.woken, timeout_ns);
+
+    if (ret < 0)
+    {
+        // Requeueing may have moved us, but not while interrupts are off
+        bucket = futex_bucket(waiter.key);
+        spinlock_acquire(&bucket->lock);
+        if (!waiter.woken)
+        {
+            futex_remove(bucket, &waiter);
+            futex_stats.timeouts++;
+        }
+        else
+        {
+            ret = 0; // Woken right at the deadline, take it
+        }
+        spinlock_release(&bucket->lock);
+    }
+
+    irq_restore(flags);
+    return ret;
+}
+
+// Wakes `waiter`, with its bucket locked
+static void futex_wake_one(futex_bucket_t *bucket, futex_waiter_t *prev, futex_waiter_t *waiter)
+{
+    futex_unlink(bucket, prev, waiter);
+    waiter->woken = true;
+    scheduler_unblock(waiter->proc);
+    futex_stats.wakes++;
+}
+
+// Wakes up to `nr` tasks waiting on `uaddr` with a bitset sharing a bit with `bitset`.
+// Returns how many got woken.
+int futex_wake(uint32_t *uaddr, uint32_t nr, uint32_t bitset)
+{
+    if (bitset == 0)
+        return -EINVAL;
+
+    uint64_t key = futex_key(uaddr);
+    if (!key)
+        return -EFAULT;
+
+    futex_bucket_t *bucket = futex_bucket(key);
+    int woken = 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&bucket->lock);
+    futex_waiter_t *prev = NULL;
+    futex_waiter_t *cur = bucket->head;
+    while (cur && (uint32_t)woken < nr)
+    {
+        futex_waiter_t *next = cur->next;
+        if (cur->key == key && (cur->bitset & bitset))
+        {
+            futex_wake_one(bucket, prev, cur);
+            woken++;
+        }
+        else
+        {
+            prev = cur;
+        }
+        cur = next;
+    }
+    spinlock_release(&bucket->lock);
+    irq_restore(flags);
+
+    return woken;
+}
+
+// Wakes up to `nr_wake` waiters of `uaddr` and moves up to `nr_requeue` of the rest over to
+// `uaddr2`, without waking them (e.g. a condition variable broadcast handing over to the
+// mutex). With `cmp` nothing happens unless `uaddr` still holds `cmpval`.
+// Returns the number of tasks woken plus requeued.
+int futex_requeue(uint32_t *uaddr, uint32_t nr_wake, uint32_t nr_requeue, uint32_t *uaddr2, bool cmp, uint32_t cmpval)
+{
+    uint64_t key = futex_key(uaddr);
+    uint64_t key2 = futex_key(uaddr2);
+    if (!key || !key2)
+        return -EFAULT;
+
+    futex_bucket_t *bucket = futex_bucket(key);
+    futex_bucket_t *bucket2 = futex_bucket(key2);
+    int woken = 0;
+    int requeued = 0;
+
+    uint64_t flags = irq_save();
+    futex_lock_pair(bucket, bucket2);
+
+    if (cmp && __atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != cmpval)
+    {
+        futex_unlock_pair(bucket, bucket2);
+        irq_restore(flags);
+        futex_stats.mismatches++;
+        return -EAGAIN;
+    }
+
+    futex_waiter_t *prev = NULL;
+    futex_waiter_t *cur = bucket->head;
+    while (cur && ((uint32_t)woken < nr_wake || (uint32_t)requeued < nr_requeue))
+    {
+        futex_waiter_t *next = cur->next;
+        if (cur->key != key)
+        {
+            prev = cur;
+        }
+        else if ((uint32_t)woken < nr_wake)
+        {
+            futex_wake_one(bucket, prev, cur);
+            woken++;
+        }
+        else if (key2 != key)
+        {
+            futex_unlink(bucket, prev, cur);
+            cur->key = key2;
+            futex_enqueue(bucket2, cur);
+            requeued++;
+            futex_stats.requeues++;
+        }
+        else
+        {
+            // Same word, it stays where it is
+            prev = cur;
+            requeued++;
+        }
+        cur = next;
+    }
+
+    futex_unlock_pair(bucket, bucket2);
+    irq_restore(flags);
+
+    return woken + requeued;
+}
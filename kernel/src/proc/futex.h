@@ -0,0 +1,38 @@
+#ifndef PROC_FUTEX_H
+#define PROC_FUTEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// futex() operations, same values as Linux
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAKE_BITSET 10
+#define FUTEX_PRIVATE_FLAG 128 // Accepted, keys are physical addresses either way
+#define FUTEX_CMD_MASK (~FUTEX_PRIVATE_FLAG)
+
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+#define FUTEX_HASH_BITS 6 // 64 buckets, waiters of unrelated words rarely share one
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+#define FUTEX_NO_TIMEOUT ((uint64_t)-1)
+
+typedef struct futex_stats
+{
+    uint64_t waits;    // Tasks that actually went to sleep
+    uint64_t wakes;    // Tasks woken up by futex_wake()/futex_requeue()
+    uint64_t requeues; // Tasks moved over to another word
+    uint64_t timeouts;
+    uint64_t mismatches; // Waits that returned right away, the word had changed already
+} futex_stats_t;
+
+extern futex_stats_t futex_stats;
+
+int futex_wait(uint32_t *uaddr, uint32_t val, uint64_t timeout_ns, uint32_t bitset);
+int futex_wake(uint32_t *uaddr, uint32_t nr, uint32_t bitset);
+int futex_requeue(uint32_t *uaddr, uint32_t nr_wake, uint32_t nr_requeue, uint32_t *uaddr2, bool cmp, uint32_t cmpval);
+
+#endif // PROC_FUTEX_H
@@ -0,0 +1,108 @@
+#include <proc/kstack.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <lib/spinlock.h>
+#include <lib/log.h>
+#include <util/cpu.h>
+
+// Kernel stacks live in their own part of the higher half, which is shared by every pagemap.
+// Slot i spans [KSTACK_REGION_START + i * KSTACK_SLOT_SIZE, +KSTACK_SLOT_SIZE), its first page
+// is never mapped, so running off the end of a stack faults instead of corrupting a neighbour.
+static uint64_t kstack_used[KSTACK_MAX_SLOTS / 64] = {0};
+static spinlock_t kstack_lock = SPINLOCK_INIT;
+
+static uint64_t kstack_slot_base(uint64_t slot)
+{
+    return KSTACK_REGION_START + slot * KSTACK_SLOT_SIZE;
+}
+
+// Returns the lowest usable address, the stack top is that plus KSTACK_PAGES pages
+void *kstack_alloc()
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&kstack_lock);
+
+    uint64_t slot = (uint64_t)-1;
+    for (uint64_t i = 0; i < KSTACK_MAX_SLOTS / 64; i++)
+    {
+        if (kstack_used[i] != ~0ull)
+        {
+            slot = i * 64 + __builtin_ctzll(~kstack_used[i]);
+            kstack_used[i] |= 1ull << (slot % 64);
+            break;
+        }
+    }
+
+    if (slot == (uint64_t)-1)
+    {
+        spinlock_release(&kstack_lock);
+        irq_restore(flags);
+        error("Out of kernel stack slots");
+        return NULL;
+    }
+
+    uint64_t stack = kstack_slot_base(slot) + PAGE_SIZE;
+    for (uint64_t i = 0; i < KSTACK_PAGES; i++)
+    {
+        uint64_t phys = (uint64_t)pmm_request_page();
+        if (phys == 0)
+        {
+            for (uint64_t j = 0; j < i; j++)
+            {
+                pmm_release_page((void *)virt_to_phys(kernel_pagemap, stack + j * PAGE_SIZE));
+                vmm_unmap(kernel_pagemap, stack + j * PAGE_SIZE);
+            }
+            kstack_used[slot / 64] &= ~(1ull << (slot % 64));
+            spinlock_release(&kstack_lock);
+            irq_restore(flags);
+            error("Out of memory for a kernel stack");
+            return NULL;
+        }
+        vmm_map(kernel_pagemap, stack + i * PAGE_SIZE, phys, VMM_PRESENT | VMM_WRITE | VMM_NX);
+    }
+
+    spinlock_release(&kstack_lock);
+    irq_restore(flags);
+    return (void *)stack;
+}
+
+void kstack_free(void *stack)
+{
+    uint64_t addr = (uint64_t)stack;
+    if (addr < KSTACK_REGION_START || (addr - KSTACK_REGION_START) % KSTACK_SLOT_SIZE != PAGE_SIZE)
+    {
+        error("Invalid kernel stack %p passed to kstack_free", stack);
+        return;
+    }
+
+    uint64_t slot = (addr - KSTACK_REGION_START) / KSTACK_SLOT_SIZE;
+    uint64_t flags = irq_save();
+    spinlock_acquire(&kstack_lock);
+    for (uint64_t i = 0; i < KSTACK_PAGES; i++)
+    {
+        uint64_t virt = addr + i * PAGE_SIZE;
+        pmm_release_page((void *)virt_to_phys(kernel_pagemap, virt));
+        vmm_unmap(kernel_pagemap, virt);
+    }
+    kstack_used[slot / 64] &= ~(1ull << (slot % 64));
+    spinlock_release(&kstack_lock);
+    irq_restore(flags);
+}
+
+// Stacks handed out right now
+uint64_t kstack_count()
+{
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < KSTACK_MAX_SLOTS / 64; i++)
+        for (uint64_t word = kstack_used[i]; word; word &= word - 1)
+            count++;
+    return count;
+}
+
+// Whether a faulting address is the guard page of some kernel stack, i.e. a stack overflow
+bool kstack_is_guard(uint64_t addr)
+{
+    if (addr < KSTACK_REGION_START || addr >= KSTACK_REGION_START + KSTACK_MAX_SLOTS * KSTACK_SLOT_SIZE)
+        return false;
+    return (addr - KSTACK_REGION_START) % KSTACK_SLOT_SIZE < PAGE_SIZE;
+}
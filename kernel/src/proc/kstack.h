@@ -0,0 +1,16 @@
+#ifndef PROC_KSTACK_H
+#define PROC_KSTACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define KSTACK_PAGES 4                                    // Usable pages per kernel stack
+#define KSTACK_SLOT_SIZE ((KSTACK_PAGES + 1) * PAGE_SIZE) // Plus one unmapped guard page below
+#define KSTACK_MAX_SLOTS 2048                             // One per possible task
+
+void *kstack_alloc();
+void kstack_free(void *stack);
+uint64_t kstack_count();
+bool kstack_is_guard(uint64_t addr);
+
+#endif // PROC_KSTACK_H
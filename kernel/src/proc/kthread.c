@@ -0,0 +1,56 @@
+#include <proc/kthread.h>
+#include <mm/vmm.h>
+#include <lib/log.h>
+#include <lib/assert.h>
+
+// Threads that return from their entry end up here, see task_entry_kernel in proc/switch.S
+[[noreturn]] void kthread_exit()
+{
+    irq_save();
+    scheduler_exit(0);
+    scheduler_yield();
+
+    // We are never scheduled again once terminated
+    hlt();
+}
+
+uint64_t kthread_create(kthread_fn_t entry, void *arg)
+{
+    uint64_t pid = scheduler_spawn_kernel(entry, arg);
+    if (pid == (uint64_t)-1)
+        return pid;
+
+    trace("Created kernel thread %d with entry %p", pid, entry);
+    return pid;
+}
+
+// Lets the current kernel thread work on a process' behalf, e.g. touch its user memory and
+// descriptors. Takes over the caller's reference to `mm`, until kthread_unuse_mm().
+void kthread_use_mm(mm_t *mm, fd_table_t *files, user_t whoami)
+{
+    pcb_t *proc = scheduler_get_current();
+    assert(proc && proc->kernel && proc->mm == &kernel_mm);
+
+    uint64_t flags = irq_save();
+    proc->mm = mm;
+    proc->files = files;
+    proc->whoami = whoami;
+    vmm_switch_pagemap(mm->pagemap);
+    irq_restore(flags);
+}
+
+// Back to the kernel address space, drops the reference kthread_use_mm() took over
+void kthread_unuse_mm()
+{
+    pcb_t *proc = scheduler_get_current();
+    assert(proc && proc->kernel && proc->mm != &kernel_mm);
+
+    mm_t *mm = proc->mm;
+    uint64_t flags = irq_save();
+    proc->mm = &kernel_mm;
+    proc->files = NULL;
+    proc->whoami = (user_t){0};
+    vmm_switch_pagemap(kernel_mm.pagemap);
+    irq_restore(flags);
+    mm_release(mm);
+}
@@ -0,0 +1,15 @@
+#ifndef PROC_KTHREAD_H
+#define PROC_KTHREAD_H
+
+#include <stdint.h>
+#include <proc/scheduler.h>
+#include <util/cpu.h>
+
+typedef void (*kthread_fn_t)(void *arg);
+
+uint64_t kthread_create(kthread_fn_t entry, void *arg);
+[[noreturn]] void kthread_exit();
+void kthread_use_mm(mm_t *mm, fd_table_t *files, user_t whoami);
+void kthread_unuse_mm();
+
+#endif // PROC_KTHREAD_H
@@ -0,0 +1,114 @@
+#include <proc/mm.h>
+#include <proc/ring.h>
+#include <mm/kmalloc.h>
+#include <lib/memory.h>
+#include <lib/log.h>
+
+// Takes over `pagemap` and `vma_ctx`, e.g. from exec_load()
+mm_t *mm_create(uint64_t *pagemap, vma_context_t *vma_ctx)
+{
+    mm_t *mm = (mm_t *)kmalloc(sizeof(mm_t));
+    if (!mm)
+        return NULL;
+
+    memset(mm, 0, sizeof(mm_t));
+    spinlock_init(&mm->lock);
+    rwsem_init(&mm->sem);
+    mm->pagemap = pagemap;
+    mm->vma_ctx = vma_ctx;
+    mm->refcount = 1;
+    return mm;
+}
+
+// Another thread running in the same address space
+mm_t *mm_share(mm_t *mm)
+{
+    spinlock_acquire(&mm->lock);
+    mm->refcount++;
+    spinlock_release(&mm->lock);
+    return mm;
+}
+
+// Like mm_share(), but fails once the last reference is gone and the address space is on
+// its way out, for holders that don't keep it alive themselves (see ring_detach())
+mm_t *mm_tryget(mm_t *mm)
+{
+    spinlock_acquire(&mm->lock);
+    bool alive = mm->refcount > 0;
+    if (alive)
+        mm->refcount++;
+    spinlock_release(&mm->lock);
+    return alive ? mm : NULL;
+}
+
+// Private copy for fork(), every page is shared copy-on-write. The regions can't change while
+// they are copied, and the copy runs under the lock too, so no other thread of ours runs (and
+// writes through a stale TLB entry) before the flush after write-protecting our pages.
+mm_t *mm_fork(mm_t *mm)
+{
+    rwsem_write_lock(&mm->sem);
+    spinlock_acquire(&mm->lock);
+    uint64_t *pagemap = vmm_fork_pagemap(mm->pagemap);
+    vma_context_t *vma_ctx = pagemap ? vma_clone_context(mm->vma_ctx, pagemap) : NULL;
+    spinlock_release(&mm->lock);
+    rwsem_write_unlock(&mm->sem);
+    if (!pagemap)
+        return NULL;
+
+    mm_t *copy = vma_ctx ? mm_create(pagemap, vma_ctx) : NULL;
+    if (!copy)
+    {
+        error("Failed to duplicate address space 0x%.16llx", (uint64_t)mm);
+        if (vma_ctx)
+            vma_destroy_context(vma_ctx);
+        vmm_destroy_pagemap(pagemap);
+        return NULL;
+    }
+    return copy;
+}
+
+// Whether the kernel may touch `size` bytes at user address `addr` of the loaded `mm`, store
+// to them if `write`: every page in a region user code may access that way, mapped and (for
+// writes) past copy-on-write. A kernel fault on user memory is fatal, so syscalls check every
+// pointer they are handed with this before going through it.
+bool mm_user_access(mm_t *mm, uint64_t addr, size_t size, bool write)
+{
+    if (!addr || addr >= VMM_USER_END || size > VMM_USER_END - addr)
+        return false;
+
+    bool ok = true;
+    rwsem_read_lock(&mm->sem);
+    for (uint64_t page = ALIGN_DOWN(addr, PAGE_SIZE); ok && page < addr + size; page += PAGE_SIZE)
+    {
+        vma_region_t *region = vma_find(mm->vma_ctx, page);
+        ok = region && (region->flags & VMM_USER) && (!write || ((region->flags & VMM_WRITE) && !region->write_denied)) &&
+             vma_fault_in(mm->vma_ctx, page, write);
+    }
+    rwsem_read_unlock(&mm->sem);
+    return ok;
+}
+
+// Like mm_user_access() for storing, and naturally aligned so the store is atomic. For pointers
+// handed in by a process that are written to later, outside of any syscall (e.g. clone()'s tids).
+bool mm_user_writable(mm_t *mm, uint64_t addr, size_t size)
+{
+    return !(addr & (size - 1)) && mm_user_access(mm, addr, size, true);
+}
+
+// The last user must not have the pagemap loaded anymore
+void mm_release(mm_t *mm)
+{
+    spinlock_acquire(&mm->lock);
+    bool last = --mm->refcount == 0;
+    spinlock_release(&mm->lock);
+    if (!last)
+        return;
+
+    if (mm->ring)
+        ring_detach(mm->ring);
+
+    // The regions' frames are mapped in the pagemap and released with it
+    vma_destroy_context(mm->vma_ctx);
+    vmm_destroy_pagemap(mm->pagemap);
+    kfree(mm);
+}
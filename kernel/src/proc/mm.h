@@ -0,0 +1,32 @@
+#ifndef PROC_MM_H
+#define PROC_MM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <mm/vma.h>
+#include <lib/spinlock.h>
+#include <proc/rwsem.h>
+
+struct ring;
+
+// A user address space, shared by the threads of a process and freed with the last of them
+typedef struct mm
+{
+    uint64_t *pagemap;
+    vma_context_t *vma_ctx;
+    struct ring *ring; // Submission ring set up in here, see ring_setup(), NULL if none
+    uint64_t refcount;
+    spinlock_t lock; // refcount, ring
+    rwsem_t sem;     // The regions, faults hold it for reading and whatever changes them for writing
+} mm_t;
+
+mm_t *mm_create(uint64_t *pagemap, vma_context_t *vma_ctx);
+mm_t *mm_share(mm_t *mm);
+mm_t *mm_tryget(mm_t *mm);
+mm_t *mm_fork(mm_t *mm);
+bool mm_user_access(mm_t *mm, uint64_t addr, size_t size, bool write);
+bool mm_user_writable(mm_t *mm, uint64_t addr, size_t size);
+void mm_release(mm_t *mm);
+
+#endif // PROC_MM_H
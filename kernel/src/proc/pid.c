@@ -0,0 +1,75 @@
+#include <proc/pid.h>
+#include <lib/spinlock.h>
+#include <lib/memory.h>
+#include <util/cpu.h>
+
+#define PID_WORDS (PID_MAX / 64)
+
+static uint64_t pid_bitmap[PID_WORDS] = {0};
+static uint64_t pid_last = PID_MAX - 1; // Allocation continues after this, so the first pid is 0
+static uint64_t pid_used = 0;
+static spinlock_t pid_lock = SPINLOCK_INIT;
+
+void pid_init()
+{
+    memset(pid_bitmap, 0, sizeof(pid_bitmap));
+    pid_last = PID_MAX - 1;
+    pid_used = 0;
+}
+
+// Hands out pids in increasing order and wraps around, so a freed pid isn't
+// reused right away. Scans at most every bitmap word once.
+uint64_t pid_alloc()
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pid_lock);
+
+    uint64_t pid = PID_NONE;
+    uint64_t start = (pid_last + 1) % PID_MAX;
+    uint64_t word = start / 64;
+    uint64_t free = ~pid_bitmap[word] & (~0ull << (start % 64)); // Only bits at or after start
+    for (uint64_t i = 0; i <= PID_WORDS; i++)
+    {
+        if (free)
+        {
+            pid = word * 64 + __builtin_ctzll(free);
+            pid_bitmap[word] |= 1ull << (pid % 64);
+            pid_last = pid;
+            pid_used++;
+            break;
+        }
+
+        word = (word + 1) % PID_WORDS;
+        free = ~pid_bitmap[word];
+    }
+
+    spinlock_release(&pid_lock);
+    irq_restore(flags);
+    return pid;
+}
+
+void pid_free(uint64_t pid)
+{
+    if (pid >= PID_MAX)
+        return;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&pid_lock);
+    if (pid_bitmap[pid / 64] & (1ull << (pid % 64)))
+    {
+        pid_bitmap[pid / 64] &= ~(1ull << (pid % 64));
+        pid_used--;
+    }
+    spinlock_release(&pid_lock);
+    irq_restore(flags);
+}
+
+bool pid_in_use(uint64_t pid)
+{
+    return pid < PID_MAX && (pid_bitmap[pid / 64] & (1ull << (pid % 64)));
+}
+
+uint64_t pid_count()
+{
+    return pid_used;
+}
@@ -0,0 +1,16 @@
+#ifndef PROC_PID_H
+#define PROC_PID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PID_MAX 2048            // that should be plenty, pids are [0, PID_MAX)
+#define PID_NONE ((uint64_t)-1) // Returned when no pid is free
+
+void pid_init();
+uint64_t pid_alloc();
+void pid_free(uint64_t pid);
+bool pid_in_use(uint64_t pid);
+uint64_t pid_count();
+
+#endif // PROC_PID_H
@@ -0,0 +1,28 @@
+#include <proc/preempt.h>
+#include <proc/scheduler.h>
+#include <lib/spinlock.h>
+
+volatile uint32_t preempt_counts[PREEMPT_MAX_CPUS] = {0};
+
+// Explicit preemption point for long running kernel loops, gives up the CPU if our
+// timeslice ran out (or someone more important woke up) and nothing keeps us atomic.
+void cond_resched()
+{
+    if (preempt_count() == 0 && scheduler_need_resched())
+        scheduler_schedule();
+}
+
+// Like cond_resched(), but for loops running under `lock`, which is dropped around the
+// switch. Returns true if we did reschedule, so the caller knows that whatever `lock`
+// protects may have changed in the meantime.
+bool cond_resched_lock(struct spinlock *lock)
+{
+    // The lock itself accounts for one
+    if (preempt_count() != 1 || !scheduler_need_resched())
+        return false;
+
+    spinlock_release(lock);
+    scheduler_schedule();
+    spinlock_acquire(lock);
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef PROC_PREEMPT_H
+#define PROC_PREEMPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/cpu.h>
+
+#define PREEMPT_MAX_CPUS 1 // Matches cpu_id(), no SMP yet
+
+// Non-zero while the CPU is inside a spinlock or an IRQ handler, the scheduler only takes
+// the CPU away from kernel code when this is zero. See idt_dispatch() and cond_resched().
+extern volatile uint32_t preempt_counts[PREEMPT_MAX_CPUS];
+
+#define preempt_count() (preempt_counts[cpu_id()])
+
+#define preempt_disable()                         \
+    do                                            \
+    {                                             \
+        preempt_counts[cpu_id()]++;               \
+        __asm__ volatile("" : : : "memory");      \
+    } while (0)
+
+// Doesn't reschedule by itself, a pending need_resched is picked up on the next interrupt
+// return or cond_resched()
+#define preempt_enable()                          \
+    do                                            \
+    {                                             \
+        __asm__ volatile("" : : : "memory");      \
+        preempt_counts[cpu_id()]--;               \
+    } while (0)
+
+struct spinlock;
+
+void cond_resched();
+bool cond_resched_lock(struct spinlock *lock);
+
+#endif // PROC_PREEMPT_H
@@ -0,0 +1,330 @@
+#include <proc/ring.h>
+#include <proc/kthread.h>
+#include <proc/preempt.h>
+#include <sys/syscall.h>
+#include <mm/kmalloc.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <lib/memory.h>
+#include <lib/log.h>
+#include <dev/timer/pit.h>
+
+ring_stats_t ring_stats = {0};
+
+static void *ring_at(ring_t *ring, uint64_t offset)
+{
+    return (uint8_t *)HIGHER_HALF(ring->frames[offset / PAGE_SIZE]) + offset % PAGE_SIZE;
+}
+
+static void ring_put(ring_t *ring)
+{
+    spinlock_acquire(&ring->lock);
+    bool last = --ring->refcount == 0;
+    spinlock_release(&ring->lock);
+    if (!last)
+        return;
+
+    // The process' mappings hold references of their own
+    for (uint64_t i = 0; i < ring->pages; i++)
+    {
+        if (ring->frames[i])
+            pmm_release_page((void *)ring->frames[i]);
+    }
+    fd_table_release(ring->files);
+    kfree(ring->frames);
+    kfree(ring);
+}
+
+// The owner's address space is going away, called from mm_release()
+void ring_detach(ring_t *ring)
+{
+    spinlock_acquire(&ring->lock);
+    ring->mm = NULL;
+    spinlock_release(&ring->lock);
+
+    wake_up(&ring->sq_wait);
+    ring_put(ring);
+}
+
+// For the polling thread, which doesn't keep the owner alive by itself
+static mm_t *ring_get_mm(ring_t *ring)
+{
+    spinlock_acquire(&ring->lock);
+    mm_t *mm = ring->mm ? mm_tryget(ring->mm) : NULL;
+    spinlock_release(&ring->lock);
+    return mm;
+}
+
+static bool ring_try_claim(ring_t *ring)
+{
+    spinlock_acquire(&ring->lock);
+    bool claimed = !ring->busy;
+    ring->busy = true;
+    spinlock_release(&ring->lock);
+    return claimed;
+}
+
+static void ring_unclaim(ring_t *ring)
+{
+    spinlock_acquire(&ring->lock);
+    ring->busy = false;
+    spinlock_release(&ring->lock);
+    wake_up(&ring->submit_wait);
+}
+
+static bool ring_sq_pending(ring_t *ring)
+{
+    return __atomic_load_n(&ring->header->sq_tail, __ATOMIC_ACQUIRE) != ring->sq_head;
+}
+
+static uint32_t ring_cq_ready(ring_t *ring)
+{
+    return ring->cq_tail - __atomic_load_n(&ring->header->cq_head, __ATOMIC_ACQUIRE);
+}
+
+// Runs in the context of the process (or the polling thread standing in for it), through the
+// same code paths as the syscalls
+static int ring_execute(ring_sqe_t *sqe)
+{
+    if (sqe->addr >= VMM_USER_END)
+        return -EFAULT;
+
+    switch (sqe->opcode)
+    {
+    case RING_OP_NOP:
+        return 0;
+    case RING_OP_READ:
+        if (!sqe->addr)
+            return -EFAULT;
+        if (sqe->off != RING_OFF_CURRENT)
+            return sys_pread(sqe->fd, (void *)sqe->addr, sqe->len, sqe->off);
+        return sqe->len ? sys_read(sqe->fd, (void *)sqe->addr, sqe->len) : 0;
+    case RING_OP_WRITE:
+        if (!sqe->addr)
+            return -EFAULT;
+        if (sqe->off != RING_OFF_CURRENT)
+            return sys_pwrite(sqe->fd, (void *)sqe->addr, sqe->len, sqe->off);
+        return sqe->len ? sys_write(sqe->fd, (void *)sqe->addr, sqe->len) : 0;
+    case RING_OP_OPEN:
+        if (!sqe->addr)
+            return -EFAULT;
+        return sys_open((const char *)sqe->addr, sqe->flags, sqe->kind);
+    case RING_OP_CLOSE:
+        return sys_close(sqe->fd);
+    case RING_OP_STAT:
+        return sys_stat(sqe->fd, (stat_t *)sqe->addr);
+    default:
+        return -EINVAL;
+    }
+}
+
+// Consumes up to `max` submissions, as long as there is room for their completions.
+// The caller must have claimed the ring.
+static uint32_t ring_submit(ring_t *ring, uint32_t max)
+{
+    ring_header_t *header = ring->header;
+    uint32_t done = 0;
+    while (done < max && ring_sq_pending(ring))
+    {
+        if (ring_cq_ready(ring) >= ring->cq_entries)
+        {
+            ring_stats.held_back++;
+            break;
+        }
+
+        // Copied out first, the process may reuse the slot as soon as sq_head moves past it
+        ring_sqe_t sqe = *(ring_sqe_t *)ring_at(ring, ring->sq_offset + (ring->sq_head & (ring->sq_entries - 1)) * sizeof(ring_sqe_t));
+        __atomic_store_n(&header->sq_head, ++ring->sq_head, __ATOMIC_RELEASE);
+
+        int res = ring_execute(&sqe);
+
+        ring_cqe_t *cqe = ring_at(ring, ring->cq_offset + (ring->cq_tail & (ring->cq_entries - 1)) * sizeof(ring_cqe_t));
+        cqe->user_data = sqe.user_data;
+        cqe->res = res;
+        cqe->flags = 0;
+        __atomic_store_n(&header->cq_tail, ++ring->cq_tail, __ATOMIC_RELEASE);
+        done++;
+    }
+
+    if (done)
+    {
+        ring_stats.completed += done;
+        wake_up(&ring->cq_wait);
+    }
+    return done;
+}
+
+// RING_SETUP_SQPOLL: keeps picking submissions up while there are some, so a busy process
+// never has to enter the kernel at all. Sleeps once nothing came in for RING_SQ_IDLE_NS.
+static void ring_sq_thread(void *arg)
+{
+    ring_t *ring = (ring_t *)arg;
+    ring_header_t *header = ring->header;
+
+    mm_t *mm;
+    while ((mm = ring_get_mm(ring)) != NULL)
+    {
+        kthread_use_mm(mm, ring->files, ring->whoami);
+        uint64_t idle_since = pit_get_ns();
+        while (pit_get_ns() - idle_since < RING_SQ_IDLE_NS)
+        {
+            if (ring_submit(ring, RING_SQ_BATCH))
+                idle_since = pit_get_ns();
+            else
+                scheduler_yield();
+        }
+        kthread_unuse_mm();
+
+        // The flag goes up before the last look at the ring, a submission racing with us is
+        // either seen here or the process sees the flag and kicks us
+        __atomic_or_fetch(&header->flags, RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+        if (!ring_sq_pending(ring))
+            wait_event(&ring->sq_wait, ring->sq_kick || !ring->mm);
+        __atomic_and_fetch(&header->flags, ~RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+        ring->sq_kick = false;
+    }
+
+    trace("Ring 0x%.16llx lost its owner, polling thread exiting", (uint64_t)ring);
+    ring_put(ring);
+    kthread_exit();
+}
+
+// Maps a submission ring of (at least) `entries` entries and a completion ring twice that
+// size into the caller's address space, one per address space
+int ring_setup(uint32_t entries, uint32_t flags, ring_params_t *params)
+{
+    pcb_t *proc = scheduler_get_current();
+    if (!proc || proc->kernel)
+        return -ESRCH;
+    if (!params || (uint64_t)params >= VMM_USER_END)
+        return -EFAULT;
+    if (entries == 0 || entries > RING_MAX_ENTRIES || (flags & ~RING_SETUP_SQPOLL))
+        return -EINVAL;
+
+    ring_t *ring = (ring_t *)kcalloc(1, sizeof(ring_t));
+    if (!ring)
+        return -ENOMEM;
+
+    ring->sq_entries = 1;
+    while (ring->sq_entries < entries)
+        ring->sq_entries <<= 1;
+    ring->cq_entries = ring->sq_entries * 2;
+    ring->sq_offset = PAGE_SIZE;
+    ring->cq_offset = ring->sq_offset + ALIGN_UP(ring->sq_entries * sizeof(ring_sqe_t), PAGE_SIZE);
+    ring->pages = (ring->cq_offset + ALIGN_UP(ring->cq_entries * sizeof(ring_cqe_t), PAGE_SIZE)) / PAGE_SIZE;
+    ring->refcount = 1;
+    spinlock_init(&ring->lock);
+    wait_queue_init(&ring->submit_wait);
+    wait_queue_init(&ring->cq_wait);
+    wait_queue_init(&ring->sq_wait);
+
+    ring->frames = (uint64_t *)kcalloc(ring->pages, sizeof(uint64_t));
+    if (!ring->frames)
+    {
+        kfree(ring);
+        return -ENOMEM;
+    }
+    for (uint64_t i = 0; i < ring->pages; i++)
+    {
+        ring->frames[i] = (uint64_t)pmm_request_page();
+        if (!ring->frames[i])
+        {
+            ring_put(ring);
+            return -ENOMEM;
+        }
+    }
+
+    ring->header = (ring_header_t *)HIGHER_HALF(ring->frames[0]);
+    ring->header->sq_entries = ring->sq_entries;
+    ring->header->cq_entries = ring->cq_entries;
+    ring->header->sq_offset = ring->sq_offset;
+    ring->header->cq_offset = ring->cq_offset;
+    ring->files = fd_table_share(proc->files);
+    ring->whoami = proc->whoami;
+
+    // VMM_SHARED keeps fork() from turning the area copy-on-write under us. A child sees the
+    // rings, but only the owner's address space has them attached.
+    uint64_t map_flags = VMM_PRESENT | VMM_WRITE | VMM_USER | VMM_NX | VMM_SHARED;
+    mm_t *mm = proc->mm;
+    rwsem_write_lock(&mm->sem);
+    spinlock_acquire(&mm->lock);
+    bool busy = mm->ring != NULL;
+    vma_region_t *region = busy ? NULL : vma_reserve(mm->vma_ctx, ring->pages, map_flags, NULL, NULL);
+    if (region)
+    {
+        for (uint64_t i = 0; i < ring->pages; i++)
+        {
+            pmm_frame_ref(ring->frames[i]);
+            vmm_map(mm->pagemap, region->start + i * PAGE_SIZE, ring->frames[i], map_flags);
+        }
+        ring->mm = mm;
+        mm->ring = ring;
+        if (flags & RING_SETUP_SQPOLL)
+            ring->refcount++;
+    }
+    spinlock_release(&mm->lock);
+    rwsem_write_unlock(&mm->sem);
+
+    if (!region)
+    {
+        ring_put(ring);
+        return busy ? -EBUSY : -ENOMEM;
+    }
+
+    if (flags & RING_SETUP_SQPOLL)
+    {
+        ring->sq_poll = kthread_create(ring_sq_thread, ring) != (uint64_t)-1;
+        if (!ring->sq_poll)
+        {
+            warning("No polling thread for ring 0x%.16llx, submissions need ring_enter()", (uint64_t)ring);
+            ring_put(ring);
+        }
+    }
+
+    params->addr = region->start;
+    params->size = ring->pages * PAGE_SIZE;
+    params->sq_entries = ring->sq_entries;
+    params->cq_entries = ring->cq_entries;
+    params->flags = ring->sq_poll ? RING_SETUP_SQPOLL : 0;
+
+    trace("Process %d set up a ring with %u entries at 0x%.16llx%s", proc->pid, ring->sq_entries, region->start, ring->sq_poll ? ", polled" : "");
+    return 0;
+}
+
+// Consumes up to `to_submit` submissions (or kicks the polling thread), then optionally waits
+// until at least `min_complete` completions are ready. Returns the number submitted.
+int ring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    pcb_t *proc = scheduler_get_current();
+    if (!proc || proc->kernel)
+        return -ESRCH;
+
+    ring_t *ring = proc->mm->ring;
+    if (!ring)
+        return -EBADF;
+    if ((flags & ~(RING_ENTER_GETEVENTS | RING_ENTER_SQ_WAKEUP)) || min_complete > ring->cq_entries)
+        return -EINVAL;
+
+    ring_stats.enters++;
+    uint32_t submitted = 0;
+    if (ring->sq_poll)
+    {
+        if (flags & RING_ENTER_SQ_WAKEUP)
+        {
+            ring->sq_kick = true;
+            wake_up(&ring->sq_wait);
+            ring_stats.sq_wakeups++;
+        }
+        submitted = to_submit; // Picked up by the polling thread
+    }
+    else if (to_submit)
+    {
+        wait_event(&ring->submit_wait, ring_try_claim(ring));
+        submitted = ring_submit(ring, to_submit);
+        ring_unclaim(ring);
+    }
+
+    if (flags & RING_ENTER_GETEVENTS)
+        wait_event(&ring->cq_wait, ring_cq_ready(ring) >= min_complete);
+    return submitted;
+}
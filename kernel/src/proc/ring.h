@@ -0,0 +1,124 @@
+#ifndef PROC_RING_H
+#define PROC_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <proc/scheduler.h>
+#include <proc/wait.h>
+#include <lib/spinlock.h>
+
+#define RING_MAX_ENTRIES 1024   // Submission entries, the completion ring gets twice as many
+#define RING_SQ_BATCH 64        // Submissions the polling thread handles in one go
+#define RING_SQ_IDLE_NS 2000000 // Polling thread goes to sleep after this long without work
+
+// ring_setup() flags
+#define RING_SETUP_SQPOLL (1 << 0) // A kernel thread picks submissions up, no ring_enter() needed
+
+// ring_enter() flags
+#define RING_ENTER_GETEVENTS (1 << 0) // Wait for `min_complete` completions
+#define RING_ENTER_SQ_WAKEUP (1 << 1) // Wake the polling thread up, see RING_SQ_NEED_WAKEUP
+
+// ring_header_t flags, written by the kernel
+#define RING_SQ_NEED_WAKEUP (1 << 0) // Polling thread is asleep, kick it with RING_ENTER_SQ_WAKEUP
+
+// Operations, each behaves like the syscall of the same name
+#define RING_OP_NOP 0
+#define RING_OP_READ 1
+#define RING_OP_WRITE 2
+#define RING_OP_OPEN 3
+#define RING_OP_CLOSE 4
+#define RING_OP_STAT 5
+
+#define RING_OFF_CURRENT ((uint64_t)-1) // Like read()/write(), use and move the file position
+
+// Submission queue entry, filled in by the process
+typedef struct ring_sqe
+{
+    uint8_t opcode;
+    uint8_t kind; // open(): type of the node to create
+    uint16_t reserved;
+    int32_t fd;
+    uint64_t addr;      // Buffer, path (open) or stat_t (stat)
+    uint64_t len;       // Buffer size
+    uint64_t flags;     // open() flags
+    uint64_t off;       // read/write position, RING_OFF_CURRENT for the file's own
+    uint64_t user_data; // Handed back untouched in the completion
+    uint64_t pad[2];
+} ring_sqe_t;
+
+// Completion queue entry, filled in by the kernel
+typedef struct ring_cqe
+{
+    uint64_t user_data;
+    int32_t res; // What the syscall would have returned
+    uint32_t flags;
+} ring_cqe_t;
+
+// First page of the shared area. The process produces at sq_tail and consumes at cq_head, the
+// kernel the other way round, each side only ever writes its own indices. They run freely and
+// wrap around, slots are index & (entries - 1).
+typedef struct ring_header
+{
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t sq_entries; // Powers of two
+    uint32_t cq_entries; //
+    uint32_t flags;      // RING_SQ_*
+    uint32_t reserved;
+    uint64_t sq_offset; // ring_sqe_t array, from the start of the area
+    uint64_t cq_offset; // ring_cqe_t array
+} ring_header_t;
+
+// What ring_setup() hands back
+typedef struct ring_params
+{
+    uint64_t addr; // Shared area, starts with the ring_header_t
+    uint64_t size;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags; // RING_SETUP_* actually in effect
+} ring_params_t;
+
+// Kernel side of a ring. The process can scribble over the shared header, so the indices the
+// kernel owns and the geometry are kept here and only ever copied out.
+typedef struct ring
+{
+    uint64_t *frames; // Shared area, reached through the HHDM from any address space
+    uint64_t pages;
+    ring_header_t *header;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint64_t sq_offset;
+    uint64_t cq_offset;
+    uint32_t sq_head;
+    uint32_t cq_tail;
+    mm_t *mm;          // Owner, NULL once its address space is gone
+    fd_table_t *files; // Descriptors the operations run against
+    user_t whoami;     // Credentials at ring_setup() time, for the polling thread
+    uint64_t refcount; // The owner, plus the polling thread if any
+    bool sq_poll;
+    bool sq_kick;
+    bool busy; // Somebody is consuming submissions
+    spinlock_t lock;
+    wait_queue_t submit_wait; // Waiting for `busy` to clear
+    wait_queue_t cq_wait;     // ring_enter() waiting for completions
+    wait_queue_t sq_wait;     // Polling thread, while asleep
+} ring_t;
+
+typedef struct ring_stats
+{
+    uint64_t enters;     // ring_enter() calls
+    uint64_t completed;  // Operations run off submission rings
+    uint64_t held_back;  // Times a full completion ring stopped consumption
+    uint64_t sq_wakeups; // Polling thread woken up by ring_enter()
+} ring_stats_t;
+
+extern ring_stats_t ring_stats;
+
+int ring_setup(uint32_t entries, uint32_t flags, ring_params_t *params);
+int ring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+void ring_detach(ring_t *ring);
+
+#endif // PROC_RING_H
@@ -0,0 +1,63 @@
+#include <proc/rwsem.h>
+#include <lib/assert.h>
+
+void rwsem_init(rwsem_t *sem)
+{
+    spinlock_init(&sem->lock);
+    sem->readers = 0;
+    sem->writer = false;
+    wait_queue_init(&sem->wait);
+}
+
+bool rwsem_read_trylock(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->lock);
+    bool ok = !sem->writer;
+    if (ok)
+        sem->readers++;
+    spinlock_release(&sem->lock);
+    return ok;
+}
+
+static bool rwsem_write_trylock(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->lock);
+    bool ok = !sem->writer && sem->readers == 0;
+    if (ok)
+        sem->writer = true;
+    spinlock_release(&sem->lock);
+    return ok;
+}
+
+void rwsem_read_lock(rwsem_t *sem)
+{
+    wait_event(&sem->wait, rwsem_read_trylock(sem));
+}
+
+void rwsem_write_lock(rwsem_t *sem)
+{
+    wait_event(&sem->wait, rwsem_write_trylock(sem));
+}
+
+void rwsem_read_unlock(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->lock);
+    assert(sem->readers > 0);
+    bool last = --sem->readers == 0;
+    spinlock_release(&sem->lock);
+
+    // Only writers wait on readers
+    if (last && wait_queue_active(&sem->wait))
+        wake_up(&sem->wait);
+}
+
+void rwsem_write_unlock(rwsem_t *sem)
+{
+    spinlock_acquire(&sem->lock);
+    assert(sem->writer);
+    sem->writer = false;
+    spinlock_release(&sem->lock);
+
+    if (wait_queue_active(&sem->wait))
+        wake_up(&sem->wait);
+}
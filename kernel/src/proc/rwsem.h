@@ -0,0 +1,28 @@
+#ifndef PROC_RWSEM_H
+#define PROC_RWSEM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <lib/spinlock.h>
+#include <proc/wait.h>
+
+// Sleeping reader/writer lock, for sections that may block while they hold it (e.g. reading
+// a page in). Readers nest and aren't held back by waiting writers. Not for IRQ context.
+typedef struct rwsem
+{
+    spinlock_t lock;   // readers, writer
+    uint64_t readers;  // Holding it for reading right now
+    bool writer;       // Held for writing
+    wait_queue_t wait; // Everybody waiting for either
+} rwsem_t;
+
+#define RWSEM_INIT {.lock = SPINLOCK_INIT, .readers = 0, .writer = false, .wait = WAIT_QUEUE_INIT}
+
+void rwsem_init(rwsem_t *sem);
+void rwsem_read_lock(rwsem_t *sem);
+bool rwsem_read_trylock(rwsem_t *sem);
+void rwsem_read_unlock(rwsem_t *sem);
+void rwsem_write_lock(rwsem_t *sem);
+void rwsem_write_unlock(rwsem_t *sem);
+
+#endif // PROC_RWSEM_H
@@ -4,24 +4,69 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <dev/stdout.h>
+#include <dev/timer/pit.h>
 #include <lib/spinlock.h>
-
-pcb_t **procs;
-uint64_t count = 0;
-uint64_t current_pid = 0;
+#include <util/cpu.h>
+#include <sys/gdt.h>
+#include <proc/futex.h>
+#include <sys/vdso.h>
+
+extern vma_context_t *kernel_vma_context;
+
+// See proc/switch.S
+extern pcb_t *context_switch(pcb_t *prev, uint64_t *prev_rsp, uint64_t next_rsp);
+extern void task_entry_user(void);
+extern void task_entry_kernel(void);
+
+pcb_t **procs; // Indexed by pid
+uint64_t nr_running = 0; // READY or RUNNING processes, the idle task not included
+uint64_t nr_user = 0;    // Userspace processes, the system is done once they are all gone
+volatile bool need_resched = false;
+uint64_t resched_requested_ns = 0; // When need_resched was raised by the tick or a wake-up, 0 if not
+sched_stats_t sched_stats = {0};
+bool scheduler_running = false; // Nothing is switched to before scheduler_start()
 spinlock_t lock = SPINLOCK_INIT;
 void (*die_func)(void) = NULL;
+mm_t kernel_mm; // Kernel threads and the idle task, never released
+
+static pcb_t *current_proc = NULL;
+static pcb_t *idle_proc = NULL;
+static uint64_t fs_base_loaded = 0; // What MSR_FS_BASE holds right now
+static pcb_t *runqueue_head = NULL; // READY processes in round-robin order, current not included
+static pcb_t *runqueue_tail = NULL;
 
-void map_range_to_pagemap(uint64_t *dest_pagemap, uint64_t *src_pagemap, uint64_t start, uint64_t size, uint64_t flags)
+// Ask for the current task to be preempted, on the way out of the interrupt or at the next
+// cond_resched(). Remembers when, for the latency stats.
+static void request_resched()
 {
-    for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE)
-    {
-        uint64_t phys = virt_to_phys(src_pagemap, start + offset);
-        if (phys)
-        {
-            vmm_map(dest_pagemap, start + offset, phys, flags);
-        }
-    }
+    if (!need_resched)
+        resched_requested_ns = pit_get_ns();
+    need_resched = true;
+}
+
+static void runqueue_push(pcb_t *proc)
+{
+    proc->run_next = NULL;
+    proc->run_prev = runqueue_tail;
+    if (runqueue_tail)
+        runqueue_tail->run_next = proc;
+    else
+        runqueue_head = proc;
+    runqueue_tail = proc;
+}
+
+static void runqueue_remove(pcb_t *proc)
+{
+    if (proc->run_prev)
+        proc->run_prev->run_next = proc->run_next;
+    else
+        runqueue_head = proc->run_next;
+    if (proc->run_next)
+        proc->run_next->run_prev = proc->run_prev;
+    else
+        runqueue_tail = proc->run_prev;
+    proc->run_next = NULL;
+    proc->run_prev = NULL;
 }
 
 void scheduler_init()
@@ -35,240 +80,659 @@ void scheduler_init()
     }
 
     trace("Initialized scheduler process list, %d bytes (%d max processes)", sizeof(pcb_t *) * PROC_MAX_PROCS, PROC_MAX_PROCS);
+    pid_init();
+
+    // The boot context becomes the idle task, it runs whenever nothing else is runnable
+    // (post_main() ends in a hlt loop) and never enters procs[]. It keeps the boot stack.
+    idle_proc = (pcb_t *)kmalloc(sizeof(pcb_t));
+    assert(idle_proc);
+    memset(idle_proc, 0, sizeof(pcb_t));
+
+    kernel_mm.pagemap = kernel_pagemap;
+    kernel_mm.vma_ctx = kernel_vma_context;
+    kernel_mm.refcount = 1;
+    spinlock_init(&kernel_mm.lock);
+    rwsem_init(&kernel_mm.sem);
+
+    idle_proc->pid = (uint64_t)-1;
+    idle_proc->state = PROCESS_RUNNING;
+    idle_proc->mm = &kernel_mm;
+    idle_proc->kernel = true;
+    current_proc = idle_proc;
+    trace("Boot context is now the idle task");
 }
 
-uint64_t scheduler_spawn(bool user, void (*entry)(void), uint64_t *pagemap)
+// Allow switching away from the boot context, called right before the PIT starts ticking
+void scheduler_start()
 {
-    pcb_t *proc = (pcb_t *)kmalloc(sizeof(pcb_t));
-    if (!proc)
+    scheduler_running = true;
+}
+
+// Only preemption needs the periodic tick. With at most one runnable process there is
+// nothing to switch to, so sleep until the next timer (timekeeping still runs off the PIT).
+void scheduler_update_tick()
+{
+    if (nr_running > 1)
     {
-        error("Failed to allocate memory for new process");
-        return -1;
+        pit_set_periodic();
+        return;
     }
 
-    proc->pid = count++;
-    proc->state = PROCESS_READY;
-    proc->ctx.rip = (uint64_t)entry;
-    proc->pagemap = pagemap;
-    proc->vma_ctx = vma_create_context(proc->pagemap);
+    pit_set_oneshot(timer_next_ns());
+}
 
-    // Setup stack and other shit
-    uint64_t stack_size = 4;
-    uint64_t map_flags = VMM_PRESENT | VMM_WRITE;
-    if (user)
+// The register_ctx pushed when a user task entered the kernel, right at the top of its kernel stack
+static struct register_ctx *scheduler_user_frame(pcb_t *proc)
+{
+    return (struct register_ctx *)((uint64_t)proc->kstack + KSTACK_PAGES * PAGE_SIZE - sizeof(struct register_ctx));
+}
+
+// Makes a user task start over at `entry` with a clean register state the next time it
+// returns to ring 3, e.g. a new task or after exec
+void scheduler_reset_user_frame(pcb_t *proc, uint64_t entry, uint64_t user_rsp)
+{
+    struct register_ctx *frame = scheduler_user_frame(proc);
+    memset(frame, 0, sizeof(struct register_ctx));
+    frame->rip = entry;
+    frame->cs = GDT_USER_CS;
+    frame->ss = GDT_USER_DS;
+    frame->rsp = user_rsp;
+    frame->rflags = 0x202;
+}
+
+// Lays out a new task's kernel stack the way context_switch() left it, so the first switch
+// "returns" into task_entry_user/kernel. User tasks also get their initial register_ctx.
+static void scheduler_setup_kstack(pcb_t *proc, uint64_t entry, uint64_t arg, uint64_t user_rsp)
+{
+    uint64_t *sp = (uint64_t *)((uint64_t)proc->kstack + KSTACK_PAGES * PAGE_SIZE);
+    uint64_t rbx = 0, r12 = 0;
+    if (proc->kernel)
     {
-        map_flags |= VMM_USER;
-        proc->ctx.cs = 0x1B; // User code segment
-        proc->ctx.ss = 0x23; // User data segment
+        *--sp = (uint64_t)task_entry_kernel;
+        rbx = entry;
+        r12 = arg;
     }
     else
     {
-        proc->ctx.cs = 0x08; // Kernel code segment
-        proc->ctx.ss = 0x10; // Kernel data segment
+        scheduler_reset_user_frame(proc, entry, user_rsp);
+        sp = (uint64_t *)((uint64_t)sp - sizeof(struct register_ctx));
+        *--sp = (uint64_t)task_entry_user;
     }
 
-    proc->ctx.rsp = (uint64_t)vma_alloc(proc->vma_ctx, stack_size, map_flags) + ((PAGE_SIZE * stack_size) - 1);
-    proc->ctx.rflags = 0x202;
+    *--sp = 0;   // rbp
+    *--sp = rbx; // rbx
+    *--sp = r12; // r12
+    *--sp = 0;   // r13
+    *--sp = 0;   // r14
+    *--sp = 0;   // r15
+    proc->kernel_rsp = (uint64_t)sp;
+}
 
-    vmm_map(proc->pagemap, (uint64_t)proc, (uint64_t)proc, map_flags);
-    map_range_to_pagemap(proc->pagemap, kernel_pagemap, (uint64_t)procs, sizeof(pcb_t *) * PROC_MAX_PROCS, map_flags);
-    map_range_to_pagemap(proc->pagemap, kernel_pagemap, 0x1000, 0x10000, map_flags);
+// Allocates a PCB with a pid and kernel stack, not yet visible to anyone. Takes over the
+// caller's reference on `mm`, but only on success. Joins `group` once published, starts a
+// new one if NULL.
+static pcb_t *scheduler_alloc(bool user, mm_t *mm, thread_group_t *group)
+{
+    pcb_t *proc = (pcb_t *)kmalloc(sizeof(pcb_t));
+    if (!proc)
+    {
+        error("Failed to allocate memory for new process");
+        return NULL;
+    }
+
+    memset(proc, 0, sizeof(pcb_t));
+    proc->pid = pid_alloc();
+    if (proc->pid == PID_NONE)
+    {
+        error("Out of pids, %d processes alive", pid_count());
+        kfree(proc);
+        return NULL;
+    }
+    proc->tgid = proc->pid; // The caller sets the group's if joining one
+    proc->group = group;
+    if (!group)
+    {
+        proc->group = (thread_group_t *)kmalloc(sizeof(thread_group_t));
+        if (!proc->group)
+        {
+            error("Failed to allocate thread group");
+            pid_free(proc->pid);
+            kfree(proc);
+            return NULL;
+        }
+        memset(proc->group, 0, sizeof(thread_group_t));
+    }
+    proc->state = PROCESS_READY;
+    proc->mm = mm;
+    proc->kernel = !user;
+
+    // Every task gets its own kernel stack, interrupts and syscalls run (and sleep) on it
+    proc->kstack = kstack_alloc();
+    if (!proc->kstack)
+    {
+        error("Failed to allocate kernel stack");
+        if (!group)
+            kfree(proc->group);
+        pid_free(proc->pid);
+        kfree(proc);
+        return NULL;
+    }
 
     // Set up some default values
     proc->timeslice = PROC_DEFAULT_TIME;
     proc->errno = EOK;
     proc->whoami.uid = 0; // run as root by default
     proc->whoami.gid = 0; //
-    proc->in_syscall = false;
+    return proc;
+}
+
+// Makes a new process runnable, nothing else looked at it so far
+static void scheduler_publish(pcb_t *proc)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&lock);
+    procs[proc->pid] = proc;
+    thread_group_t *group = proc->group;
+    proc->group_next = group->threads;
+    if (group->threads)
+        group->threads->group_prev = proc;
+    group->threads = proc;
+    group->nr_threads++;
+    runqueue_push(proc);
+    nr_running++;
+    if (!proc->kernel)
+        nr_user++;
+    scheduler_update_tick();
+    spinlock_release(&lock);
+    irq_restore(flags);
+}
 
-    proc->fd_count = 0;
-    for (int i = 0; i < PROC_MAX_FDS; i++)
+static uint64_t scheduler_create(bool user, uint64_t entry, uint64_t arg, uint64_t *pagemap)
+{
+    // Kernel threads share the kernel address space
+    mm_t *mm = &kernel_mm;
+    if (user)
     {
-        proc->fd_table[i] = NULL;
+        mm = mm_create(pagemap, vma_create_context(pagemap));
+        if (!mm || !mm->vma_ctx)
+        {
+            error("Failed to allocate address space");
+            kfree(mm);
+            return -1;
+        }
     }
 
-    procs[proc->pid] = proc;
+    pcb_t *proc = scheduler_alloc(user, mm, NULL);
+    if (!proc)
+    {
+        if (user)
+            mm_release(mm);
+        return -1;
+    }
+
+    // Setup stack and other shit
+    uint64_t stack_size = 4;
+    uint64_t user_rsp = 0;
+    if (user)
+        user_rsp = (uint64_t)vma_alloc(mm->vma_ctx, stack_size, VMM_PRESENT | VMM_WRITE | VMM_USER) + ((PAGE_SIZE * stack_size) - 1);
+
+    scheduler_setup_kstack(proc, entry, arg, user_rsp);
 
     // Setup default file descriptor table.
     // - 0: stdout
-    scheduler_proc_add_vnode(proc->pid, stdout);
+    if (user)
+    {
+        proc->files = fd_table_create();
+        assert(proc->files);
+        file_t *out = file_open(stdout, 0);
+        assert(out);
+        fd_alloc(proc->files, out);
+    }
+
+    scheduler_publish(proc);
 
     trace("Spawned process %d with entry %p, and pagemap %p", proc->pid, entry, pagemap);
     return proc->pid;
 }
 
-void scheduler_tick(struct register_ctx *ctx)
+// User process running an image built by exec_load()
+uint64_t scheduler_spawn_image(uint64_t *pagemap, vma_context_t *vma_ctx, uint64_t entry, uint64_t user_rsp)
 {
-    spinlock_acquire(&lock);
-    if (count == 0)
+    mm_t *mm = mm_create(pagemap, vma_ctx);
+    if (!mm)
+        return -1;
+
+    pcb_t *proc = scheduler_alloc(true, mm, NULL);
+    if (!proc)
     {
-        spinlock_release(&lock);
-        return;
+        kfree(mm); // The caller still owns the image
+        return -1;
     }
 
-    pcb_t *proc = procs[current_pid];
-    if (proc && proc->state == PROCESS_RUNNING)
+    scheduler_setup_kstack(proc, entry, 0, user_rsp);
+    vdso_update_proc(proc);
+
+    proc->files = fd_table_create();
+    assert(proc->files);
+    file_t *out = file_open(stdout, 0);
+    assert(out);
+    fd_alloc(proc->files, out);
+
+    scheduler_publish(proc);
+
+    trace("Spawned process %d with entry %p, and pagemap %p", proc->pid, entry, pagemap);
+    return proc->pid;
+}
+
+// New task continuing the current user task from the same syscall, returning 0 in it. `flags`
+// (CLONE_*) pick what it shares with us: threads share the address space and usually the
+// descriptors, a plain fork() shares nothing. Returns the new pid, -1 on failure.
+uint64_t scheduler_clone(uint64_t flags, uint64_t stack, uint32_t *parent_tid, uint32_t *child_tid, uint64_t tls)
+{
+    pcb_t *parent = scheduler_get_current();
+    if (!parent || parent->kernel)
+        return -1;
+
+    mm_t *mm = (flags & CLONE_VM) ? mm_share(parent->mm) : mm_fork(parent->mm);
+    if (!mm)
+        return -1;
+
+    fd_table_t *files = (flags & CLONE_FILES) ? fd_table_share(parent->files) : fd_table_clone(parent->files);
+    pcb_t *proc = files ? scheduler_alloc(true, mm, (flags & CLONE_THREAD) ? parent->group : NULL) : NULL;
+    if (!proc)
     {
-        // Skip decrementing the timeslice if the process is in a syscall.
-        if (!proc->in_syscall)
-        {
-            memcpy(&proc->ctx, ctx, sizeof(struct register_ctx));
-
-            if (--proc->timeslice == 0)
-            {
-                proc->state = PROCESS_READY;
-                proc->timeslice = PROC_DEFAULT_TIME;
-                current_pid = (current_pid + 1) % count;
-            }
-        }
+        error("Failed to clone process %d", parent->pid);
+        if (files)
+            fd_table_release(files);
+        mm_release(mm); // Never loaded if it was a copy, still ours if shared
+        return -1;
+    }
+
+    proc->files = files;
+    proc->whoami = parent->whoami;
+    if (flags & CLONE_THREAD)
+        proc->tgid = parent->tgid;
+    proc->fs_base = (flags & CLONE_SETTLS) ? tls : parent->fs_base;
+    if (flags & CLONE_CHILD_CLEARTID)
+        proc->clear_child_tid = (uint64_t)child_tid;
+    if (!(flags & CLONE_VM))
+        vdso_update_proc(proc);
+
+    scheduler_setup_kstack(proc, 0, 0, 0);
+    struct register_ctx *frame = scheduler_user_frame(proc);
+    memcpy(frame, scheduler_user_frame(parent), sizeof(struct register_ctx));
+    frame->rax = 0;
+    if (stack)
+        frame->rsp = stack;
+
+    // Both before it can run, CLONE_CHILD_SETTID implies the same memory
+    if (flags & CLONE_PARENT_SETTID)
+        *parent_tid = proc->pid;
+    if (flags & CLONE_CHILD_SETTID)
+        *child_tid = proc->pid;
+
+    scheduler_publish(proc);
+
+    trace("Cloned %s %d from %d (flags 0x%llx)", (flags & CLONE_THREAD) ? "thread" : "process", proc->pid, parent->pid, flags);
+    return proc->pid;
+}
+
+// Duplicates the current user process. The child shares every page copy-on-write, gets a copy
+// of the descriptor table and returns from the same syscall, with 0 instead of its pid.
+uint64_t scheduler_fork()
+{
+    return scheduler_clone(0, 0, NULL, NULL, 0);
+}
+
+// Thread pointer of `proc`, loaded right away if it is running
+void scheduler_set_fs_base(pcb_t *proc, uint64_t base)
+{
+    uint64_t flags = irq_save();
+    proc->fs_base = base;
+    if (proc == current_proc && base != fs_base_loaded)
+    {
+        wrmsr(MSR_FS_BASE, base);
+        fs_base_loaded = base;
     }
+    irq_restore(flags);
+}
+
+uint64_t scheduler_spawn(bool user, void (*entry)(void), uint64_t *pagemap)
+{
+    return scheduler_create(user, (uint64_t)entry, 0, pagemap);
+}
+
+// Kernel thread running entry(arg) on kernel_pagemap, see kthread_create()
+uint64_t scheduler_spawn_kernel(void (*entry)(void *), void *arg)
+{
+    return scheduler_create(false, (uint64_t)entry, (uint64_t)arg, kernel_pagemap);
+}
+
+static pcb_t *scheduler_pick_next()
+{
+    pcb_t *proc = runqueue_head;
+    if (proc == NULL)
+        return idle_proc;
+
+    runqueue_remove(proc);
+    return proc;
+}
+
+// Frees a terminated process, only once we are off its kernel stack and pagemap
+static void scheduler_reap(pcb_t *proc)
+{
+    if (!proc->kernel)
+        mm_release(proc->mm);
+    kstack_free(proc->kstack);
+    kfree(proc);
+}
 
-    pcb_t *next_proc = procs[current_pid];
-    assert(ctx && next_proc);
-    if (next_proc)
+// Runs on the new task right after context_switch(), `prev` is the task we came from
+static void scheduler_switch_tail(pcb_t *prev)
+{
+    if (prev->state == PROCESS_TERMINATED)
+        scheduler_reap(prev);
+}
+
+// Where a brand new task starts out, still holding the lock from whoever switched to it
+void scheduler_task_start(pcb_t *prev)
+{
+    scheduler_switch_tail(prev);
+    scheduler_update_tick();
+    spinlock_release(&lock);
+}
+
+// Switch over to the next runnable process (or the idle task). Called with the lock held and
+// interrupts off; only the callee-saved registers are switched, everything else is already
+// saved on the kernel stack by whoever called us (e.g. the interrupt entry).
+static void scheduler_switch()
+{
+    pcb_t *prev = current_proc;
+    if (prev->state == PROCESS_RUNNING && prev != idle_proc)
     {
-        if (next_proc->state == PROCESS_READY)
-        {
-            next_proc->state = PROCESS_RUNNING;
-            assert(next_proc->pagemap);
-            assert(ctx);
-            assert(&next_proc->ctx);
-            memcpy(ctx, &next_proc->ctx, sizeof(struct register_ctx));
-            vmm_switch_pagemap(next_proc->pagemap);
-        }
-        else if (next_proc->state == PROCESS_TERMINATED)
-        {
-            procs[next_proc->pid] = NULL;
-            count--;
+        prev->state = PROCESS_READY;
+        runqueue_push(prev);
+    }
 
-            if (count == 0)
-                spinlock_release(&lock);
-            {
-                return;
-            }
+    if (resched_requested_ns)
+    {
+        uint64_t latency = pit_get_ns() - resched_requested_ns;
+        sched_stats.preemptions++;
+        sched_stats.total_latency_ns += latency;
+        sched_stats.max_latency_ns = MAX(sched_stats.max_latency_ns, latency);
+        resched_requested_ns = 0;
+    }
 
-            current_pid = (current_pid + 1) % count;
+    need_resched = false;
+    pcb_t *next = scheduler_pick_next();
+    assert(next && next->mm);
+    next->state = PROCESS_RUNNING;
+    current_proc = next;
+
+    if (next == prev)
+        return;
+
+    if (next->mm->pagemap != prev->mm->pagemap)
+        vmm_switch_pagemap(next->mm->pagemap);
+    if (!next->kernel && next->fs_base != fs_base_loaded)
+    {
+        // Kernel threads don't use FS, they can keep whatever is loaded
+        wrmsr(MSR_FS_BASE, next->fs_base);
+        fs_base_loaded = next->fs_base;
+    }
+    if (next->kstack)
+    {
+        tss_set_rsp0((uint64_t)next->kstack + KSTACK_PAGES * PAGE_SIZE);
+        syscall_set_kernel_rsp((uint64_t)next->kstack + KSTACK_PAGES * PAGE_SIZE);
+    }
+
+    prev = context_switch(prev, &prev->kernel_rsp, next->kernel_rsp);
+    scheduler_switch_tail(prev);
+}
+
+// Timeslice accounting only, the switch itself happens on the way out of the interrupt
+void scheduler_tick()
+{
+    spinlock_acquire(&lock);
+
+    pcb_t *proc = current_proc;
+    if (proc != idle_proc && proc->state == PROCESS_RUNNING)
+    {
+        // Syscalls are preemptible too, but kernel threads run until they block or yield
+        if (!proc->kernel && --proc->timeslice == 0)
+        {
+            proc->timeslice = PROC_DEFAULT_TIME;
+            request_resched();
         }
     }
+    else if (runqueue_head)
+    {
+        request_resched();
+    }
+
+    scheduler_update_tick();
     spinlock_release(&lock);
 }
 
+// Reschedule right away, for when the current process stopped being runnable (e.g. it exited
+// or blocked) or its timeslice ran out. Returns once this task gets the CPU back.
+void scheduler_schedule()
+{
+    if (!scheduler_running)
+        return;
+
+    // Whatever lock we are holding would stay taken while someone else runs
+    if (preempt_count() != 0)
+        warning("Scheduling while atomic (preempt count %u)", preempt_count());
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&lock);
+    scheduler_switch();
+    scheduler_update_tick();
+    spinlock_release(&lock);
+    irq_restore(flags);
+}
+
 void scheduler_exit(int return_code)
 {
     (void)return_code; // might be unused.
-    pcb_t *proc = procs[current_pid];
+    pcb_t *proc = scheduler_get_current();
     if (proc)
     {
-        proc->ctx.rip = 0;
+        fd_table_release(proc->files);
+        proc->files = NULL;
 
-        for (uint64_t i = 0; i < proc->fd_count; i++)
+        // Tells whoever joins this thread that it is gone, unless its stack went away (or got
+        // remapped read-only) meanwhile
+        if (proc->clear_child_tid && mm_user_writable(proc->mm, proc->clear_child_tid, sizeof(uint32_t)))
         {
-            if (proc->fd_table[i] != NULL)
-            {
-                proc->fd_table[i] = NULL;
-            }
+            *(uint32_t *)proc->clear_child_tid = 0;
+            futex_wake((uint32_t *)proc->clear_child_tid, 1, FUTEX_BITSET_MATCH_ANY);
         }
 
-        vmm_destroy_pagemap(proc->pagemap);
-        kfree(proc);
+        timer_cancel(&proc->wait_timer);
 
+        // The pagemap is still loaded, so it and the PCB are freed by scheduler_switch() once we are off it.
+        // A tick must not switch away before we are done, this task never runs again after that.
+        uint64_t flags = irq_save();
+        spinlock_acquire(&lock);
+        proc->state = PROCESS_TERMINATED;
         procs[proc->pid] = NULL;
-        count--;
+        if (proc->pid != proc->tgid)
+            pid_free(proc->pid);
+
+        // The leader's pid is what every thread's getpid() returns, so it can't be handed out
+        // again before the last of them is gone, even if the leader exits first
+        thread_group_t *group = proc->group;
+        if (proc->group_prev)
+            proc->group_prev->group_next = proc->group_next;
+        else
+            group->threads = proc->group_next;
+        if (proc->group_next)
+            proc->group_next->group_prev = proc->group_prev;
+        if (--group->nr_threads == 0)
+        {
+            pid_free(proc->tgid);
+            kfree(group);
+        }
+        proc->group = NULL;
+        nr_running--;
+        if (!proc->kernel)
+            nr_user--;
+        need_resched = true;
+        spinlock_release(&lock);
 
-        current_pid = (count == 0) ? 0 : (current_pid + 1) % count;
         trace("Process %d exited with return code %d", proc->pid, return_code);
 
-        if (count == 0)
+        if (nr_user == 0 && !proc->kernel)
         {
-            trace("No more processes available, freezing scheduler.");
+            trace("No more processes available, idling.");
             if (die_func)
                 die_func();
-            hlt();
         }
+        irq_restore(flags); // Nothing left to do here, the next interrupt switches away for good
     }
     else
     {
-        error("No process to exit (current_pid: %d)", current_pid);
+        error("No process to exit");
+    }
+}
+
+// Checked on the way out of every interrupt, see idt_dispatch()
+bool scheduler_need_resched()
+{
+    return need_resched && scheduler_running;
+}
+
+// Both take the lock with interrupts off, the tick takes it too and pipes and rings wake
+// from syscalls with interrupts on
+void scheduler_block(pcb_t *proc)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&lock);
+    if (proc->state == PROCESS_RUNNING || proc->state == PROCESS_READY)
+    {
+        if (proc->state == PROCESS_READY)
+            runqueue_remove(proc);
+        proc->state = PROCESS_WAITING;
+        nr_running--;
+        if (proc == current_proc)
+            need_resched = true;
+    }
+    spinlock_release(&lock);
+    irq_restore(flags);
+}
+
+void scheduler_unblock(pcb_t *proc)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&lock);
+    if (proc->state == PROCESS_WAITING)
+    {
+        proc->state = PROCESS_READY;
+        runqueue_push(proc);
+        nr_running++;
+        scheduler_update_tick();
+
+        // Nobody else would get the CPU off the idle task until the next one-shot, and
+        // kernel threads (e.g. workqueue bottom halves) should run as soon as possible
+        if (current_proc == idle_proc || (proc->kernel && current_proc && !current_proc->kernel))
+            request_resched();
     }
+    spinlock_release(&lock);
+    irq_restore(flags);
+}
+
+// Give up the CPU from kernel mode, e.g. after a kernel thread blocked itself
+void scheduler_yield()
+{
+    scheduler_schedule();
 }
 
 pcb_t *scheduler_get_current()
 {
-    if (procs == NULL)
+    if (current_proc == idle_proc)
+        return NULL;
+    return current_proc;
+}
+
+pcb_t *scheduler_find(uint64_t pid)
+{
+    if (pid >= PROC_MAX_PROCS)
         return NULL;
-    return procs[current_pid];
+    return procs[pid];
 }
 
-int scheduler_proc_add_vnode(uint64_t pid, vnode_t *node)
+// Live processes and kernel threads, unrelated to how many are runnable
+uint64_t scheduler_nr_procs()
+{
+    return pid_count();
+}
+
+// Opens `node` with `flags` (O_*) under a new descriptor
+int scheduler_proc_add_vnode(uint64_t pid, vnode_t *node, uint64_t flags)
 {
     trace("adding new fd to pid %d", pid);
-    if (pid >= count || procs[pid] == NULL)
+    pcb_t *proc = scheduler_find(pid);
+    if (proc == NULL)
     {
         error("Invalid pid %d for process", pid);
         return -1;
     }
-
-    pcb_t *proc = procs[pid];
-    assert(proc);
     assert(node);
 
-    if (proc->fd_count < PROC_MAX_FDS)
-    {
-        proc->fd_table[proc->fd_count++] = node;
-        trace("Added %s to fd %d in pid %d", vfs_get_full_path(node), proc->fd_count - 1, proc->pid);
-    }
-    else
+    file_t *file = proc->files ? file_open(node, flags) : NULL;
+    int fd = file ? fd_alloc(proc->files, file) : -1;
+    if (fd < 0)
     {
         error("No available file descriptors for process %d", proc->pid);
+        file_put(file);
         return -1;
     }
 
-    return proc->fd_count - 1;
+    trace("Added %s to fd %d in pid %d", vfs_get_full_path(node), fd, proc->pid);
+    return fd;
 }
 
 int scheduler_proc_remove_vnode(uint64_t pid, int fd)
 {
-    if (pid >= count || procs[pid] == NULL)
+    pcb_t *proc = scheduler_find(pid);
+    if (proc == NULL)
     {
         error("Invalid pid %d for process", pid);
         return -2;
     }
-
-    pcb_t *proc = procs[pid];
-    assert(proc);
     trace("Attempting to remove fd: %d, pid: %d", fd, proc->pid);
 
-    if (fd < 0 || fd >= PROC_MAX_FDS || proc->fd_table[fd] == NULL)
+    // The slot is simply freed, other descriptors keep their numbers
+    if (!proc->files || fd_free(proc->files, fd) < 0)
     {
         error("Invalid file descriptor %d for process %d", fd, pid);
         return -1;
     }
-
-    if (proc->fd_table[fd] != NULL)
-    {
-        trace("Removing %s from fd %d in pid %d", vfs_get_full_path(proc->fd_table[fd]), fd, proc->pid);
-
-        for (uint64_t i = fd; i < proc->fd_count - 1; i++)
-        {
-            proc->fd_table[i] = proc->fd_table[i + 1];
-        }
-
-        proc->fd_table[--proc->fd_count] = NULL;
-    }
+    trace("Removed fd %d from pid %d", fd, proc->pid);
     return 0;
 }
 
+// Credentials are per process, so every thread of `pid`'s group gets them
 int scheduler_proc_change_whoami(uint64_t pid, user_t info)
 {
-    if (pid >= count || procs[pid] == NULL)
+    pcb_t *proc = scheduler_find(pid);
+    if (proc == NULL)
     {
         error("Invalid pid %d for process", pid);
         return -2;
     }
 
-    pcb_t *proc = procs[pid];
-    assert(proc);
-    proc->whoami = info;
+    uint64_t flags = irq_save();
+    spinlock_acquire(&lock);
+    for (pcb_t *thread = proc->group->threads; thread != NULL; thread = thread->group_next)
+        thread->whoami = info;
+    spinlock_release(&lock);
+    irq_restore(flags);
+
+    if (!proc->kernel)
+        vdso_update_proc(proc);
     return 0;
 }
 
@@ -6,10 +6,25 @@
 #include <dev/vfs.h>
 #include <mm/vma.h>
 #include <util/errno.h>
+#include <proc/wait.h>
+#include <sys/timer.h>
+#include <proc/fdtable.h>
+#include <proc/pid.h>
+#include <proc/kstack.h>
+#include <proc/preempt.h>
+#include <proc/mm.h>
 
 #define PROC_DEFAULT_TIME 1 // Roughly 20ms, timer is expected to run at roughly 200hz
-#define PROC_MAX_PROCS 2048 // that should be plenty
-#define PROC_MAX_FDS 1024   // that shuold hopefully be plenty
+#define PROC_MAX_PROCS PID_MAX
+
+// scheduler_clone() flags, same values as Linux
+#define CLONE_VM 0x00000100             // Share the address space
+#define CLONE_FILES 0x00000400          // Share the descriptor table
+#define CLONE_THREAD 0x00010000         // Same process (tgid and credentials), needs CLONE_VM
+#define CLONE_SETTLS 0x00080000         // Start out with `tls` as FS base
+#define CLONE_PARENT_SETTID 0x00100000  // Store the new tid at `parent_tid`
+#define CLONE_CHILD_CLEARTID 0x00200000 // Zero `child_tid` once the new thread exits
+#define CLONE_CHILD_SETTID 0x01000000   // Store the new tid at `child_tid`, needs CLONE_VM
 
 typedef enum
 {
@@ -26,28 +41,76 @@ typedef struct user
     uint64_t gid;
 } user_t;
 
-// Process control block, some information
+struct pcb;
+
+// The threads of one process, see pcb_t.tgid. Freed together with the tgid once the last
+// of them exited.
+typedef struct thread_group
+{
+    uint64_t nr_threads; // Published and not exited yet
+    struct pcb *threads; // Linked through pcb_t.group_next
+} thread_group_t;
+
+// Control block of a single thread. What the threads of a process share (address space,
+// descriptors) lives behind refcounted pointers, see scheduler_clone().
 typedef struct pcb
 {
-    struct register_ctx ctx;
-    uint64_t pid;
+    uint64_t kernel_rsp; // Saved by context_switch() while not running
+    uint64_t pid;        // Thread id, unique among all tasks
+    uint64_t tgid;       // Process id, the pid of the first thread of the process
+    thread_group_t *group;
+    struct pcb *group_next; // Other threads of the group, under the scheduler lock
+    struct pcb *group_prev; //
     process_state_t state;
     uint64_t timeslice;
-    uint64_t *pagemap;
-    vnode_t *fd_table[PROC_MAX_FDS];
-    uint64_t fd_count;
+    mm_t *mm;          // Address space, the kernel's for kernel threads
+    fd_table_t *files; // NULL for kernel threads
     errno_t errno;
-    user_t whoami; // Current user info, updated when needed ofc
-    vma_context_t *vma_ctx;
-    bool in_syscall;
+    user_t whoami;            // Current user info, kept the same across a thread group
+    uint64_t fs_base;         // Thread pointer (TLS), see arch_prctl()
+    uint64_t clear_child_tid; // Zeroed when the thread exits (CLONE_CHILD_CLEARTID), 0 if none
+    struct pcb *run_next;     // Run queue links, only while READY
+    struct pcb *run_prev;     //
+    struct pcb *wait_next;    // Next sleeper on the same wait queue
+    wait_queue_t *wait_queue; // Queue we are sleeping on, if any
+    ktimer_t wait_timer;      // Timeout of the current wait
+    bool wait_timed_out;
+    bool kernel;  // Kernel thread, runs in ring 0 on kernel_pagemap
+    void *kstack; // Bottom of the task's kernel stack, see kstack_alloc() (NULL for idle)
 } pcb_t;
 
+// Time from asking for a reschedule (timeslice over, wake-up) until the switch happened
+typedef struct sched_stats
+{
+    uint64_t preemptions;
+    uint64_t total_latency_ns;
+    uint64_t max_latency_ns;
+} sched_stats_t;
+
+extern sched_stats_t sched_stats;
+extern mm_t kernel_mm;
+
 void scheduler_init();
+void scheduler_start();
 uint64_t scheduler_spawn(bool user, void (*entry)(void), uint64_t *pagemap);
-void scheduler_tick(struct register_ctx *ctx);
+uint64_t scheduler_spawn_kernel(void (*entry)(void *), void *arg);
+uint64_t scheduler_spawn_image(uint64_t *pagemap, vma_context_t *vma_ctx, uint64_t entry, uint64_t user_rsp);
+uint64_t scheduler_fork();
+uint64_t scheduler_clone(uint64_t flags, uint64_t stack, uint32_t *parent_tid, uint32_t *child_tid, uint64_t tls);
+void scheduler_set_fs_base(pcb_t *proc, uint64_t base);
+void scheduler_reset_user_frame(pcb_t *proc, uint64_t entry, uint64_t user_rsp);
+void scheduler_tick();
+void scheduler_schedule();
+bool scheduler_need_resched();
+void scheduler_update_tick();
+void scheduler_block(pcb_t *proc);
+void scheduler_unblock(pcb_t *proc);
+void scheduler_yield();
 void scheduler_exit(int return_code);
 pcb_t *scheduler_get_current();
-int scheduler_proc_add_vnode(uint64_t pid, vnode_t *node);
+pcb_t *scheduler_find(uint64_t pid);
+uint64_t scheduler_nr_procs();
+int scheduler_proc_add_vnode(uint64_t pid, vnode_t *node, uint64_t flags);
 int scheduler_proc_remove_vnode(uint64_t pid, int fd);
 int scheduler_proc_change_whoami(uint64_t pid, user_t info);
 void scheduler_set_final(void (*final)(void));
@@ -0,0 +1,123 @@
+#include <proc/wait.h>
+#include <proc/scheduler.h>
+#include <lib/assert.h>
+#include <dev/timer/pit.h>
+
+void wait_queue_init(wait_queue_t *wq)
+{
+    spinlock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// Queue the current task on `wq` (or nothing if NULL) and mark it as not runnable. It keeps
+// running until the caller gives up the CPU, see wait_event().
+void wait_queue_sleep(wait_queue_t *wq)
+{
+    pcb_t *proc = scheduler_get_current();
+    assert(proc);
+
+    if (wq)
+    {
+        // Timeouts take the lock from the PIT IRQ
+        uint64_t flags = irq_save();
+        spinlock_acquire(&wq->lock);
+        proc->wait_queue = wq;
+        proc->wait_next = NULL;
+        if (wq->tail)
+            wq->tail->wait_next = proc;
+        else
+            wq->head = proc;
+        wq->tail = proc;
+        spinlock_release(&wq->lock);
+        irq_restore(flags);
+    }
+
+    scheduler_block(proc);
+}
+
+// Only unlinks `proc` if it is still on `wq`. wake_up() may have taken it off already, then
+// its wait_next belongs to wake_up() and must be left alone.
+static void wait_queue_remove(wait_queue_t *wq, pcb_t *proc)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&wq->lock);
+    pcb_t *prev = NULL;
+    for (pcb_t *cur = wq->head; cur != NULL; prev = cur, cur = cur->wait_next)
+    {
+        if (cur != proc)
+            continue;
+
+        if (prev)
+            prev->wait_next = cur->wait_next;
+        else
+            wq->head = cur->wait_next;
+        if (wq->tail == cur)
+            wq->tail = prev;
+        proc->wait_next = NULL;
+        proc->wait_queue = NULL;
+        break;
+    }
+    spinlock_release(&wq->lock);
+    irq_restore(flags);
+}
+
+static void wait_timeout_fire(ktimer_t *timer)
+{
+    pcb_t *proc = (pcb_t *)timer->data;
+    proc->wait_timed_out = true;
+    if (proc->wait_queue)
+        wait_queue_remove(proc->wait_queue, proc);
+    scheduler_unblock(proc);
+}
+
+// Start the deadline of a timed wait of the current task
+void wait_timeout_arm(uint64_t timeout_ns)
+{
+    pcb_t *proc = scheduler_get_current();
+    assert(proc);
+
+    proc->wait_timed_out = false;
+    timer_setup(&proc->wait_timer, wait_timeout_fire, proc);
+    uint64_t now = pit_get_ns();
+    timer_add(&proc->wait_timer, timeout_ns > TIMER_NEVER - now ? TIMER_NEVER : now + timeout_ns);
+}
+
+// Consumes the result of the current timed wait
+bool wait_timeout_expired()
+{
+    pcb_t *proc = scheduler_get_current();
+    assert(proc);
+    if (!proc->wait_timed_out)
+        return false;
+    proc->wait_timed_out = false;
+    return true;
+}
+
+void wait_timeout_clear()
+{
+    pcb_t *proc = scheduler_get_current();
+    assert(proc);
+    timer_cancel(&proc->wait_timer);
+    proc->wait_timed_out = false;
+}
+
+// Tasks are taken off one by one under the lock, so a timeout firing meanwhile either finds
+// its task still queued or already woken, never half way.
+void wake_up(wait_queue_t *wq)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&wq->lock);
+    pcb_t *proc;
+    while ((proc = wq->head) != NULL)
+    {
+        wq->head = proc->wait_next;
+        if (wq->head == NULL)
+            wq->tail = NULL;
+        proc->wait_next = NULL;
+        proc->wait_queue = NULL;
+        scheduler_unblock(proc);
+    }
+    spinlock_release(&wq->lock);
+    irq_restore(flags);
+}
@@ -0,0 +1,76 @@
+#ifndef PROC_WAIT_H
+#define PROC_WAIT_H
+
+#include <lib/spinlock.h>
+#include <util/errno.h>
+#include <util/cpu.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct pcb;
+
+// FIFO of processes sleeping until some condition becomes true
+typedef struct wait_queue
+{
+    spinlock_t lock;
+    struct pcb *head;
+    struct pcb *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {.lock = SPINLOCK_INIT, .head = NULL, .tail = NULL}
+
+void wait_queue_init(wait_queue_t *wq);
+void wait_queue_sleep(wait_queue_t *wq);
+void wait_timeout_arm(uint64_t timeout_ns);
+bool wait_timeout_expired();
+void wait_timeout_clear();
+void wake_up(wait_queue_t *wq);
+
+// Anybody asleep on `wq`, lets wakers skip wake_up() and its lock on the fast path
+static inline bool wait_queue_active(wait_queue_t *wq)
+{
+    return __atomic_load_n(&wq->head, __ATOMIC_SEQ_CST) != NULL;
+}
+
+// proc/scheduler.h includes us for wait_queue_t
+void scheduler_schedule();
+
+// Sleep on `wq` until `cond` holds. Every task has its own kernel stack, so this really
+// blocks in place (syscalls included) and picks up right here after wake_up(). Interrupts
+// stay off between checking `cond` and going to sleep, so a wake-up can't slip in between.
+#define wait_event(wq, cond)                \
+    ({                                      \
+        uint64_t __flags = irq_save();      \
+        while (!(cond))                     \
+        {                                   \
+            wait_queue_sleep(wq);           \
+            scheduler_schedule();           \
+        }                                   \
+        irq_restore(__flags);               \
+        0;                                  \
+    })
+
+// Like wait_event(), but gives up with -ETIMEDOUT after `timeout_ns`.
+// `wq` may be NULL to just sleep.
+#define wait_event_timeout(wq, cond, timeout_ns)     \
+    ({                                               \
+        int __ret = 0;                               \
+        uint64_t __flags = irq_save();               \
+        wait_timeout_arm(timeout_ns);                \
+        while (!(cond))                              \
+        {                                            \
+            if (wait_timeout_expired())              \
+            {                                        \
+                __ret = -ETIMEDOUT;                  \
+                break;                               \
+            }                                        \
+            wait_queue_sleep(wq);                    \
+            scheduler_schedule();                    \
+        }                                            \
+        wait_timeout_clear();                        \
+        irq_restore(__flags);                        \
+        __ret;                                       \
+    })
+
+#endif // PROC_WAIT_H
@@ -0,0 +1,119 @@
+#include <proc/workqueue.h>
+#include <proc/kthread.h>
+#include <mm/kmalloc.h>
+#include <lib/log.h>
+#include <lib/assert.h>
+#include <util/cpu.h>
+
+// Per-CPU queues for bottom halves, IRQ handlers push here via schedule_work()
+static workqueue_t *system_wq[WORKQUEUE_MAX_CPUS] = {0};
+
+static work_t *workqueue_pop(workqueue_t *wq)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&wq->lock);
+    work_t *work = wq->head;
+    if (work)
+    {
+        wq->head = work->next;
+        if (wq->head == NULL)
+            wq->tail = NULL;
+        work->next = NULL;
+        work->pending = false; // May be queued again from inside its own callback
+    }
+    spinlock_release(&wq->lock);
+    irq_restore(flags);
+    return work;
+}
+
+static void worker_thread(void *arg)
+{
+    workqueue_t *wq = (workqueue_t *)arg;
+    for (;;)
+    {
+        wait_event(&wq->wait, wq->head != NULL);
+
+        work_t *work;
+        while ((work = workqueue_pop(wq)) != NULL)
+            work->func(work);
+    }
+}
+
+workqueue_t *workqueue_create(const char *name)
+{
+    workqueue_t *wq = (workqueue_t *)kmalloc(sizeof(workqueue_t));
+    if (!wq)
+    {
+        error("Failed to allocate workqueue \"%s\"", name);
+        return NULL;
+    }
+
+    wq->name = name;
+    spinlock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+    wait_queue_init(&wq->wait);
+
+    wq->pid = kthread_create(worker_thread, wq);
+    if (wq->pid == (uint64_t)-1)
+    {
+        error("Failed to create worker thread for workqueue \"%s\"", name);
+        kfree(wq);
+        return NULL;
+    }
+
+    trace("Created workqueue \"%s\" with worker %d", name, wq->pid);
+    return wq;
+}
+
+void workqueue_init()
+{
+    for (int i = 0; i < WORKQUEUE_MAX_CPUS; i++)
+    {
+        system_wq[i] = workqueue_create("events");
+        assert(system_wq[i]);
+    }
+}
+
+void work_init(work_t *work, work_fn_t func, void *data)
+{
+    work->func = func;
+    work->data = data;
+    work->next = NULL;
+    work->pending = false;
+}
+
+// Safe from interrupt context. Returns false if `work` was already pending.
+bool queue_work(workqueue_t *wq, work_t *work)
+{
+    assert(wq && work && work->func);
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&wq->lock);
+    if (work->pending)
+    {
+        spinlock_release(&wq->lock);
+        irq_restore(flags);
+        return false;
+    }
+
+    work->pending = true;
+    work->next = NULL;
+    if (wq->tail)
+        wq->tail->next = work;
+    else
+        wq->head = work;
+    wq->tail = work;
+    spinlock_release(&wq->lock);
+
+    wake_up(&wq->wait);
+    irq_restore(flags);
+    return true;
+}
+
+bool schedule_work(work_t *work)
+{
+    workqueue_t *wq = system_wq[cpu_id()];
+    assert(wq);
+    return queue_work(wq, work);
+}
@@ -0,0 +1,42 @@
+#ifndef PROC_WORKQUEUE_H
+#define PROC_WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <lib/spinlock.h>
+#include <proc/wait.h>
+
+#define WORKQUEUE_MAX_CPUS 1 // Matches cpu_id(), no SMP yet
+
+struct work;
+typedef void (*work_fn_t)(struct work *work);
+
+// A piece of deferred work, usually embedded in whatever it operates on
+typedef struct work
+{
+    work_fn_t func;
+    void *data;
+    struct work *next;
+    bool pending; // Queued and not yet started, a pending work can't be queued twice
+} work_t;
+
+// FIFO of work items, run one after another by its own kernel thread
+typedef struct workqueue
+{
+    const char *name;
+    spinlock_t lock;
+    work_t *head;
+    work_t *tail;
+    wait_queue_t wait; // Worker sleeps here while the queue is empty
+    uint64_t pid;      // Worker thread
+} workqueue_t;
+
+#define WORK_INIT(fn, d) {.func = (fn), .data = (d), .next = NULL, .pending = false}
+
+void workqueue_init();
+workqueue_t *workqueue_create(const char *name);
+void work_init(work_t *work, work_fn_t func, void *data);
+bool queue_work(workqueue_t *wq, work_t *work);
+bool schedule_work(work_t *work);
+
+#endif // PROC_WORKQUEUE_H
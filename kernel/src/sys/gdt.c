@@ -6,6 +6,7 @@
 gdt_entry_t gdt[7];
 gdt_ptr_t gdt_ptr;
 tss_entry_t tss;
+static uint8_t __attribute__((aligned(16))) df_stack[TSS_IST_STACK_SIZE];
 
 void gdt_init()
 {
@@ -14,8 +15,9 @@ void gdt_init()
     gdt[0] = (gdt_entry_t){0, 0, 0, 0x00, 0x00, 0};                               // Null descriptor
     gdt[1] = (gdt_entry_t){0, 0, 0, GDT_KERNEL_CODE, GDT_GRANULARITY_FLAT, 0};    // Kernel code segment
     gdt[2] = (gdt_entry_t){0, 0, 0, GDT_KERNEL_DATA, GDT_GRANULARITY_FLAT, 0};    // Kernel data segment
-    gdt[3] = (gdt_entry_t){0, 0, 0, GDT_USER_CODE, GDT_GRANULARITY_LONG_MODE, 0}; // User code segment
-    gdt[4] = (gdt_entry_t){0, 0, 0, GDT_USER_DATA, 0x00, 0};                      // User data segment
+    // SYSRET wants user data right before user code, see syscall_init()
+    gdt[3] = (gdt_entry_t){0, 0, 0, GDT_USER_DATA, 0x00, 0};                      // User data segment
+    gdt[4] = (gdt_entry_t){0, 0, 0, GDT_USER_CODE, GDT_GRANULARITY_LONG_MODE, 0}; // User code segment
 
     gdt_ptr.limit = (uint16_t)(sizeof(gdt) - 1);
     gdt_ptr.base = (uint64_t)&gdt;
@@ -35,6 +37,7 @@ void tss_init(uint64_t stack)
     memset(&tss, 0, sizeof(tss_entry_t));
 
     tss.rsp0 = stack;
+    tss.ist1 = (uint64_t)df_stack + TSS_IST_STACK_SIZE;
     tss.io_map_base = sizeof(tss_entry_t);
 
     uint64_t base = (uint64_t)&tss;
@@ -58,6 +61,12 @@ void tss_init(uint64_t stack)
     flush_tss();
 }
 
+// Kernel stack the CPU switches to on an interrupt from ring 3, updated on every task switch
+void tss_set_rsp0(uint64_t rsp0)
+{
+    tss.rsp0 = rsp0;
+}
+
 void gdt_flush(gdt_ptr_t gdt_ptr)
 {
     trace("Flushing GDT to CPU...");
@@ -22,6 +22,15 @@
 #define GDT_USER_DATA (GDT_ACCESS_PRESENT | GDT_ACCESS_RING3 | GDT_ACCESS_DATA | GDT_ACCESS_RW)
 #define GDT_TSS 0xE9
 
+// Selectors, user ones with RPL 3
+#define GDT_KERNEL_CS 0x08
+#define GDT_KERNEL_DS 0x10
+#define GDT_USER_DS 0x1B
+#define GDT_USER_CS 0x23
+
+#define TSS_IST_DOUBLE_FAULT 1 // Known good stack for #DF, e.g. after a kernel stack overflow
+#define TSS_IST_STACK_SIZE 0x1000
+
 // Granularity Flags
 #define GDT_GRANULARITY_4K 0x80
 #define GDT_GRANULARITY_32B 0x40
@@ -80,6 +89,7 @@ extern gdt_ptr_t gdt_ptr;
 void gdt_init();
 void gdt_flush(gdt_ptr_t gdt_ptr);
 void tss_init(uint64_t rsp0);
+void tss_set_rsp0(uint64_t rsp0);
 extern void jump_user(uint64_t addr, uint64_t stack);
 
 #endif // SYS_GDT_H
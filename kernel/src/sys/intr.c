@@ -7,12 +7,17 @@
 #include <lib/assert.h>
 #include <dev/vfs.h>
 #include <mm/vma.h>
+#include <mm/vmm.h>
 #include <util/errno.h>
 #include <sys/syscall.h>
+#include <proc/kstack.h>
 
 struct idt_entry __attribute__((aligned(16))) idt_descriptor[256] = {0};
 idt_intr_handler real_handlers[256] = {0};
 extern uint64_t stubs[];
+extern void syscall_entry(void);
+syscall_stats_t syscall_stats = {0};
+static syscall_cpu_t syscall_cpus[PREEMPT_MAX_CPUS];
 
 struct __attribute__((packed)) idt_ptr
 {
@@ -84,14 +89,7 @@ static void capture_regs(struct register_ctx *context)
     __asm__ volatile(
         "movq %%cs,  %0\n\t"
         "movq %%ss,  %1\n\t"
-        "movq %%es,  %2\n\t"
-        "movq %%ds,  %3\n\t"
-        "movq %%cr0, %4\n\t"
-        "movq %%cr2, %5\n\t"
-        "movq %%cr3, %6\n\t"
-        "movq %%cr4, %7\n\t"
-        : "=r"(context->cs), "=r"(context->ss), "=r"(context->es), "=r"(context->ds),
-          "=r"(context->cr0), "=r"(context->cr2), "=r"(context->cr3), "=r"(context->cr4)
+        : "=r"(context->cs), "=r"(context->ss)
         :
         : "memory");
 
@@ -130,6 +128,13 @@ void kpanic(struct register_ctx *ctx, const char *fmt, ...)
 
     char buf[1024];
 
+    // Not part of the interrupt frame, but still what they were at the time of the fault
+    uint64_t cr0, cr2, cr3, cr4;
+    __asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("movq %%cr2, %0" : "=r"(cr2));
+    __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+
     if (fmt)
     {
         va_list args;
@@ -139,7 +144,11 @@ void kpanic(struct register_ctx *ctx, const char *fmt, ...)
     }
     else
     {
-        if (regs.vector >= sizeof(strings) / sizeof(strings[0]))
+        if ((regs.vector == 8 || regs.vector == 14) && kstack_is_guard(cr2))
+        {
+            snprintf(buf, sizeof(buf), "Kernel stack overflow (%s)", strings[regs.vector]);
+        }
+        else if (regs.vector >= sizeof(strings) / sizeof(strings[0]))
         {
             snprintf(buf, sizeof(buf), "Unknown panic vector: %d", regs.vector);
         }
@@ -154,8 +163,6 @@ void kpanic(struct register_ctx *ctx, const char *fmt, ...)
     if (proc)
     {
         printf(", pid %d error: %s", proc->pid, ERRNO_TO_STR(proc->errno));
-        // Also exit out from any active syscall
-        proc->in_syscall = false;
     }
     printf(" ===\n");
 
@@ -181,15 +188,11 @@ void kpanic(struct register_ctx *ctx, const char *fmt, ...)
     kprintf("| %-12s | 0x%016llx |\n", "r14", regs.r14);
     kprintf("| %-12s | 0x%016llx |\n", "r15", regs.r15);
 
-    kprintf("\n[SEGMENT REGISTERS]\n");
-    kprintf("| %-12s | 0x%016llx |\n", "es", regs.es);
-    kprintf("| %-12s | 0x%016llx |\n", "ds", regs.ds);
-
     kprintf("\n[CONTROL REGISTERS]\n");
-    kprintf("| %-12s | 0x%016llx |\n", "cr0", regs.cr0);
-    kprintf("| %-12s | 0x%016llx |\n", "cr2", regs.cr2);
-    kprintf("| %-12s | 0x%016llx |\n", "cr3", regs.cr3);
-    kprintf("| %-12s | 0x%016llx |\n", "cr4", regs.cr4);
+    kprintf("| %-12s | 0x%016llx |\n", "cr0", cr0);
+    kprintf("| %-12s | 0x%016llx |\n", "cr2", cr2);
+    kprintf("| %-12s | 0x%016llx |\n", "cr3", cr3);
+    kprintf("| %-12s | 0x%016llx |\n", "cr4", cr4);
 
     kprintf("\n[FINAL SYSTEM STATE]\n");
     kprintf("| %-12s | 0x%016llx |\n", "vector", regs.vector);
@@ -221,10 +224,6 @@ void syscall_handler(struct register_ctx *ctx)
     {
         warning("Syscall fired while not in a process, is this intentional?");
     }
-    else
-    {
-        proc->in_syscall = true;
-    }
 
     s_trace("syscall(%lu, 0x%.16lx, 0x%.16lx, 0x%.16lx, 0x%.16lx) from 0x%.16llx",
             ctx->rax,
@@ -234,11 +233,15 @@ void syscall_handler(struct register_ctx *ctx)
             ctx->rcx,
             ctx->rip);
 
-    int status = 0;
+    long status = 0;
+
+    // int 0x80 is an interrupt gate, but syscalls may run for a while (big reads, slow
+    // serial writes), so let the tick preempt them like any other code
+    irq_enable();
 
     if (ctx->rax < SYSCALL_TABLE_SIZE)
     {
-        status = syscall_table[ctx->rax]((void *)ctx->rdi, (void *)ctx->rsi, (void *)ctx->rdx, (void *)ctx->rcx, (void *)ctx->r8);
+        status = syscall_table[ctx->rax]((void *)ctx->rdi, (void *)ctx->rsi, (void *)ctx->rdx, (void *)ctx->rcx, (void *)ctx->r8, (void *)ctx->r9);
     }
     else
     {
@@ -246,6 +249,8 @@ void syscall_handler(struct register_ctx *ctx)
         status = -EINVAL;
     }
 
+    irq_disable();
+
     if (proc)
     {
         if (status < 0)
@@ -254,19 +259,125 @@ void syscall_handler(struct register_ctx *ctx)
             warning("%s: %s", SYSCALL_TO_STR(ctx->rax), ERRNO_TO_STR(proc->errno));
             if (proc->errno == ENOTTY)
             {
-                warning(" - device: %s", vfs_get_full_path(proc->fd_table[ctx->rdi]));
+                file_t *file = fd_get(proc->files, ctx->rdi);
+                if (file)
+                    warning(" - device: %s", vfs_get_full_path(file->node));
+                file_put(file);
             }
         }
-        proc->in_syscall = false;
     }
     ctx->rax = status;
 }
 
+// Something woke up a process while idle, the current one exited/blocked or ran out of
+// its timeslice. Kernel code is only preempted outside of spinlocks and irq-off sections.
+static void idt_preempt(struct register_ctx *ctx)
+{
+    if (scheduler_need_resched() && preempt_count() == 0 && (ctx->rflags & RFLAGS_IF))
+    {
+        scheduler_schedule();
+    }
+}
+
+// Called by isr_handler_stub for every vector
+void idt_dispatch(struct register_ctx *ctx)
+{
+    // IRQ handlers are atomic, syscalls and exceptions run in the context of the current task
+    bool irq = ctx->vector >= IDT_IRQ_BASE && ctx->vector < IDT_IRQ_BASE + 16;
+    if (irq)
+        preempt_disable();
+    real_handlers[ctx->vector](ctx);
+    if (irq)
+        preempt_enable();
+
+    idt_preempt(ctx);
+}
+
 void idt_default_interrupt_handler(struct register_ctx *ctx)
 {
     kpanic(ctx, NULL);
 }
 
+// Copy-on-write faults are resolved by the VMM and demand paging by the VMA layer. Anything
+// else kills the process if user code faulted (there are no signals to send, so this stands in
+// for SIGSEGV/SIGBUS), and the kernel if it was the kernel itself.
+static void page_fault_handler(struct register_ctx *ctx)
+{
+    uint64_t cr2;
+    __asm__ volatile("movq %%cr2, %0" : "=r"(cr2));
+
+    // Kernel threads only have user memory to fault on after kthread_use_mm()
+    pcb_t *proc = scheduler_get_current();
+    if (proc && proc->mm != &kernel_mm)
+    {
+        // CR2 is safe now, and reading a page in may take a while. The regions must stay put
+        // meanwhile (another thread may munmap()), in atomic context we can't wait for that.
+        mm_t *mm = proc->mm;
+        bool locked = true;
+        if ((ctx->rflags & RFLAGS_IF) && preempt_count() == 0)
+        {
+            irq_enable();
+            rwsem_read_lock(&mm->sem);
+        }
+        else
+        {
+            locked = rwsem_read_trylock(&mm->sem);
+        }
+
+        bool handled = locked && (vmm_handle_fault(mm->pagemap, cr2, ctx->err) ||
+                                  vma_handle_fault(mm->vma_ctx, cr2, ctx->err));
+        if (locked)
+            rwsem_read_unlock(&mm->sem);
+        irq_disable();
+        if (handled)
+            return;
+
+        if (ctx->err & VMM_FAULT_USER)
+        {
+            warning("Killing process %llu: unhandled page fault at 0x%.16llx (rip 0x%.16llx, err 0x%llx)", proc->pid, cr2, ctx->rip, ctx->err);
+            scheduler_exit(-EFAULT); // Switched away from on the way out, see idt_preempt()
+            return;
+        }
+    }
+
+    kpanic(ctx, NULL);
+}
+
+static void syscall_legacy_handler(struct register_ctx *ctx)
+{
+    syscall_stats.legacy++;
+    syscall_handler(ctx);
+}
+
+// C side of the SYSCALL entry, returns whether SYSRET may take us back to ring 3
+bool syscall_dispatch(struct register_ctx *ctx)
+{
+    syscall_stats.fast++;
+    syscall_handler(ctx);
+    idt_preempt(ctx);
+
+    // SYSRET to a non-canonical rip would fault in ring 0, on the user's stack
+    return ctx->rip < VMM_USER_END && ctx->cs == GDT_USER_CS;
+}
+
+// SYSCALL enters at syscall_entry with CS 0x08/SS 0x10 and IF masked, SYSRET goes back to
+// GDT_USER_CS/GDT_USER_DS (STAR base + 16 and + 8)
+void syscall_init()
+{
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+    wrmsr(MSR_STAR, ((uint64_t)(GDT_USER_DS - 8) << 48) | ((uint64_t)GDT_KERNEL_CS << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
+    wrmsr(MSR_SFMASK, RFLAGS_IF | RFLAGS_DF | RFLAGS_TF | RFLAGS_AC);
+    wrmsr(MSR_KERNEL_GS_BASE, (uint64_t)&syscall_cpus[cpu_id()]);
+    trace("SYSCALL entry at 0x%.16llx", (uint64_t)syscall_entry);
+}
+
+// Kernel stack SYSCALL switches to, kept in sync with TSS.rsp0 on every task switch
+void syscall_set_kernel_rsp(uint64_t rsp)
+{
+    syscall_cpus[cpu_id()].kernel_rsp = rsp;
+}
+
 #define SET_GATE(interrupt, base, flags)                                    \
     do                                                                      \
     {                                                                       \
@@ -292,9 +403,13 @@ void idt_init()
         SET_GATE(i, stubs[i], IDT_INTERRUPT_GATE);
     }
 
-    // Set up syscalls (allow userspace to call int 0x80)
+    // Interrupt gate, so nothing can clobber CR2 before we read it
+    SET_GATE(14, stubs[14], IDT_INTERRUPT_GATE);
+    real_handlers[14] = page_fault_handler;
+
+    // Set up syscalls (allow userspace to call int 0x80), SYSCALL is the fast way in
     SET_GATE(0x80, stubs[0x80], IDT_INTERRUPT_GATE | GDT_ACCESS_RING3);
-    real_handlers[0x80] = syscall_handler;
+    real_handlers[0x80] = syscall_legacy_handler;
 }
 
 void load_idt()
@@ -304,6 +419,12 @@ void load_idt()
         : : "m"(idt_ptr) : "memory");
 }
 
+// Only valid once the TSS is loaded, see tss_init()
+void idt_set_ist(size_t vector, uint8_t ist)
+{
+    idt_descriptor[vector].ist = ist;
+}
+
 int idt_register_handler(size_t vector, idt_intr_handler handler)
 {
     if (real_handlers[vector] != idt_default_interrupt_handler)
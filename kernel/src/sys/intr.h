@@ -5,11 +5,10 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 struct __attribute__((packed)) register_ctx
 {
-    uint64_t es, ds;
-    uint64_t cr4, cr3, cr2, cr0;
     uint64_t r15, r14, r13, r12, r11, r10, r9, r8, rsi, rdi, rbp, rdx, rcx, rbx, rax;
     uint64_t vector, err;
     uint64_t rip, cs, rflags, rsp, ss;
@@ -27,6 +26,21 @@ struct __attribute__((packed)) idt_entry
 };
 
 typedef void (*idt_intr_handler)(struct register_ctx *ctx);
+
+// Found through KERNEL_GS_BASE by the SYSCALL entry, see sys/syscall_entry.S
+typedef struct syscall_cpu
+{
+    uint64_t kernel_rsp; // Top of the running task's kernel stack, like TSS.rsp0
+    uint64_t user_rsp;   // Scratch for the entry
+} syscall_cpu_t;
+
+typedef struct syscall_stats
+{
+    uint64_t fast;   // Through SYSCALL
+    uint64_t legacy; // Through int 0x80
+} syscall_stats_t;
+
+extern syscall_stats_t syscall_stats;
 #define IDT_INTERRUPT_GATE (0x8E)
 #define IDT_TRAP_GATE (0x8F)
 #define IDT_IRQ_BASE (0x20)
@@ -34,6 +48,11 @@ typedef void (*idt_intr_handler)(struct register_ctx *ctx);
 void idt_init();
 void load_idt();
 int idt_register_handler(size_t vector, idt_intr_handler handler);
+void idt_set_ist(size_t vector, uint8_t ist);
+void idt_dispatch(struct register_ctx *ctx);
+void syscall_init();
+void syscall_set_kernel_rsp(uint64_t rsp);
+bool syscall_dispatch(struct register_ctx *ctx);
 void idt_default_interrupt_handler(struct register_ctx *ctx);
 void kpanic(struct register_ctx *ctx, const char *fmt, ...);
 
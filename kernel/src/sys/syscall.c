@@ -5,23 +5,57 @@
 #include <util/errno.h>
 #include <lib/assert.h>
 #include <dev/time/rtc.h>
+#include <dev/timer/pit.h>
+#include <sys/timer.h>
+#include <proc/wait.h>
+#include <proc/exec.h>
+#include <proc/futex.h>
+#include <fs/pipe.h>
+#include <fs/shmfs.h>
+#include <mm/mmap.h>
+#include <mm/kmalloc.h>
+#include <mm/vmm.h>
 
 syscall_fn_t syscall_table[] = {
-    (syscall_fn_t)sys_exit,   // SYS_exit
-    (syscall_fn_t)sys_open,   // SYS_open
-    (syscall_fn_t)sys_close,  // SYS_close
-    (syscall_fn_t)sys_write,  // SYS_write
-    (syscall_fn_t)sys_read,   // SYS_read
-    (syscall_fn_t)sys_stat,   // SYS_stat
-    (syscall_fn_t)sys_setuid, // SYS_setuid
-    (syscall_fn_t)sys_setgid, // SYS_setgid
-    (syscall_fn_t)sys_ioctl,  // SYS_ioctl
-    (syscall_fn_t)sys_getpid, // SYS_getpid
-    (syscall_fn_t)sys_uname,  // SYS_uname
+    (syscall_fn_t)sys_exit,          // SYS_exit
+    (syscall_fn_t)sys_open,          // SYS_open
+    (syscall_fn_t)sys_close,         // SYS_close
+    (syscall_fn_t)sys_write,         // SYS_write
+    (syscall_fn_t)sys_read,          // SYS_read
+    (syscall_fn_t)sys_stat,          // SYS_stat
+    (syscall_fn_t)sys_setuid,        // SYS_setuid
+    (syscall_fn_t)sys_setgid,        // SYS_setgid
+    (syscall_fn_t)sys_ioctl,         // SYS_ioctl
+    (syscall_fn_t)sys_getpid,        // SYS_getpid
+    (syscall_fn_t)sys_uname,         // SYS_uname
+    (syscall_fn_t)sys_nanosleep,     // SYS_nanosleep
+    (syscall_fn_t)sys_clock_gettime, // SYS_clock_gettime
+    (syscall_fn_t)sys_fork,          // SYS_fork
+    (syscall_fn_t)sys_execve,        // SYS_execve
+    (syscall_fn_t)sys_clone,         // SYS_clone
+    (syscall_fn_t)sys_arch_prctl,    // SYS_arch_prctl
+    (syscall_fn_t)sys_gettid,        // SYS_gettid
+    (syscall_fn_t)sys_futex,         // SYS_futex
+    (syscall_fn_t)sys_ring_setup,    // SYS_ring_setup
+    (syscall_fn_t)sys_ring_enter,    // SYS_ring_enter
+    (syscall_fn_t)sys_lseek,         // SYS_lseek
+    (syscall_fn_t)sys_pread,         // SYS_pread
+    (syscall_fn_t)sys_pwrite,        // SYS_pwrite
+    (syscall_fn_t)sys_readv,         // SYS_readv
+    (syscall_fn_t)sys_writev,        // SYS_writev
+    (syscall_fn_t)sys_sendfile,      // SYS_sendfile
+    (syscall_fn_t)sys_splice,        // SYS_splice
+    (syscall_fn_t)sys_pipe,          // SYS_pipe
+    (syscall_fn_t)sys_shm_open,      // SYS_shm_open
+    (syscall_fn_t)sys_shm_unlink,    // SYS_shm_unlink
+    (syscall_fn_t)sys_ftruncate,     // SYS_ftruncate
+    (syscall_fn_t)sys_mmap,          // SYS_mmap
+    (syscall_fn_t)sys_munmap,        // SYS_munmap
+    (syscall_fn_t)sys_mprotect,      // SYS_mprotect
 };
 
 // Define the syscalls
-int sys_exit(int code)
+long sys_exit(int code)
 {
     s_trace("exit(%d)", code);
     if (!scheduler_get_current())
@@ -30,13 +64,15 @@ int sys_exit(int code)
     return 0;
 }
 
-int sys_open(const char *path, uint64_t flags, uint8_t kind)
+long sys_open(const char *path, uint64_t flags, uint8_t kind)
 {
     s_trace("open(path=\"%s\", flags=%llu)", path, flags);
     if (!scheduler_get_current())
         return -ESRCH;
 
     vnode_t *node = vfs_lazy_lookup(VFS_ROOT()->mount, path);
+    if ((flags & (O_CREATE | O_EXCL)) == (O_CREATE | O_EXCL) && node != NULL)
+        return -EEXIST;
     if ((flags & O_CREATE) && node == NULL)
     {
         node = vfs_create_vnode(vfs_lazy_lookup_last(VFS_ROOT()->mount, path), FILENAME_FROM_PATH(path), kind);
@@ -49,10 +85,10 @@ int sys_open(const char *path, uint64_t flags, uint8_t kind)
     }
 
     node->access_time = GET_CURRENT_UNIX_TIME();
-    return scheduler_proc_add_vnode(scheduler_get_current()->pid, node);
+    return scheduler_proc_add_vnode(scheduler_get_current()->pid, node, flags);
 }
 
-int sys_close(int fd)
+long sys_close(int fd)
 {
     s_trace("close(fd=%d)", fd);
     if (!scheduler_get_current())
@@ -67,57 +103,74 @@ int sys_close(int fd)
     return 0;
 }
 
-int sys_write(int fd, void *buff, size_t size)
+// Descriptor lookup and permission check of the read and write families. `action` is what
+// vfs_am_i_allowed() takes, 1 to read and 2 to write. The caller puts the file.
+static int sys_get_file(int fd, uint64_t action, const char *name, file_t **out)
 {
-    s_trace("write(fd=%d, buff=0x%.16lx, size=%d, offset=0)", fd, (uint64_t)buff, (int)size);
-    if (!scheduler_get_current())
-        return -ESRCH;
-
-    vnode_t *node = scheduler_get_current()->fd_table[fd];
-    if (node == NULL)
+    pcb_t *proc = scheduler_get_current();
+    file_t *file = fd_get(proc->files, fd);
+    if (file == NULL)
     {
-        warning("Invalid file descriptor passed to write()");
+        warning("Invalid file descriptor passed to %s()", name);
         return -EBADF;
     }
 
-    if (!vfs_am_i_allowed(node, scheduler_get_current()->whoami.uid, scheduler_get_current()->whoami.gid, 2))
+    if (!vfs_am_i_allowed(file->node, proc->whoami.uid, proc->whoami.gid, action))
     {
+        file_put(file);
         return -EACCES;
     }
 
+    *out = file;
+    return 0;
+}
+
+// Whether `size` bytes at `ptr` may be read (or written if `write`) by the kernel on behalf of
+// the current process, see mm_user_access()
+static bool sys_user_access(const void *ptr, size_t size, bool write)
+{
+    return mm_user_access(scheduler_get_current()->mm, (uint64_t)ptr, size, write);
+}
+
+long sys_write(int fd, void *buff, size_t size)
+{
+    s_trace("write(fd=%d, buff=0x%.16lx, size=%d)", fd, (uint64_t)buff, (int)size);
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    file_t *file;
+    int ret = sys_get_file(fd, 2, "write", &file);
+    if (ret < 0)
+        return ret;
+
     assert(buff);
     assert(size);
 
-    int ret = vfs_write(node, buff, size, 0);
+    ret = file_write(file, buff, size);
+    file_put(file);
     return (ret == -1) ? -ENOTIMPL : ret;
 }
 
-int sys_read(int fd, void *buff, size_t size)
+long sys_read(int fd, void *buff, size_t size)
 {
-    s_trace("read(fd=%d, buff=0x%.16lx, size=%d, offset=0)", fd, (uint64_t)buff, (int)size);
+    s_trace("read(fd=%d, buff=0x%.16lx, size=%d)", fd, (uint64_t)buff, (int)size);
     if (!scheduler_get_current())
         return -ESRCH;
 
-    vnode_t *node = scheduler_get_current()->fd_table[fd];
-    if (node == NULL)
-    {
-        warning("Invalid file descriptor passed to read()");
-        return -EBADF;
-    }
-
-    if (!vfs_am_i_allowed(node, scheduler_get_current()->whoami.uid, scheduler_get_current()->whoami.gid, 1))
-    {
-        return -EACCES;
-    }
+    file_t *file;
+    int ret = sys_get_file(fd, 1, "read", &file);
+    if (ret < 0)
+        return ret;
 
     assert(buff);
     assert(size);
 
-    int ret = vfs_read(node, buff, size, 0);
+    ret = file_read(file, buff, size);
+    file_put(file);
     return (ret == -1) ? -ENOTIMPL : ret;
 }
 
-int sys_stat(int fd, stat_t *stat)
+long sys_stat(int fd, stat_t *stat)
 {
     s_trace("stat(fd=%d, stat=0x%.16lx)", fd, (uintptr_t)stat);
     if (!scheduler_get_current())
@@ -129,71 +182,75 @@ int sys_stat(int fd, stat_t *stat)
         return -EFAULT;
     }
 
-    vnode_t *node = scheduler_get_current()->fd_table[fd];
-    if (node == NULL)
+    file_t *file = fd_get(scheduler_get_current()->files, fd);
+    if (file == NULL)
     {
         warning("Invalid file descriptor passed to stat()");
         return -EBADF;
     }
 
+    vnode_t *node = file->node;
     stat->flags = node->flags;
     stat->size = node->size;
     stat->type = (uint32_t)node->type;
     stat->uid = node->uid;
     stat->gid = node->gid;
     stat->mode = node->mode;
+    file_put(file);
     return 0;
 }
 
-int sys_setuid(uint32_t uid)
+long sys_setuid(uint32_t uid)
 {
     s_trace("setuid(uid=%d)", uid);
     if (!scheduler_get_current())
         return -ESRCH;
-    scheduler_get_current()->whoami.uid = uid;
+    user_t info = scheduler_get_current()->whoami;
+    info.uid = uid;
+    scheduler_proc_change_whoami(scheduler_get_current()->pid, info);
     return 0;
 }
 
-int sys_setgid(uint32_t gid)
+long sys_setgid(uint32_t gid)
 {
     s_trace("setgid(gid=%d)", gid);
     if (!scheduler_get_current())
         return -ESRCH;
-    scheduler_get_current()->whoami.gid = gid;
+    user_t info = scheduler_get_current()->whoami;
+    info.gid = gid;
+    scheduler_proc_change_whoami(scheduler_get_current()->pid, info);
     return 0;
 }
 
-int sys_ioctl(int fd, uint32_t cmd, uint32_t arg)
+long sys_ioctl(int fd, uint32_t cmd, uint32_t arg)
 {
     s_trace("ioctl(fd=%d, cmd=0x%x, arg=0x%x)", fd, cmd, arg);
     if (!scheduler_get_current())
         return -ESRCH;
 
-    vnode_t *node = scheduler_get_current()->fd_table[fd];
-    if (node == NULL)
+    file_t *file = fd_get(scheduler_get_current()->files, fd);
+    if (file == NULL)
     {
         warning("Invalid file descriptor passed to ioctl()");
         return -EBADF;
     }
 
-    if (node->ops->ioctl == NULL)
-    {
-        return -ENOTTY;
-    }
-
-    return node->ops->ioctl(node, cmd, arg);
+    vnode_t *node = file->node;
+    int ret = node->ops->ioctl ? node->ops->ioctl(node, cmd, arg) : -ENOTTY;
+    file_put(file);
+    return ret;
 }
 
-int sys_getpid()
+long sys_getpid()
 {
     s_trace("getpid()");
     if (!scheduler_get_current())
         return -ESRCH;
 
-    return scheduler_get_current()->pid;
+    return scheduler_get_current()->tgid;
 }
 
-int sys_uname(uname_t *buf)
+long sys_uname(uname_t *buf)
 {
     return -ENOTIMPL;
     if (!buf)
@@ -216,3 +273,583 @@ int sys_uname(uname_t *buf)
 
     return 0;
 }
+
+long sys_nanosleep(const timespec_t *req, timespec_t *rem)
+{
+    s_trace("nanosleep(req=0x%.16lx, rem=0x%.16lx)", (uint64_t)req, (uint64_t)rem);
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    if (!sys_user_access(req, sizeof(timespec_t), false))
+        return -EFAULT;
+
+    timespec_t ts = *req;
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000)
+        return -EINVAL;
+
+    // Clamp to something that can't overflow, the timer wheel caps it further anyways
+    uint64_t ns = MIN((uint64_t)ts.tv_sec, 0xFFFFFFFFull) * 1000000000ull + ts.tv_nsec;
+
+    // Nothing else wakes us, so this only returns once the timeout fired
+    wait_event_timeout(NULL, false, ns);
+
+    if (rem)
+    {
+        // Checked only now, another thread may have unmapped it while we slept
+        if (!sys_user_access(rem, sizeof(timespec_t), true))
+            return -EFAULT;
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    return 0;
+}
+
+long sys_clock_gettime(uint64_t clock, timespec_t *tp)
+{
+    s_trace("clock_gettime(clock=%llu, tp=0x%.16lx)", clock, (uint64_t)tp);
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    uint64_t ns = pit_get_ns();
+    timespec_t ts;
+    switch (clock)
+    {
+    case CLOCK_REALTIME:
+        ts.tv_sec = timer_realtime_base() + ns / 1000000000ull;
+        break;
+    case CLOCK_MONOTONIC:
+        ts.tv_sec = ns / 1000000000ull;
+        break;
+    default:
+        return -EINVAL;
+    }
+    ts.tv_nsec = ns % 1000000000ull;
+
+    if (!sys_user_access(tp, sizeof(timespec_t), true))
+        return -EFAULT;
+    *tp = ts;
+    return 0;
+}
+
+long sys_fork()
+{
+    s_trace("fork()");
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    uint64_t pid = scheduler_fork();
+    if (pid == (uint64_t)-1)
+        return -ENOMEM;
+
+    return pid;
+}
+
+long sys_execve(const char *path, const char *const argv[], const char *const envp[])
+{
+    s_trace("execve(path=\"%s\", argv=0x%.16lx, envp=0x%.16lx)", path, (uint64_t)argv, (uint64_t)envp);
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    if (path == NULL)
+        return -EFAULT;
+
+    return exec_replace(path, argv, envp);
+}
+
+long sys_clone(uint64_t flags, uint64_t stack, uint32_t *parent_tid, uint32_t *child_tid, uint64_t tls)
+{
+    s_trace("clone(flags=0x%llx, stack=0x%.16lx, parent_tid=0x%.16lx, child_tid=0x%.16lx, tls=0x%.16lx)",
+            flags, stack, (uint64_t)parent_tid, (uint64_t)child_tid, tls);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc || proc->kernel)
+        return -ESRCH;
+
+    uint64_t known = CLONE_VM | CLONE_FILES | CLONE_THREAD | CLONE_SETTLS | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID | CLONE_CHILD_SETTID;
+    if (flags & ~known)
+        return -EINVAL;
+
+    // A copied address space would need the child's tid written past copy-on-write
+    if ((flags & (CLONE_THREAD | CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID)) && !(flags & CLONE_VM))
+        return -EINVAL;
+
+    // Stored through without any further checks, by clone() itself and when the child exits
+    if (((flags & CLONE_PARENT_SETTID) && !mm_user_writable(proc->mm, (uint64_t)parent_tid, sizeof(uint32_t))) ||
+        ((flags & (CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID)) && !mm_user_writable(proc->mm, (uint64_t)child_tid, sizeof(uint32_t))))
+        return -EFAULT;
+
+    if (stack >= VMM_USER_END || ((flags & CLONE_SETTLS) && tls >= VMM_USER_END))
+        return -EINVAL;
+
+    uint64_t pid = scheduler_clone(flags, stack, parent_tid, child_tid, tls);
+    if (pid == (uint64_t)-1)
+        return -ENOMEM;
+
+    return pid;
+}
+
+long sys_arch_prctl(int code, uint64_t addr)
+{
+    s_trace("arch_prctl(code=0x%x, addr=0x%.16lx)", code, addr);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc)
+        return -ESRCH;
+
+    switch (code)
+    {
+    case ARCH_SET_FS:
+        // Non-canonical bases would #GP on wrmsr
+        if (addr >= VMM_USER_END)
+            return -EACCES;
+        scheduler_set_fs_base(proc, addr);
+        return 0;
+    case ARCH_GET_FS:
+        if (!addr || addr >= VMM_USER_END)
+            return -EFAULT;
+        *(uint64_t *)addr = proc->fs_base;
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+long sys_gettid()
+{
+    s_trace("gettid()");
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    return scheduler_get_current()->pid;
+}
+
+// `timeout` doubles as the requeue count for (CMP_)REQUEUE, like on Linux
+long sys_futex(uint32_t *uaddr, int op, uint32_t val, const timespec_t *timeout, uint32_t *uaddr2, uint32_t val3)
+{
+    s_trace("futex(uaddr=0x%.16lx, op=%d, val=%u, timeout=0x%.16lx, uaddr2=0x%.16lx, val3=%u)",
+            (uint64_t)uaddr, op, val, (uint64_t)timeout, (uint64_t)uaddr2, val3);
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    int cmd = op & FUTEX_CMD_MASK;
+    uint64_t timeout_ns = FUTEX_NO_TIMEOUT;
+    if ((cmd == FUTEX_WAIT || cmd == FUTEX_WAIT_BITSET) && timeout)
+    {
+        // Read once, the process could change it between the check and the conversion
+        if (!sys_user_access(timeout, sizeof(timespec_t), false))
+            return -EFAULT;
+        timespec_t ts = *timeout;
+        if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000)
+            return -EINVAL;
+
+        // Clamped like nanosleep(), so it can't overflow into a short (or no) timeout
+        timeout_ns = MIN((uint64_t)ts.tv_sec, 0xFFFFFFFFull) * 1000000000ull + ts.tv_nsec;
+
+        // WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline
+        if (cmd == FUTEX_WAIT_BITSET)
+        {
+            uint64_t now = pit_get_ns();
+            timeout_ns = timeout_ns > now ? timeout_ns - now : 0;
+        }
+    }
+
+    switch (cmd)
+    {
+    case FUTEX_WAIT:
+        return futex_wait(uaddr, val, timeout_ns, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAIT_BITSET:
+        return futex_wait(uaddr, val, timeout_ns, val3);
+    case FUTEX_WAKE:
+        return futex_wake(uaddr, val, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAKE_BITSET:
+        return futex_wake(uaddr, val, val3);
+    case FUTEX_REQUEUE:
+        return futex_requeue(uaddr, val, (uint32_t)(uint64_t)timeout, uaddr2, false, 0);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(uaddr, val, (uint32_t)(uint64_t)timeout, uaddr2, true, val3);
+    default:
+        return -ENOTIMPL;
+    }
+}
+
+long sys_ring_setup(uint32_t entries, uint32_t flags, ring_params_t *params)
+{
+    s_trace("ring_setup(entries=%u, flags=%u, params=0x%.16lx)", entries, flags, (uint64_t)params);
+    return ring_setup(entries, flags, params);
+}
+
+long sys_ring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    s_trace("ring_enter(to_submit=%u, min_complete=%u, flags=%u)", to_submit, min_complete, flags);
+    return ring_enter(to_submit, min_complete, flags);
+}
+
+long sys_lseek(int fd, int64_t offset, int whence)
+{
+    s_trace("lseek(fd=%d, offset=%lld, whence=%d)", fd, offset, whence);
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    file_t *file = fd_get(scheduler_get_current()->files, fd);
+    if (file == NULL)
+    {
+        warning("Invalid file descriptor passed to lseek()");
+        return -EBADF;
+    }
+
+    int64_t pos = file_seek(file, offset, whence);
+    file_put(file);
+    return pos;
+}
+
+// Like read(), but at `offset` and without moving the file position
+long sys_pread(int fd, void *buff, size_t size, uint64_t offset)
+{
+    s_trace("pread(fd=%d, buff=0x%.16lx, size=%d, offset=%llu)", fd, (uint64_t)buff, (int)size, offset);
+    if (!scheduler_get_current())
+        return -ESRCH;
+    if (!sys_user_access(buff, size, true))
+        return -EFAULT;
+
+    file_t *file;
+    int ret = sys_get_file(fd, 1, "pread", &file);
+    if (ret < 0)
+        return ret;
+
+    ret = size ? vfs_read(file->node, buff, size, offset) : 0;
+    file_put(file);
+    return (ret == -1) ? -ENOTIMPL : ret;
+}
+
+// Like write(), but at `offset` and without moving the file position
+long sys_pwrite(int fd, void *buff, size_t size, uint64_t offset)
+{
+    s_trace("pwrite(fd=%d, buff=0x%.16lx, size=%d, offset=%llu)", fd, (uint64_t)buff, (int)size, offset);
+    if (!scheduler_get_current())
+        return -ESRCH;
+    if (!sys_user_access(buff, size, false))
+        return -EFAULT;
+
+    file_t *file;
+    int ret = sys_get_file(fd, 2, "pwrite", &file);
+    if (ret < 0)
+        return ret;
+
+    ret = size ? vfs_write(file->node, buff, size, offset) : 0;
+    file_put(file);
+    return (ret == -1) ? -ENOTIMPL : ret;
+}
+
+// Copies the iovec array in, so the process can't change it between the checks and the
+// transfer. The total has to fit the int return value.
+static int sys_copy_iov(const iovec_t *iov, int iovcnt, iovec_t **out)
+{
+    if (iovcnt < 0 || iovcnt > IOV_MAX)
+        return -EINVAL;
+    if (!iov || (uint64_t)iov >= VMM_USER_END || iovcnt * sizeof(iovec_t) > VMM_USER_END - (uint64_t)iov)
+        return -EFAULT;
+
+    iovec_t *copy = (iovec_t *)kmalloc(iovcnt * sizeof(iovec_t));
+    if (!copy)
+        return -ENOMEM;
+    memcpy(copy, iov, iovcnt * sizeof(iovec_t));
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        uint64_t base = (uint64_t)copy[i].iov_base;
+        if (copy[i].iov_len && (!base || base >= VMM_USER_END || copy[i].iov_len > VMM_USER_END - base))
+        {
+            kfree(copy);
+            return -EFAULT;
+        }
+
+        total += copy[i].iov_len;
+        if (copy[i].iov_len > INT32_MAX || total > INT32_MAX)
+        {
+            kfree(copy);
+            return -EINVAL;
+        }
+    }
+
+    *out = copy;
+    return 0;
+}
+
+long sys_readv(int fd, const iovec_t *iov, int iovcnt)
+{
+    s_trace("readv(fd=%d, iov=0x%.16lx, iovcnt=%d)", fd, (uint64_t)iov, iovcnt);
+    if (!scheduler_get_current())
+        return -ESRCH;
+    if (iovcnt == 0)
+        return 0;
+
+    iovec_t *copy;
+    int ret = sys_copy_iov(iov, iovcnt, &copy);
+    if (ret < 0)
+        return ret;
+
+    file_t *file;
+    ret = sys_get_file(fd, 1, "readv", &file);
+    if (ret == 0)
+    {
+        ret = file_readv(file, copy, iovcnt);
+        file_put(file);
+        ret = (ret == -1) ? -ENOTIMPL : ret;
+    }
+    kfree(copy);
+    return ret;
+}
+
+long sys_writev(int fd, const iovec_t *iov, int iovcnt)
+{
+    s_trace("writev(fd=%d, iov=0x%.16lx, iovcnt=%d)", fd, (uint64_t)iov, iovcnt);
+    if (!scheduler_get_current())
+        return -ESRCH;
+    if (iovcnt == 0)
+        return 0;
+
+    iovec_t *copy;
+    int ret = sys_copy_iov(iov, iovcnt, &copy);
+    if (ret < 0)
+        return ret;
+
+    file_t *file;
+    ret = sys_get_file(fd, 2, "writev", &file);
+    if (ret == 0)
+    {
+        ret = file_writev(file, copy, iovcnt);
+        file_put(file);
+        ret = (ret == -1) ? -ENOTIMPL : ret;
+    }
+    kfree(copy);
+    return ret;
+}
+
+// Both ends of sendfile() and splice(), `off_in`/`off_out` are optional user pointers
+static int sys_splice_files(int fd_in, int64_t *off_in, int fd_out, int64_t *off_out, size_t len, const char *name)
+{
+    if ((off_in && !sys_user_access(off_in, sizeof(int64_t), true)) || (off_out && !sys_user_access(off_out, sizeof(int64_t), true)))
+        return -EFAULT;
+    if ((off_in && *off_in < 0) || (off_out && *off_out < 0))
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+
+    file_t *in;
+    int ret = sys_get_file(fd_in, 1, name, &in);
+    if (ret < 0)
+        return ret;
+
+    file_t *out;
+    ret = sys_get_file(fd_out, 2, name, &out);
+    if (ret < 0)
+    {
+        file_put(in);
+        return ret;
+    }
+
+    uint64_t in_offset = off_in ? (uint64_t)*off_in : 0;
+    uint64_t out_offset = off_out ? (uint64_t)*off_out : 0;
+    ret = file_splice(in, off_in ? &in_offset : NULL, out, off_out ? &out_offset : NULL, MIN(len, INT32_MAX));
+    // The transfer may have slept, the offsets could be gone by now
+    if (ret > 0 && ((off_in && !sys_user_access(off_in, sizeof(int64_t), true)) || (off_out && !sys_user_access(off_out, sizeof(int64_t), true))))
+        ret = -EFAULT;
+    if (ret > 0 && off_in)
+        *off_in = in_offset;
+    if (ret > 0 && off_out)
+        *off_out = out_offset;
+
+    file_put(in);
+    file_put(out);
+    return (ret == -1) ? -ENOTIMPL : ret;
+}
+
+// Copies from `in_fd` to `out_fd` without going through userspace. From `*offset` (updated
+// afterwards, the file position stays) if given, from in_fd's position otherwise.
+long sys_sendfile(int out_fd, int in_fd, int64_t *offset, size_t count)
+{
+    s_trace("sendfile(out_fd=%d, in_fd=%d, offset=0x%.16lx, count=%llu)", out_fd, in_fd, (uint64_t)offset, count);
+    if (!scheduler_get_current())
+        return -ESRCH;
+
+    return sys_splice_files(in_fd, offset, out_fd, NULL, count, "sendfile");
+}
+
+// General form of sendfile(), both sides may give an offset. No flags are supported yet.
+long sys_splice(int fd_in, int64_t *off_in, int fd_out, int64_t *off_out, size_t len, uint32_t flags)
+{
+    s_trace("splice(fd_in=%d, off_in=0x%.16lx, fd_out=%d, off_out=0x%.16lx, len=%llu, flags=%u)",
+            fd_in, (uint64_t)off_in, fd_out, (uint64_t)off_out, len, flags);
+    if (!scheduler_get_current())
+        return -ESRCH;
+    if (flags)
+        return -EINVAL;
+
+    return sys_splice_files(fd_in, off_in, fd_out, off_out, len, "splice");
+}
+
+// fds[0] is the read end, fds[1] the write end
+long sys_pipe(int fds[2])
+{
+    s_trace("pipe(fds=0x%.16lx)", (uint64_t)fds);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc)
+        return -ESRCH;
+    if (!sys_user_access(fds, 2 * sizeof(int), true))
+        return -EFAULT;
+
+    file_t *read_file, *write_file;
+    int ret = pipe_open(proc->whoami.uid, proc->whoami.gid, &read_file, &write_file);
+    if (ret < 0)
+        return ret;
+
+    int read_fd = fd_alloc(proc->files, read_file);
+    int write_fd = read_fd < 0 ? -1 : fd_alloc(proc->files, write_file);
+    if (write_fd < 0)
+    {
+        if (read_fd < 0)
+            file_put(read_file);
+        else
+            fd_free(proc->files, read_fd);
+        file_put(write_file);
+        return -ENOMEM;
+    }
+
+    fds[0] = read_fd;
+    fds[1] = write_fd;
+    return 0;
+}
+
+// `name` is "/something" inside /dev/shm, or NULL for an anonymous object that only lives as
+// long as it is open or mapped. `mode` takes VNODE_MODE_* bits for a newly created one.
+long sys_shm_open(const char *name, uint64_t flags, uint32_t mode)
+{
+    s_trace("shm_open(name=\"%s\", flags=%llu, mode=0x%x)", name ? name : "(anon)", flags, mode);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc)
+        return -ESRCH;
+    if (name && (uint64_t)name >= VMM_USER_END)
+        return -EFAULT;
+
+    file_t *file;
+    int ret = shm_open(name, flags, mode, proc->whoami.uid, proc->whoami.gid, &file);
+    if (ret < 0)
+        return ret;
+
+    int fd = fd_alloc(proc->files, file);
+    if (fd < 0)
+    {
+        file_put(file);
+        return -ENOMEM;
+    }
+    return fd;
+}
+
+long sys_shm_unlink(const char *name)
+{
+    s_trace("shm_unlink(name=\"%s\")", name);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc)
+        return -ESRCH;
+    if (!name || (uint64_t)name >= VMM_USER_END)
+        return -EFAULT;
+
+    return shm_unlink(name, proc->whoami.uid, proc->whoami.gid);
+}
+
+long sys_ftruncate(int fd, int64_t length)
+{
+    s_trace("ftruncate(fd=%d, length=%lld)", fd, length);
+    if (!scheduler_get_current())
+        return -ESRCH;
+    if (length < 0)
+        return -EINVAL;
+
+    file_t *file;
+    int ret = sys_get_file(fd, 2, "ftruncate", &file);
+    if (ret < 0)
+        return ret;
+
+    ret = vfs_truncate(file->node, length);
+    file_put(file);
+    return (ret == -1) ? -EINVAL : ret;
+}
+
+// Maps `fd` into the caller's address space, or anonymous memory with MAP_ANONYMOUS (`fd` is
+// ignored then). A mapping keeps its file alive by itself, the descriptor may be closed right
+// away.
+long sys_mmap(uint64_t addr, size_t length, int prot, int flags, int fd, int64_t offset)
+{
+    s_trace("mmap(addr=0x%.16llx, length=%llu, prot=%d, flags=0x%x, fd=%d, offset=%lld)", addr, length, prot, flags, fd, offset);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc || proc->kernel)
+        return -ESRCH;
+    if (offset < 0 || length == 0 || length > VMM_USER_END)
+        return -EINVAL;
+
+    file_t *file = NULL;
+    int ret = 0;
+    if ((flags & MAP_ANONYMOUS) && (flags & MAP_SHARED))
+    {
+        // Shared anonymous memory is an unnamed shm object, so fork() children see it too
+        ret = shm_open(NULL, 0, VNODE_MODE_RUSR | VNODE_MODE_WUSR, proc->whoami.uid, proc->whoami.gid, &file);
+        if (ret == 0 && vfs_truncate(file->node, ALIGN_UP(length, PAGE_SIZE)) < 0)
+            ret = -ENOMEM;
+        offset = 0;
+    }
+    else if (!(flags & MAP_ANONYMOUS))
+    {
+        ret = sys_get_file(fd, 1, "mmap", &file);
+        if (ret == 0 && (flags & MAP_SHARED) && (prot & PROT_WRITE) && !vfs_am_i_allowed(file->node, proc->whoami.uid, proc->whoami.gid, 2))
+            ret = -EACCES;
+    }
+
+    if (ret < 0)
+    {
+        file_put(file);
+        return ret;
+    }
+
+    mm_t *mm = proc->mm;
+    rwsem_write_lock(&mm->sem);
+    long start = mmap_map(mm->vma_ctx, addr, length, prot, flags, file ? file->node : NULL, offset);
+    if (start >= 0 && file && (flags & MAP_SHARED) && !vfs_am_i_allowed(file->node, proc->whoami.uid, proc->whoami.gid, 2))
+        vma_find(mm->vma_ctx, start)->write_denied = true;
+    rwsem_write_unlock(&mm->sem);
+    file_put(file);
+
+    if (start >= 0 && (flags & MAP_POPULATE))
+    {
+        rwsem_read_lock(&mm->sem);
+        mmap_populate(mm->vma_ctx, start, length, prot);
+        rwsem_read_unlock(&mm->sem);
+    }
+    return start;
+}
+
+long sys_munmap(uint64_t addr, size_t length)
+{
+    s_trace("munmap(addr=0x%.16llx, length=%llu)", addr, length);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc || proc->kernel)
+        return -ESRCH;
+
+    mm_t *mm = proc->mm;
+    rwsem_write_lock(&mm->sem);
+    int ret = mmap_unmap(mm->vma_ctx, addr, length);
+    rwsem_write_unlock(&mm->sem);
+    return ret;
+}
+
+long sys_mprotect(uint64_t addr, size_t length, int prot)
+{
+    s_trace("mprotect(addr=0x%.16llx, length=%llu, prot=%d)", addr, length, prot);
+    pcb_t *proc = scheduler_get_current();
+    if (!proc || proc->kernel)
+        return -ESRCH;
+
+    mm_t *mm = proc->mm;
+    rwsem_write_lock(&mm->sem);
+    int ret = mmap_protect(mm->vma_ctx, addr, length, prot);
+    rwsem_write_unlock(&mm->sem);
+    return ret;
+}
@@ -4,9 +4,12 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <dev/vfs.h>
+#include <proc/ring.h>
 
 // open() flags--
 #define O_CREATE BIT(0)
+#define O_APPEND BIT(1) // Every write goes to the end of the file
+#define O_EXCL BIT(2)   // With O_CREATE, fail if the file already exists
 // --end
 
 // Define syscall IDs
@@ -21,8 +24,40 @@
 #define SYS_ioctl 8
 #define SYS_getpid 9
 #define SYS_uname 10
+#define SYS_nanosleep 11
+#define SYS_clock_gettime 12
+#define SYS_fork 13
+#define SYS_execve 14
+#define SYS_clone 15
+#define SYS_arch_prctl 16
+#define SYS_gettid 17
+#define SYS_futex 18
+#define SYS_ring_setup 19
+#define SYS_ring_enter 20
+#define SYS_lseek 21
+#define SYS_pread 22
+#define SYS_pwrite 23
+#define SYS_readv 24
+#define SYS_writev 25
+#define SYS_sendfile 26
+#define SYS_splice 27
+#define SYS_pipe 28
+#define SYS_shm_open 29
+#define SYS_shm_unlink 30
+#define SYS_ftruncate 31
+#define SYS_mmap 32
+#define SYS_munmap 33
+#define SYS_mprotect 34
 
-#define SYSCALL_TABLE_SIZE 11
+#define SYSCALL_TABLE_SIZE 35
+
+// arch_prctl() codes
+#define ARCH_SET_FS 0x1002
+#define ARCH_GET_FS 0x1003
+
+// clock_gettime() clocks
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
 
 typedef struct
 {
@@ -35,43 +70,97 @@ typedef struct
     char os_type[64];
 } uname_t;
 
-typedef int (*syscall_fn_t)(...);
+typedef struct
+{
+    int64_t tv_sec;
+    int64_t tv_nsec;
+} timespec_t;
+
+typedef long (*syscall_fn_t)(...);
 extern syscall_fn_t syscall_table[];
 
-int sys_exit(int code);
-int sys_open(const char *path, uint64_t flags, uint8_t kind);
-int sys_close(int fd);
-int sys_write(int fd, void *buff, size_t size);
-int sys_read(int fd, void *buff, size_t size);
-int sys_stat(int fd, stat_t *stat);
-int sys_setuid(uint32_t uid);
-int sys_setgid(uint32_t gid);
-int sys_ioctl(int fd, uint32_t cmd, uint32_t arg);
-int sys_getpid();
-int sys_uname(uname_t *buf);
+long sys_exit(int code);
+long sys_open(const char *path, uint64_t flags, uint8_t kind);
+long sys_close(int fd);
+long sys_write(int fd, void *buff, size_t size);
+long sys_read(int fd, void *buff, size_t size);
+long sys_stat(int fd, stat_t *stat);
+long sys_setuid(uint32_t uid);
+long sys_setgid(uint32_t gid);
+long sys_ioctl(int fd, uint32_t cmd, uint32_t arg);
+long sys_getpid();
+long sys_uname(uname_t *buf);
+long sys_nanosleep(const timespec_t *req, timespec_t *rem);
+long sys_clock_gettime(uint64_t clock, timespec_t *tp);
+long sys_fork();
+long sys_execve(const char *path, const char *const argv[], const char *const envp[]);
+long sys_clone(uint64_t flags, uint64_t stack, uint32_t *parent_tid, uint32_t *child_tid, uint64_t tls);
+long sys_arch_prctl(int code, uint64_t addr);
+long sys_gettid();
+long sys_futex(uint32_t *uaddr, int op, uint32_t val, const timespec_t *timeout, uint32_t *uaddr2, uint32_t val3);
+long sys_ring_setup(uint32_t entries, uint32_t flags, ring_params_t *params);
+long sys_ring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+long sys_lseek(int fd, int64_t offset, int whence);
+long sys_pread(int fd, void *buff, size_t size, uint64_t offset);
+long sys_pwrite(int fd, void *buff, size_t size, uint64_t offset);
+long sys_readv(int fd, const iovec_t *iov, int iovcnt);
+long sys_writev(int fd, const iovec_t *iov, int iovcnt);
+long sys_sendfile(int out_fd, int in_fd, int64_t *offset, size_t count);
+long sys_splice(int fd_in, int64_t *off_in, int fd_out, int64_t *off_out, size_t len, uint32_t flags);
+long sys_pipe(int fds[2]);
+long sys_shm_open(const char *name, uint64_t flags, uint32_t mode);
+long sys_shm_unlink(const char *name);
+long sys_ftruncate(int fd, int64_t length);
+long sys_mmap(uint64_t addr, size_t length, int prot, int flags, int fd, int64_t offset);
+long sys_munmap(uint64_t addr, size_t length);
+long sys_mprotect(uint64_t addr, size_t length, int prot);
 
-#define SYSCALL_TO_STR(number)                                       \
-    ((number) == SYS_exit ? "exit" : (number) == SYS_open ? "open"   \
-                                 : (number) == SYS_close  ? "close"  \
-                                 : (number) == SYS_write  ? "write"  \
-                                 : (number) == SYS_read   ? "read"   \
-                                 : (number) == SYS_stat   ? "stat"   \
-                                 : (number) == SYS_setuid ? "setuid" \
-                                 : (number) == SYS_setgid ? "setgid" \
-                                 : (number) == SYS_ioctl  ? "ioctl"  \
-                                 : (number) == SYS_getpid ? "getpid" \
-                                 : (number) == SYS_uname  ? "uname"  \
-                                                          : "unknown")
+#define SYSCALL_TO_STR(number)                                                       \
+    ((number) == SYS_exit ? "exit" : (number) == SYS_open       ? "open"          \
+                                 : (number) == SYS_close         ? "close"         \
+                                 : (number) == SYS_write         ? "write"         \
+                                 : (number) == SYS_read          ? "read"          \
+                                 : (number) == SYS_stat          ? "stat"          \
+                                 : (number) == SYS_setuid        ? "setuid"        \
+                                 : (number) == SYS_setgid        ? "setgid"        \
+                                 : (number) == SYS_ioctl         ? "ioctl"         \
+                                 : (number) == SYS_getpid        ? "getpid"        \
+                                 : (number) == SYS_uname         ? "uname"         \
+                                 : (number) == SYS_nanosleep     ? "nanosleep"     \
+                                 : (number) == SYS_clock_gettime ? "clock_gettime" \
+                                 : (number) == SYS_fork          ? "fork"          \
+                                 : (number) == SYS_execve        ? "execve"        \
+                                 : (number) == SYS_clone         ? "clone"         \
+                                 : (number) == SYS_arch_prctl    ? "arch_prctl"    \
+                                 : (number) == SYS_gettid        ? "gettid"        \
+                                 : (number) == SYS_futex         ? "futex"         \
+                                 : (number) == SYS_ring_setup    ? "ring_setup"    \
+                                 : (number) == SYS_ring_enter    ? "ring_enter"    \
+                                 : (number) == SYS_lseek         ? "lseek"         \
+                                 : (number) == SYS_pread         ? "pread"         \
+                                 : (number) == SYS_pwrite        ? "pwrite"        \
+                                 : (number) == SYS_readv         ? "readv"         \
+                                 : (number) == SYS_writev        ? "writev"        \
+                                 : (number) == SYS_sendfile      ? "sendfile"      \
+                                 : (number) == SYS_splice        ? "splice"        \
+                                 : (number) == SYS_pipe          ? "pipe"          \
+                                 : (number) == SYS_shm_open      ? "shm_open"      \
+                                 : (number) == SYS_shm_unlink    ? "shm_unlink"    \
+                                 : (number) == SYS_ftruncate     ? "ftruncate"     \
+                                 : (number) == SYS_mmap          ? "mmap"          \
+                                 : (number) == SYS_munmap        ? "munmap"        \
+                                 : (number) == SYS_mprotect      ? "mprotect"      \
+                                                                 : "unknown")
 
 static inline long
 syscall(uint64_t number, uint64_t arg1, uint64_t arg2, uint64_t arg3)
 {
     long ret;
     __asm__ volatile(
-        "int $0x80"
+        "syscall"
         : "=a"(ret)
         : "a"(number), "D"(arg1), "S"(arg2), "d"(arg3)
-        : "memory");
+        : "rcx", "r11", "memory");
     return ret;
 }
 
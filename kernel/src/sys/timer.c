@@ -0,0 +1,214 @@
+#include <sys/timer.h>
+#include <dev/timer/pit.h>
+#include <dev/time/rtc.h>
+#include <lib/spinlock.h>
+#include <util/cpu.h>
+#include <lib/log.h>
+#include <mm/pmm.h>
+#include <stddef.h>
+
+static ktimer_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static uint64_t occupied[TIMER_WHEEL_LEVELS]; // Bit per non-empty slot
+static uint64_t wheel_now = 0;                // Next resolution unit to process
+static uint64_t pending_count = 0;
+static uint64_t realtime_base = 0; // Unix time at pit_init(), in seconds
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+timer_stats_t timer_stats = {0};
+
+static void timer_link(ktimer_t *timer, uint8_t level, uint8_t slot)
+{
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel[level][slot];
+    if (timer->next)
+        timer->next->prev = timer;
+    wheel[level][slot] = timer;
+    occupied[level] |= 1ull << slot;
+}
+
+static void timer_unlink(ktimer_t *timer)
+{
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        wheel[timer->level][timer->slot] = timer->next;
+
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    if (wheel[timer->level][timer->slot] == NULL)
+        occupied[timer->level] &= ~(1ull << timer->slot);
+}
+
+// Pick the level whose slot width fits the distance to the expiry, O(1)
+static void timer_enqueue(ktimer_t *timer)
+{
+    if ((int64_t)(timer->expires - wheel_now) < 0)
+    {
+        // Already due, run on the next unit processed
+        timer_link(timer, 0, wheel_now & TIMER_WHEEL_MASK);
+        return;
+    }
+
+    uint64_t delta = timer->expires - wheel_now;
+    for (uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        if (delta < (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+        {
+            timer_link(timer, level, (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+            return;
+        }
+    }
+
+    // Further out than the wheel spans, park it at the far end of the top level
+    uint8_t top = TIMER_WHEEL_LEVELS - 1;
+    timer->expires = wheel_now + (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    timer_link(timer, top, (timer->expires >> (TIMER_WHEEL_BITS * top)) & TIMER_WHEEL_MASK);
+}
+
+// Move every timer of a higher level slot down to the finer levels
+static void timer_cascade(uint8_t level, uint8_t slot)
+{
+    ktimer_t *timer = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~(1ull << slot);
+
+    while (timer)
+    {
+        ktimer_t *next = timer->next;
+        timer_enqueue(timer);
+        timer = next;
+    }
+}
+
+void timer_init()
+{
+    realtime_base = GET_CURRENT_UNIX_TIME() - pit_get_ns() / 1000000000ull;
+    wheel_now = pit_get_ns() / TIMER_RESOLUTION_NS;
+    trace("Initialized timer wheel, %d levels of %d slots, %lluns resolution", TIMER_WHEEL_LEVELS, TIMER_WHEEL_SIZE, TIMER_RESOLUTION_NS);
+}
+
+void timer_setup(ktimer_t *timer, void (*callback)(ktimer_t *), void *data)
+{
+    timer->callback = callback;
+    timer->data = data;
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->pending = false;
+}
+
+// (Re-)arm `timer` to fire at the absolute monotonic time `deadline_ns`
+void timer_add(ktimer_t *timer, uint64_t deadline_ns)
+{
+    // timer_run() takes the lock from the PIT IRQ
+    uint64_t flags = irq_save();
+    spinlock_acquire(&timer_lock);
+    if (timer->pending)
+    {
+        timer_unlink(timer);
+        pending_count--;
+    }
+
+    timer->expires_ns = deadline_ns;
+    timer->expires = DIV_ROUND_UP(deadline_ns, TIMER_RESOLUTION_NS); // Never fire early
+    timer->pending = true;
+    pending_count++;
+    timer_enqueue(timer);
+    spinlock_release(&timer_lock);
+    irq_restore(flags);
+}
+
+// Returns whether the timer was still pending
+bool timer_cancel(ktimer_t *timer)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&timer_lock);
+    bool was_pending = timer->pending;
+    if (was_pending)
+    {
+        timer_unlink(timer);
+        timer->pending = false;
+        pending_count--;
+    }
+    spinlock_release(&timer_lock);
+    irq_restore(flags);
+    return was_pending;
+}
+
+// Advance the wheel up to `now_ns`, firing everything that expired. Called from the PIT IRQ.
+void timer_run(uint64_t now_ns)
+{
+    uint64_t target = now_ns / TIMER_RESOLUTION_NS;
+
+    spinlock_acquire(&timer_lock);
+    while ((int64_t)(target - wheel_now) >= 0)
+    {
+        uint8_t slot = wheel_now & TIMER_WHEEL_MASK;
+
+        // Crossing a level boundary, pull the next slot of the level above down
+        for (uint8_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if (((wheel_now >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) != 0)
+                break;
+            timer_cascade(level, (wheel_now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+        }
+
+        // Step first, so callbacks re-arming an already due timer land in the next slot
+        wheel_now++;
+
+        ktimer_t *timer;
+        while ((timer = wheel[0][slot]) != NULL)
+        {
+            timer_unlink(timer);
+            timer->pending = false;
+            timer->next = NULL;
+            timer->prev = NULL;
+            pending_count--;
+
+            uint64_t late = now_ns > timer->expires_ns ? now_ns - timer->expires_ns : 0;
+            timer_stats.fired++;
+            timer_stats.total_late_ns += late;
+            timer_stats.max_late_ns = MAX(timer_stats.max_late_ns, late);
+
+            // Callbacks may re-arm timers
+            spinlock_release(&timer_lock);
+            timer->callback(timer);
+            spinlock_acquire(&timer_lock);
+        }
+    }
+    spinlock_release(&timer_lock);
+}
+
+// Earliest time the wheel needs to be run again, used to program the one-shot tick
+uint64_t timer_next_ns()
+{
+    if (pending_count == 0)
+        return TIMER_NEVER;
+
+    // Higher levels only need attention when the next one gets cascaded
+    uint64_t next = TIMER_NEVER;
+    for (uint8_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        if (occupied[level])
+        {
+            next = (wheel_now | TIMER_WHEEL_MASK) + 1;
+            break;
+        }
+    }
+
+    if (occupied[0])
+    {
+        uint8_t offset = wheel_now & TIMER_WHEEL_MASK;
+        uint64_t rotated = (occupied[0] >> offset) | (offset ? occupied[0] << (TIMER_WHEEL_SIZE - offset) : 0);
+        next = MIN(next, wheel_now + __builtin_ctzll(rotated));
+    }
+
+    return next == TIMER_NEVER ? TIMER_NEVER : next * TIMER_RESOLUTION_NS;
+}
+
+uint64_t timer_realtime_base()
+{
+    return realtime_base;
+}
@@ -0,0 +1,46 @@
+#ifndef SYS_TIMER_H
+#define SYS_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Hierarchical timer wheel, 6 levels of 64 slots. Level n slots are 64^n resolution units wide.
+#define TIMER_RESOLUTION_NS 1000000ull // 1ms
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 6
+#define TIMER_NEVER ((uint64_t)-1)
+
+typedef struct ktimer
+{
+    uint64_t expires;    // In resolution units
+    uint64_t expires_ns; // As requested, used for the jitter stats
+    void (*callback)(struct ktimer *timer);
+    void *data;
+
+    struct ktimer *next;
+    struct ktimer *prev;
+    uint8_t level;
+    uint8_t slot;
+    bool pending;
+} ktimer_t;
+
+typedef struct timer_stats
+{
+    uint64_t fired;
+    uint64_t total_late_ns;
+    uint64_t max_late_ns;
+} timer_stats_t;
+
+extern timer_stats_t timer_stats;
+
+void timer_init();
+void timer_setup(ktimer_t *timer, void (*callback)(ktimer_t *), void *data);
+void timer_add(ktimer_t *timer, uint64_t deadline_ns);
+bool timer_cancel(ktimer_t *timer);
+void timer_run(uint64_t now_ns);
+uint64_t timer_next_ns();
+uint64_t timer_realtime_base();
+
+#endif // SYS_TIMER_H
@@ -0,0 +1,207 @@
+#include <sys/vdso.h>
+#include <sys/syscall.h>
+#include <proc/scheduler.h>
+#include <dev/timer/pit.h>
+#include <sys/timer.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <lib/memory.h>
+#include <lib/log.h>
+#include <util/cpu.h>
+#include <stddef.h>
+
+#define VDSO_CALIBRATE_NS 100000000 // Of PIT ticks to measure the TSC against
+#define VDSO_SHIFT 32
+
+_Static_assert(offsetof(vdso_data_t, realtime_sec) == 40, "sys/vdso.S relies on the vdso_data_t layout");
+_Static_assert(offsetof(vdso_proc_t, pid) == 0, "sys/vdso.S relies on the vdso_proc_t layout");
+_Static_assert(SYS_clock_gettime == 12, "sys/vdso.S falls back to SYS_clock_gettime");
+
+extern uint8_t vdso_start[];
+extern uint8_t vdso_end[];
+
+static uint64_t vdso_data_frame = 0;
+static uint64_t vdso_code_frame = 0;
+static vdso_data_t *vdso_data = NULL;
+static uint64_t vdso_mult = 0;    // As calibrated, vdso_data->mult is this plus the slew
+static uint64_t vdso_last_ns = 0; // PIT time of the last update
+
+static uint64_t vdso_rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// a * b / c with a 128 bit intermediate, the result has to fit 64 bits
+static uint64_t vdso_mul_div(uint64_t a, uint64_t b, uint64_t c)
+{
+    uint64_t quot, rem;
+    __asm__("mulq %[b]\n\tdivq %[c]" : "=a"(quot), "=&d"(rem) : "a"(a), [b] "rm"(b), [c] "rm"(c) : "cc");
+    (void)rem;
+    return quot;
+}
+
+// Time as userspace would compute it right now from the data page
+static uint64_t vdso_extrapolate(uint64_t tsc)
+{
+    unsigned __int128 delta = (unsigned __int128)(tsc - vdso_data->tsc_base) * vdso_data->mult;
+    return vdso_data->ns_base + (uint64_t)(delta >> vdso_data->shift);
+}
+
+// Sets up the shared pages. The clock only becomes usable once vdso_update_time() measured
+// the TSC against the PIT, until then clock_gettime() traps.
+void vdso_init()
+{
+    vdso_data_frame = (uint64_t)pmm_request_page();
+    vdso_code_frame = (uint64_t)pmm_request_page();
+    if (!vdso_data_frame || !vdso_code_frame)
+    {
+        error("Failed to allocate the vDSO");
+        vdso_code_frame = 0;
+        return;
+    }
+
+    memcpy(HIGHER_HALF(vdso_code_frame), vdso_start, MIN((uint64_t)(vdso_end - vdso_start), PAGE_SIZE));
+    vdso_data = (vdso_data_t *)HIGHER_HALF(vdso_data_frame);
+    trace("vDSO at 0x%.16llx, %llu bytes of code", VDSO_BASE, (uint64_t)(vdso_end - vdso_start));
+}
+
+// First VDSO_CALIBRATE_NS of PIT ticks, to learn the TSC frequency without busy waiting
+static bool vdso_calibrate(uint64_t tsc, uint64_t ns)
+{
+    static uint64_t tsc_start = 0;
+    static uint64_t ns_start = 0;
+    if (!tsc_start)
+    {
+        tsc_start = tsc;
+        ns_start = ns;
+        return false;
+    }
+    if (ns - ns_start < VDSO_CALIBRATE_NS)
+        return false;
+
+    // The tick may have been stopped for a long idle stretch, so the product can easily take
+    // more than 64 bits (a 5 GHz TSC gets there in under 4 seconds)
+    uint64_t hz = vdso_mul_div(tsc - tsc_start, 1000000000ull, ns - ns_start);
+    if (hz == 0)
+    {
+        warning("TSC doesn't tick, vDSO clock_gettime() will keep using the syscall");
+        tsc_start = 0;
+        return false;
+    }
+
+    vdso_mult = (1000000000ull << VDSO_SHIFT) / hz;
+    vdso_last_ns = ns;
+    vdso_data->shift = VDSO_SHIFT;
+    vdso_data->mult = vdso_mult;
+    vdso_data->tsc_base = tsc;
+    vdso_data->ns_base = ns;
+    vdso_data->realtime_sec = timer_realtime_base();
+    __atomic_store_n(&vdso_data->flags, VDSO_TIME_VALID, __ATOMIC_RELEASE);
+    trace("vDSO clock ready, TSC at %llu kHz", hz / 1000);
+    return true;
+}
+
+// Re-anchors the data page on the PIT, every tick. Userspace extrapolates from the TSC in
+// between, and its clock must never go backwards. So a clock that fell behind the PIT is
+// stepped forward, while one that ran ahead keeps its time but runs slower until the next
+// update, by as much as it got ahead over the last interval (at most half speed).
+void vdso_update_time()
+{
+    if (!vdso_data)
+        return;
+
+    uint64_t flags = irq_save();
+    uint64_t tsc = vdso_rdtsc();
+    uint64_t ns = pit_get_ns();
+    if (!(vdso_data->flags & VDSO_TIME_VALID))
+    {
+        vdso_calibrate(tsc, ns);
+        irq_restore(flags);
+        return;
+    }
+
+    uint64_t interval = ns - vdso_last_ns;
+    uint64_t now = vdso_extrapolate(tsc);
+    uint64_t mult = vdso_mult;
+    if (now > ns && interval)
+        mult = vdso_mul_div(vdso_mult, interval - MIN(now - ns, interval / 2), interval);
+    vdso_last_ns = ns;
+
+    __atomic_store_n(&vdso_data->seq, vdso_data->seq + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    vdso_data->tsc_base = tsc;
+    vdso_data->ns_base = MAX(ns, now);
+    vdso_data->mult = mult;
+    __atomic_store_n(&vdso_data->seq, vdso_data->seq + 1, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+static uint64_t vdso_fault(vma_region_t *region, uint64_t index, bool *shared)
+{
+    (void)index;
+    uint64_t frame = (uint64_t)region->data;
+    pmm_frame_ref(frame);
+    *shared = true;
+    return frame;
+}
+
+static const vma_ops_t vdso_ops = {
+    .fault = vdso_fault,
+};
+
+// Adds the vDSO to a fresh address space, see exec_load(). The process page starts out
+// empty, vdso_update_proc() fills it in once it is known who runs there.
+int vdso_map(vma_context_t *ctx)
+{
+    if (!vdso_code_frame)
+        return 0;
+
+    uint64_t proc = (uint64_t)pmm_request_page();
+    if (!proc)
+        return -ENOMEM;
+
+    if (!vma_insert(ctx, VDSO_DATA, 1, VMM_PRESENT | VMM_USER | VMM_NX, &vdso_ops, (void *)vdso_data_frame) ||
+        !vma_insert(ctx, VDSO_PROC, 1, VMM_PRESENT | VMM_USER | VMM_NX, NULL, NULL) ||
+        !vma_insert(ctx, VDSO_CODE, 1, VMM_PRESENT | VMM_USER, &vdso_ops, (void *)vdso_code_frame))
+    {
+        pmm_release_page((void *)proc);
+        return -ENOMEM;
+    }
+
+    vmm_map(ctx->pagemap, VDSO_PROC, proc, VMM_PRESENT | VMM_USER | VMM_NX);
+    return 0;
+}
+
+// Refreshes what getpid() and friends see in `proc`'s address space. A fork()ed child
+// still shares its parent's page at first, it gets its own here.
+void vdso_update_proc(struct pcb *proc)
+{
+    uint64_t *pagemap = proc->mm->pagemap;
+    uint64_t frame = virt_to_phys(pagemap, VDSO_PROC);
+    if (!frame)
+        return;
+
+    if (pmm_frame_refcount(frame) > 1)
+    {
+        uint64_t copy = (uint64_t)pmm_request_page();
+        if (!copy)
+        {
+            error("Out of memory for the vDSO of process %d", proc->pid);
+            return;
+        }
+
+        uint64_t flags = irq_save();
+        vmm_map(pagemap, VDSO_PROC, copy, VMM_PRESENT | VMM_USER | VMM_NX);
+        __asm__ volatile("invlpg (%0)" : : "r"(VDSO_PROC) : "memory");
+        irq_restore(flags);
+        pmm_release_page((void *)frame);
+        frame = copy;
+    }
+
+    vdso_proc_t *info = (vdso_proc_t *)HIGHER_HALF(frame);
+    info->pid = proc->tgid;
+    info->uid = proc->whoami.uid;
+    info->gid = proc->whoami.gid;
+}
@@ -0,0 +1,50 @@
+#ifndef SYS_VDSO_H
+#define SYS_VDSO_H
+
+#include <stdint.h>
+#include <mm/vma.h>
+
+// Three pages mapped into every exec()ed process, read-only for it:
+//   VDSO_DATA  time keeping (vdso_data_t), the same frame for everyone
+//   VDSO_PROC  the process (vdso_proc_t), one per address space
+//   VDSO_CODE  entry points below, position independent, also shared
+#define VDSO_BASE 0x00007ffffff00000
+#define VDSO_DATA VDSO_BASE
+#define VDSO_PROC (VDSO_BASE + PAGE_SIZE)
+#define VDSO_CODE (VDSO_BASE + 2 * PAGE_SIZE)
+#define VDSO_PAGES 3
+
+// Entry points, as offsets into VDSO_CODE (see sys/vdso.S)
+#define VDSO_CLOCK_GETTIME 0x00 // int clock_gettime(clockid, timespec_t *), falls back to the syscall
+#define VDSO_GETPID 0x08        // int getpid()
+
+#define VDSO_TIME_VALID (1 << 0) // TSC calibrated, otherwise clock_gettime() always traps
+
+// Read under `seq`: odd while the kernel is updating it, retry if it changed meanwhile.
+// Offsets are relied upon by sys/vdso.S.
+typedef struct vdso_data
+{
+    volatile uint32_t seq;
+    uint32_t flags;
+    uint64_t tsc_base;     // Anchor, refreshed every tick
+    uint64_t ns_base;      // Monotonic time at tsc_base
+    uint64_t mult;         // ns = ns_base + ((tsc - tsc_base) * mult) >> shift
+    uint64_t shift;        //
+    uint64_t realtime_sec; // CLOCK_REALTIME minus CLOCK_MONOTONIC, in seconds
+} vdso_data_t;
+
+typedef struct vdso_proc
+{
+    uint64_t pid; // The tgid, what getpid() returns
+    uint64_t uid;
+    uint64_t gid;
+} vdso_proc_t;
+
+struct pcb;
+
+void vdso_init();
+void vdso_update_time();
+int vdso_map(vma_context_t *ctx);
+void vdso_update_proc(struct pcb *proc);
+
+#endif // SYS_VDSO_H
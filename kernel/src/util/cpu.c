@@ -16,4 +16,46 @@
 void cpuid(uint32_t eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
 {
     asm volatile("cpuid" : "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(eax));
-}
\ No newline at end of file
+}
+
+// Disables interrupts, returning the previous RFLAGS for irq_restore()
+uint64_t irq_save(void)
+{
+    uint64_t flags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void irq_restore(uint64_t flags)
+{
+    if (flags & RFLAGS_IF)
+        __asm__ volatile("sti" : : : "memory");
+}
+
+void irq_enable(void)
+{
+    __asm__ volatile("sti" : : : "memory");
+}
+
+void irq_disable(void)
+{
+    __asm__ volatile("cli" : : : "memory");
+}
+
+// No SMP bring-up yet, everything runs on the BSP
+uint32_t cpu_id(void)
+{
+    return 0;
+}
+
+uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
@@ -3,8 +3,29 @@
 
 #include <stdint.h>
 
+#define RFLAGS_TF (1 << 8)  // Single step
+#define RFLAGS_IF (1 << 9)  // Interrupts enabled
+#define RFLAGS_DF (1 << 10) // String ops go backwards
+#define RFLAGS_AC (1 << 18) // Alignment check / SMAP override
+
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+#define MSR_FS_BASE 0xC0000100
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+#define EFER_SCE (1 << 0) // SYSCALL/SYSRET enable
+
 [[noreturn]] void hcf(void);
 [[noreturn]] void hlt(void);
 void cpuid(uint32_t eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+uint64_t irq_save(void);
+void irq_restore(uint64_t flags);
+void irq_enable(void);
+void irq_disable(void);
+uint32_t cpu_id(void);
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
 
 #endif // UTIL_CPU_H
@@ -14,6 +14,16 @@ typedef unsigned int errno_t;
 #define ENOTTY 8   // Inappropriate ioctl for device
 #define ESRCH 9    // No such process
 #define ENOMEM 10  // No memory
+// 11 was ERESTART, gone since syscalls block in place
+#define ETIMEDOUT 12 // Timed out
+#define E2BIG 13   // Argument list too long
+#define ENOEXEC 14 // Exec format error
+#define EAGAIN 15  // Try again
+#define EBUSY 16   // Device or resource busy
+#define EPIPE 17   // Broken pipe
+#define EEXIST 18  // File exists
+#define ENODEV 19  // No such device
+#define ETXTBSY 20 // Text file busy
 
 #define ERRNO_TO_STR(errno)                                                             \
     ((errno) == EOK ? "No error" : (errno) == ENOENT ? "No such file or directory"      \
@@ -26,6 +36,15 @@ typedef unsigned int errno_t;
                                : (errno) == ENOTTY   ? "Inappropriate ioctl for device" \
                                : (errno) == ESRCH    ? "No such process"                \
                                : (errno) == ENOMEM   ? "No memory"                      \
+                               : (errno) == ETIMEDOUT ? "Timed out"                     \
+                               : (errno) == E2BIG    ? "Argument list too long"         \
+                               : (errno) == ENOEXEC  ? "Exec format error"              \
+                               : (errno) == EAGAIN   ? "Try again"                      \
+                               : (errno) == EBUSY    ? "Device or resource busy"        \
+                               : (errno) == EPIPE    ? "Broken pipe"                    \
+                               : (errno) == EEXIST   ? "File exists"                    \
+                               : (errno) == ENODEV   ? "No such device"                 \
+                               : (errno) == ETXTBSY  ? "Text file busy"                 \
                                                      : "Unknown error")
 
 #endif // PROC_ERRNO_H